@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+
+'''Reads the histograms WbLSdaq fills as it decodes with histograms set.
+
+    ./histograms.py /wblsdaq_hist
+
+prints the entries, rate, and mean of each histogram. In other monitors, 
+Histograms(name).snapshot() returns the totals of every histogram, copied
+consistently card by card while the DAQ keeps merging into them.'''
+
+import os
+import sys
+import time
+import mmap
+import struct
+import argparse
+import numpy as np
+
+# layouts of histogram_header, histogram_card, and histogram_entry
+HEADER = struct.Struct('=8sIIIIQd')
+CARD = struct.Struct('=32sQdQ')
+ENTRY = struct.Struct('=64sIIddQ')
+
+class Histograms:
+    
+    def __init__(self, name):
+        fd = os.open('/dev/shm/'+name.lstrip('/'), os.O_RDONLY)
+        try:
+            self.mem = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+        finally:
+            os.close(fd)
+        magic, version, ncards, nhists, _, self.bins_offset, self.started = HEADER.unpack_from(self.mem, 0)
+        if magic != b'WbLShist' or version != 1:
+            raise ValueError(name+' is not a WbLSdaq histogram feed')
+        self.cards = []
+        for i in range(ncards):
+            card = CARD.unpack_from(self.mem, HEADER.size+i*CARD.size)[0]
+            self.cards.append(card.split(b'\0')[0].decode())
+        self.hists = []
+        for i in range(nhists):
+            hname, card, nbins, lo, hi, offset = ENTRY.unpack_from(self.mem, HEADER.size+ncards*CARD.size+i*ENTRY.size)
+            self.hists.append((hname.split(b'\0')[0].decode(), card, nbins, lo, hi, offset))
+    
+    def _seq(self, card):
+        return struct.unpack_from('=Qd', self.mem, HEADER.size+card*CARD.size+32)
+    
+    def snapshot(self):
+        '''Returns {name: (lo, hi, counts, seconds)} where counts has the bins
+        under lo and over hi first and last, and seconds is how long after
+        the histograms started they were last merged.'''
+        result = {}
+        for card in range(len(self.cards)):
+            hists = [h for h in self.hists if h[1] == card]
+            while True:
+                seq, updated = self._seq(card)
+                if seq % 2:
+                    time.sleep(0.001)
+                    continue
+                copies = [np.frombuffer(self.mem, dtype=np.uint64, count=nbins+2, offset=self.bins_offset+8*offset).copy() for _, _, nbins, _, _, offset in hists]
+                if self._seq(card)[0] == seq:
+                    break
+            for (name, _, _, lo, hi, _), counts in zip(hists, copies):
+                result[name] = (lo, hi, counts, updated)
+        return result
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Print histogram summaries from a running WbLSdaq')
+    parser.add_argument('name', help='histograms name from the RUN table')
+    parser.add_argument('--interval', type=float, default=5.0, help='seconds between reports')
+    args = parser.parse_args()
+    
+    hists = Histograms(args.name)
+    last = {}
+    while True:
+        for name, (lo, hi, counts, seconds) in sorted(hists.snapshot().items()):
+            entries = int(counts.sum())
+            inside = counts[1:-1]
+            centers = lo + (np.arange(len(inside))+0.5)*(hi-lo)/len(inside)
+            mean = float((inside*centers).sum()/inside.sum()) if inside.sum() else 0.0
+            before, then = last.get(name, (0, 0.0))
+            rate = (entries-before)/(seconds-then) if seconds > then else 0.0
+            last[name] = (entries, seconds)
+            print('%s: %d entries, %.1f Hz, mean %g, %d under, %d over' % (name, entries, rate, mean, counts[0], counts[-1]))
+        sys.stdout.flush()
+        time.sleep(args.interval)
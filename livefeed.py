@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+
+'''Reads the events WbLSdaq publishes to shared memory with live_feed set.
+
+    ./livefeed.py /wblsdaq [--prescale N] [--rate K]
+
+prints the event rate of each channel. In other monitors, LiveFeed(name).poll()
+returns the records published since the last poll. Each reader takes a slot of
+the feed's consumer table and is only sent every prescale-th event, and at
+most rate records per second of each channel, which sample() changes at any
+time. Readers never hold up the DAQ; records overwritten before they were read
+are counted in missed.'''
+
+import os
+import sys
+import time
+import mmap
+import struct
+import argparse
+import fcntl
+import numpy as np
+
+# layouts of live_feed_header, live_feed_consumer, live_feed_channel, and live_feed_record
+HEADER = struct.Struct('=8sIIQQQQQQ')
+CONSUMER = struct.Struct('=iIdQ')
+CHANNEL = struct.Struct('=48sII')
+RECORD = struct.Struct('=IHHIIQQ')
+CONSUMERS = 32
+WRAP = 0xFFFF
+VERSION = 2
+OFF_NCHANNELS, OFF_RESERVE, OFF_HEAD, OFF_RECORDS, OFF_BATCH = 12, 32, 40, 48, 56
+OFF_SENT = 16
+
+class LiveFeed:
+    
+    def __init__(self, name, prescale=1, rate=0.0):
+        self.fd = os.open('/dev/shm/'+name.lstrip('/'), os.O_RDWR)
+        self.mem = mmap.mmap(self.fd, 0, mmap.MAP_SHARED, mmap.PROT_READ|mmap.PROT_WRITE)
+        magic, version = HEADER.unpack_from(self.mem, 0)[:2]
+        if magic != b'WbLSfeed' or version != VERSION:
+            raise ValueError(name+' is not a WbLSdaq live feed')
+        self.ring_offset, self.ring_size = HEADER.unpack_from(self.mem, 0)[3:5]
+        self.channels = []
+        self.slot = self._claim(prescale, rate)
+        # only what is published after the slot is claimed belongs to it
+        self.tail = self._u64(OFF_HEAD)
+        self.read = 0
+        self.sent = self._u64(self._consumer(self.slot)+OFF_SENT)
+        self.missed = 0
+    
+    def _consumer(self, slot):
+        return HEADER.size + slot*CONSUMER.size
+    
+    def _claim(self, prescale, rate):
+        '''Takes a slot that is free or whose reader has died, locking the
+        consumer table against other readers doing the same.'''
+        fcntl.lockf(self.fd, fcntl.LOCK_EX, CONSUMERS*CONSUMER.size, HEADER.size)
+        try:
+            for slot in range(CONSUMERS):
+                pid = struct.unpack_from('=i', self.mem, self._consumer(slot))[0]
+                if pid:
+                    try:
+                        os.kill(pid, 0)
+                        continue
+                    except ProcessLookupError:
+                        pass
+                    except PermissionError:
+                        continue
+                self.slot = slot
+                self.sample(prescale, rate)
+                struct.pack_into('=i', self.mem, self._consumer(slot), os.getpid())
+                return slot
+        finally:
+            fcntl.lockf(self.fd, fcntl.LOCK_UN, CONSUMERS*CONSUMER.size, HEADER.size)
+        raise RuntimeError('all %d consumer slots of the live feed are taken' % CONSUMERS)
+    
+    def sample(self, prescale=1, rate=0.0):
+        '''Asks for only events numbered a multiple of prescale, and at most
+        rate records per second of each channel (0 for no limit).'''
+        struct.pack_into('=Id', self.mem, self._consumer(self.slot)+4, max(int(prescale), 1), float(rate))
+    
+    def close(self):
+        '''Frees the consumer slot, which the DAQ also does once this process
+        is gone.'''
+        if self.mem is not None:
+            struct.pack_into('=i', self.mem, self._consumer(self.slot), 0)
+            self.mem.close()
+            os.close(self.fd)
+            self.mem = None
+        
+    def _u64(self, offset):
+        return struct.unpack_from('=Q', self.mem, offset)[0]
+        
+    def _update_channels(self):
+        nchannels = struct.unpack_from('=I', self.mem, OFF_NCHANNELS)[0]
+        while len(self.channels) < nchannels:
+            name, nsamples, bits = CHANNEL.unpack_from(self.mem, self._consumer(CONSUMERS)+len(self.channels)*CHANNEL.size)
+            self.channels.append((name.split(b'\0')[0].decode(), nsamples, bits))
+    
+    def poll(self):
+        '''Returns (channel name, pattern, time, event, samples) of each
+        record published since the last poll.'''
+        head = self._u64(OFF_HEAD)
+        sent = self._u64(self._consumer(self.slot)+OFF_SENT)
+        mask = 1 << self.slot
+        events = []
+        if head - self.tail > self.ring_size:
+            self.tail = self._u64(OFF_BATCH)
+        while self.tail < head:
+            pos = self.tail % self.ring_size
+            if self.ring_size - pos < RECORD.size:
+                self.tail += self.ring_size - pos
+                continue
+            start = self.ring_offset + pos
+            size, channel, pattern, consumers, _, trigger_time, event = RECORD.unpack_from(self.mem, start)
+            data = self.mem[start+RECORD.size:start+size]
+            if self._u64(OFF_RESERVE) > self.tail + self.ring_size:
+                # lapped while copying, so skip to the latest batch
+                self.tail = self._u64(OFF_BATCH)
+                head = self._u64(OFF_HEAD)
+                continue
+            self.tail += size
+            if channel == WRAP or not consumers & mask:
+                continue
+            if channel >= len(self.channels):
+                self._update_channels()
+            name, nsamples, bits = self.channels[channel]
+            events.append((name, pattern, trigger_time, event, np.frombuffer(data, dtype=np.uint16, count=nsamples)))
+        self.read += len(events)
+        self.missed = max(sent - self.sent - self.read, self.missed)
+        return events
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Print event rates from a WbLSdaq live feed')
+    parser.add_argument('name', help='live_feed name from the RUN table')
+    parser.add_argument('--interval', type=float, default=1.0, help='seconds between reports')
+    parser.add_argument('--prescale', type=int, default=1, help='only every Nth event of each card')
+    parser.add_argument('--rate', type=float, default=0.0, help='at most this many events per second of each channel')
+    args = parser.parse_args()
+    
+    feed = LiveFeed(args.name, args.prescale, args.rate)
+    counts = {}
+    last = time.time()
+    while True:
+        for name, pattern, trigger_time, event, samples in feed.poll():
+            counts[name] = counts.get(name, 0) + 1
+        now = time.time()
+        if now - last >= args.interval:
+            for name in sorted(counts):
+                print('%s: %.1f Hz' % (name, counts[name]/(now-last)))
+            print('missed %d records' % feed.missed)
+            sys.stdout.flush()
+            counts = {}
+            last = now
+        time.sleep(0.01)
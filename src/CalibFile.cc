@@ -0,0 +1,120 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "CalibFile.hh"
+
+using namespace std;
+
+static const char calib_magic[8] = {'D','R','S','4','C','A','L','\0'};
+static const uint32_t calib_version = 2;
+
+CalibFile::CalibFile(const string &fname) {
+    int fd = open(fname.c_str(),O_RDONLY);
+    if (fd < 0) throw runtime_error("Could not open calibration file " + fname);
+    struct stat st;
+    if (fstat(fd,&st)) {
+        close(fd);
+        throw runtime_error("Could not stat calibration file " + fname);
+    }
+    size = st.st_size;
+    if (size < sizeof(calib_file_header)) {
+        close(fd);
+        throw runtime_error("Calibration file " + fname + " is truncated");
+    }
+    void *addr = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (addr == MAP_FAILED) throw runtime_error("Could not map calibration file " + fname);
+    map = (const char*)addr;
+    
+    const calib_file_header &hdr = header();
+    if (memcmp(hdr.magic,calib_magic,sizeof(calib_magic))) {
+        munmap((void*)map,size);
+        throw runtime_error(fname + " is not a calibration file");
+    }
+    if (hdr.version != calib_version) {
+        munmap((void*)map,size);
+        throw runtime_error(fname + " has calibration version " + to_string(hdr.version) + " (expected " + to_string(calib_version) + ")");
+    }
+    for (size_t freq = 0; freq < 3; freq++) {
+        if (hdr.tables[freq] % 8 || hdr.tables[freq] + sizeof(calib_file_tables) > size) {
+            munmap((void*)map,size);
+            throw runtime_error("Calibration file " + fname + " is truncated");
+        }
+    }
+}
+
+CalibFile::~CalibFile() {
+    munmap((void*)map,size);
+}
+
+void CalibFile::write(const string &fname, const calib_file_header &_header, CAEN_DGTZ_DRS4Correction_t *corr[3]) {
+    calib_file_header header = _header;
+    memcpy(header.magic,calib_magic,sizeof(calib_magic));
+    header.version = calib_version;
+    header.reserved = 0;
+    uint64_t offset = sizeof(calib_file_header);
+    for (size_t freq = 0; freq < 3; freq++) {
+        if (corr[freq]) {
+            header.tables[freq] = offset;
+            offset += sizeof(calib_file_tables);
+        } else {
+            header.tables[freq] = 0;
+        }
+    }
+    
+    //write beside the target and rename so readers never see a partial file
+    const string tmpname = fname + ".tmp";
+    ofstream out(tmpname, ios::binary | ios::trunc);
+    if (!out.good()) throw runtime_error("Could not open calibration file " + tmpname);
+    out.write((const char*)&header,sizeof(header));
+    
+    calib_file_tables *tables = new calib_file_tables;
+    for (size_t freq = 0; freq < 3; freq++) {
+        if (!corr[freq]) continue;
+        for (size_t gr = 0; gr < 4; gr++) {
+            memcpy(tables->cell[gr],corr[freq][gr].cell,sizeof(tables->cell[gr]));
+            memcpy(tables->nsample[gr],corr[freq][gr].nsample,sizeof(tables->nsample[gr]));
+            memcpy(tables->time[gr],corr[freq][gr].time,sizeof(tables->time[gr]));
+        }
+        out.write((const char*)tables,sizeof(calib_file_tables));
+    }
+    delete tables;
+    
+    out.close();
+    if (out.fail()) throw runtime_error("Could not write calibration file " + tmpname);
+    if (rename(tmpname.c_str(),fname.c_str())) throw runtime_error("Could not replace calibration file " + fname);
+}
+
+bool isCalibFile(const string &fname) {
+    char magic[8];
+    ifstream in(fname, ios::binary);
+    in.read(magic,sizeof(magic));
+    return in.good() && !memcmp(magic,calib_magic,sizeof(magic));
+}
+
+string calibFileName(const string &dir, uint32_t serial, uint32_t freq) {
+    return dir + "/v1742_" + to_string(serial) + "_freq" + to_string(freq) + ".cal";
+}
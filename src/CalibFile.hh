@@ -0,0 +1,85 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <cstdint>
+
+#include <CAENDigitizer.h>
+
+#ifndef CalibFile__hh
+#define CalibFile__hh
+
+// DRS4 tables of all four V1742 groups at one sample frequency, stored
+// exactly this way on disk so a mapped file can be used without parsing
+typedef struct {
+    int16_t cell[4][9][1024]; // cell offsets (ADC counts)
+    int8_t nsample[4][9][1024]; // sequential sample offsets (ADC counts)
+    float time[4][1024]; // cell delays (ns)
+} calib_file_tables;
+
+// Small fixed header at the start of every calibration file
+typedef struct {
+    char magic[8]; // "DRS4CAL"
+    uint32_t version; // layout version
+    uint32_t serial; // board serial number
+    char roc_firmware[20]; // firmware when the tables were read
+    char amc_firmware[40];
+    uint32_t reserved;
+    int64_t created; // unix timestamp when the tables were read
+    uint64_t tables[3]; // file offset of calib_file_tables for each V1742SampleFreq (0 if absent)
+} calib_file_header;
+
+// Read-only memory map of a calibration file
+class CalibFile {
+
+    public:
+    
+        // Maps fname, throwing runtime_error if it is not a valid calibration file
+        CalibFile(const std::string &fname);
+        
+        virtual ~CalibFile();
+        
+        inline const calib_file_header& header() {
+            return *(const calib_file_header*)map;
+        }
+        
+        inline bool hasTables(uint32_t freq) {
+            return freq < 3 && header().tables[freq];
+        }
+        
+        inline const calib_file_tables& tables(uint32_t freq) {
+            return *(const calib_file_tables*)(map + header().tables[freq]);
+        }
+        
+        // Writes tables for each frequency (NULL if absent) from the four 
+        // groups of CAEN corrections, replacing any existing file
+        static void write(const std::string &fname, const calib_file_header &header, CAEN_DGTZ_DRS4Correction_t *corr[3]);
+        
+    protected:
+    
+        const char *map;
+        size_t size;
+
+};
+
+// True if fname starts with the calibration file magic (as opposed to JSON)
+bool isCalibFile(const std::string &fname);
+
+// Cache file name for a board serial and sample frequency in dir
+std::string calibFileName(const std::string &dir, uint32_t serial, uint32_t freq);
+
+#endif
@@ -34,6 +34,10 @@ Digitizer::~Digitizer() {
 
 }
 
+bool Digitizer::retune(DigitizerSettings &current, DigitizerSettings &next, const std::vector<std::string> &keys) {
+    return false;
+}
+
 size_t Digitizer::readoutBLT(char *buffer, size_t buffer_size) {
     size_t offset = 0, size = 0;
     while (offset < buffer_size && (size = readBLT(0x0000, buffer+offset, 4093))) {
@@ -42,4 +46,30 @@ size_t Digitizer::readoutBLT(char *buffer, size_t buffer_size) {
     return offset;
 }
 
-void Decoder::dispatch(int nfd, int *fds) { }
+Decoder::Decoder() : chunk(0), histograms(NULL) {
+
+}
+
+Decoder::~Decoder() {
+    if (histograms) delete histograms;
+}
+
+void Decoder::writeOut(H5::H5File &file, size_t nEvents) {
+    OutputBatch batch;
+    writeOut(batch,nEvents);
+    batch.write(file);
+}
+
+void Decoder::dispatch(LiveFeed &feed) { }
+
+bool Decoder::getPatterns(size_t nEvents, std::vector<uint16_t> &patterns) {
+    return false;
+}
+
+void Decoder::enableHistograms() {
+    if (!histograms) histograms = newHistograms();
+}
+
+HistogramSet* Decoder::newHistograms() {
+    return NULL;
+}
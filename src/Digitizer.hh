@@ -19,6 +19,10 @@
 
 #include "VMECard.hh"
 #include "Buffer.hh"
+#include "Output.hh"
+#include "RawFile.hh"
+#include "LiveFeed.hh"
+#include "Histograms.hh"
 #include "H5Cpp.h"
 
 #ifndef Digitizer__hh
@@ -50,6 +54,11 @@ class Digitizer : public VMECard {
     
         virtual bool program(DigitizerSettings &settings) = 0;
         
+        // On a stopped card programmed with current, copies what the table
+        // keys set from next into current and rewrites only those registers.
+        // Returns false, writing nothing, if a key needs a full program.
+        virtual bool retune(DigitizerSettings &current, DigitizerSettings &next, const std::vector<std::string> &keys);
+        
         virtual bool checkTemps(std::vector<uint32_t> &temps, uint32_t danger) = 0;
         
         virtual void softTrig() = 0;
@@ -80,14 +89,55 @@ class Decoder {
     
     public:
         
+        Decoder();
+        
+        virtual ~Decoder();
+        
+        // With chunk > 0, writeOut appends to chunked datasets that grow 
+        // across calls on the same file instead of creating fixed ones
+        inline void setChunking(size_t _chunk) {
+            chunk = _chunk;
+        }
+        
         virtual void decode(Buffer &buffer) = 0;
         
+        // Checks the boundaries of readout data without decoding it, adding
+        // an index entry per event with offsets relative to data. Returns
+        // the triggers seen and throws if the data is malformed.
+        virtual size_t index(const char *data, size_t size, std::vector<raw_index_entry> &entries) = 0;
+        
         virtual size_t eventsReady() = 0;
         
-        virtual void writeOut(H5::H5File &file, size_t nEvents) = 0;
+        // Records the first nEvents ready events into batch and drops them
+        virtual void writeOut(OutputBatch &batch, size_t nEvents) = 0;
+        
+        // Writes the first nEvents ready events to file and drops them
+        void writeOut(H5::H5File &file, size_t nEvents);
+        
+        // Copies the events ready since the last call into feed, leaving
+        // them to be published by the caller
+        virtual void dispatch(LiveFeed &feed);
+        
+        // LVDS patterns of the first nEvents ready events for event building
+        // returns false if this decoder does not record patterns
+        virtual bool getPatterns(size_t nEvents, std::vector<uint16_t> &patterns);
+        
+        // Fills histograms of the events decoded from now on, if the decoder
+        // has any to fill
+        void enableHistograms();
+        
+        // NULL unless enableHistograms found histograms to fill
+        inline HistogramSet* getHistograms() {
+            return histograms;
+        }
+        
+    protected:
+    
+        size_t chunk;
+        HistogramSet *histograms;
         
-        // length, lvdsidx, dsize, nsamples, samples[], strlen, strname[]
-        virtual void dispatch(int nfd, int *fds);
+        // Defines the histograms of the decoder's card, or returns NULL
+        virtual HistogramSet* newHistograms();
 };
 
 #endif
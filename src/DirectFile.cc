@@ -0,0 +1,229 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "DirectFile.hh"
+
+using namespace std;
+
+#define DIRECT_ALIGN 4096
+
+DirectFile::DirectFile(const string &_fname, size_t depth, size_t _bufsize) : fname(_fname), ring(-1), registered(false), written(0), cur(0), fill(0), inflight(0), offset(0), sq_ring(NULL), cq_ring(NULL), sqes(NULL) {
+    bufsize = (_bufsize+DIRECT_ALIGN-1)/DIRECT_ALIGN*DIRECT_ALIGN;
+    if (!bufsize) bufsize = DIRECT_ALIGN;
+    if (!depth) depth = 1;
+    
+    direct = true;
+    fd = open(fname.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT,0644);
+    if (fd < 0 && errno == EINVAL) {
+        //some filesystems (tmpfs) refuse O_DIRECT
+        direct = false;
+        fd = open(fname.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    }
+    if (fd < 0) throw runtime_error("Could not open " + fname);
+    
+    //one buffer fills while the rest are in flight
+    buffers.resize(depth+1,NULL);
+    busy.resize(depth+1,false);
+    for (size_t i = 0; i < buffers.size(); i++) {
+        void *ptr;
+        if (posix_memalign(&ptr,DIRECT_ALIGN,bufsize)) {
+            release();
+            throw runtime_error("Could not allocate aligned buffers for " + fname);
+        }
+        buffers[i] = (char*)ptr;
+    }
+    
+    setupRing(depth+1);
+}
+
+DirectFile::~DirectFile() {
+    if (fd >= 0) {
+        try {
+            close();
+        } catch (runtime_error &e) {
+            //nowhere to report this from a destructor
+        }
+    }
+    release();
+}
+
+void DirectFile::setupRing(size_t depth) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params,0,sizeof(params));
+    ring = syscall(__NR_io_uring_setup,depth,&params);
+    if (ring < 0) return; //pwrite instead
+    
+    sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sq_ring_size = cq_ring_size = max(sq_ring_size,cq_ring_size);
+    sq_ring = mmap(NULL,sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring,IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = NULL;
+        closeRing();
+        return;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL,cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring,IORING_OFF_CQ_RING);
+    }
+    sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    void *sqes_map = mmap(NULL,sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring,IORING_OFF_SQES);
+    if (cq_ring == MAP_FAILED || sqes_map == MAP_FAILED) {
+        if (cq_ring == MAP_FAILED) cq_ring = NULL;
+        if (sqes_map != MAP_FAILED) munmap(sqes_map,sqes_size);
+        closeRing();
+        return;
+    }
+    sqes = (struct io_uring_sqe*)sqes_map;
+    
+    sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+    cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+    
+    //registered buffers skip mapping pages on every write, but count 
+    //against RLIMIT_MEMLOCK, so plain writes are used if that is too low
+    vector<struct iovec> iovs(buffers.size());
+    for (size_t i = 0; i < buffers.size(); i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = bufsize;
+    }
+    registered = syscall(__NR_io_uring_register,ring,IORING_REGISTER_BUFFERS,iovs.data(),iovs.size()) == 0;
+#endif
+}
+
+void DirectFile::closeRing() {
+    if (sqes) munmap(sqes,sqes_size);
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring,cq_ring_size);
+    if (sq_ring) munmap(sq_ring,sq_ring_size);
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+    if (ring >= 0) ::close(ring);
+    ring = -1;
+}
+
+void DirectFile::release() {
+    closeRing();
+    for (size_t i = 0; i < buffers.size(); i++) free(buffers[i]);
+    buffers.clear();
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+void DirectFile::submit(size_t buf, size_t len) {
+    if (ring < 0) {
+        for (size_t done = 0; done < len; ) {
+            ssize_t res = pwrite(fd,buffers[buf]+done,len-done,offset+done);
+            if (res < 0) throw runtime_error("Could not write " + fname + ": " + strerror(errno));
+            done += res;
+        }
+        return;
+    }
+#ifdef __NR_io_uring_enter
+    const unsigned tail = *sq_tail, idx = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)buffers[buf];
+    sqe->len = len;
+    sqe->buf_index = registered ? buf : 0;
+    sqe->user_data = buf | ((uint64_t)len << 32);
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+    
+    busy[buf] = true;
+    inflight++;
+    if (syscall(__NR_io_uring_enter,ring,1,0,0,NULL,0) < 0) throw runtime_error("Could not submit a write to " + fname + ": " + strerror(errno));
+#endif
+}
+
+void DirectFile::reap(bool wait) {
+#ifdef __NR_io_uring_enter
+    for (;;) {
+        unsigned head = *cq_head;
+        const unsigned tail = __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (!wait) return;
+            if (syscall(__NR_io_uring_enter,ring,0,1,IORING_ENTER_GETEVENTS,NULL,0) < 0 && errno != EINTR) throw runtime_error("Could not wait for writes to " + fname + ": " + strerror(errno));
+            continue;
+        }
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            const size_t buf = cqe->user_data & 0xFFFFFFFF, len = cqe->user_data >> 32;
+            if (cqe->res < 0) throw runtime_error("Could not write " + fname + ": " + strerror(-cqe->res));
+            if ((size_t)cqe->res != len) throw runtime_error("Short write to " + fname);
+            busy[buf] = false;
+            inflight--;
+        }
+        __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+        return;
+    }
+#endif
+}
+
+void DirectFile::write(const void *_data, size_t size) {
+    const char *data = (const char*)_data;
+    written += size;
+    while (size) {
+        const size_t amt = min(size,bufsize-fill);
+        memcpy(buffers[cur]+fill,data,amt);
+        fill += amt;
+        data += amt;
+        size -= amt;
+        if (fill == bufsize) {
+            submit(cur,bufsize);
+            offset += bufsize;
+            fill = 0;
+            cur = (cur+1) % buffers.size();
+            reap(false);
+            while (busy[cur]) reap(true);
+        }
+    }
+}
+
+void DirectFile::close() {
+    if (fd < 0) return;
+    if (fill) {
+        //O_DIRECT needs whole blocks, the padding is trimmed below
+        const size_t len = direct ? (fill+DIRECT_ALIGN-1)/DIRECT_ALIGN*DIRECT_ALIGN : fill;
+        memset(buffers[cur]+fill,0,len-fill);
+        submit(cur,len);
+        fill = 0;
+    }
+    while (inflight) reap(true);
+    if (direct && ftruncate(fd,written)) throw runtime_error("Could not trim " + fname);
+    fsync(fd);
+    ::close(fd);
+    fd = -1;
+}
@@ -0,0 +1,85 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#ifndef DirectFile__hh
+#define DirectFile__hh
+
+// Appends to a file with O_DIRECT from aligned buffers, bypassing the page
+// cache. Full buffers are written with io_uring, keeping up to depth writes
+// in flight while the next buffer fills. Falls back to buffered I/O where 
+// O_DIRECT is refused, and to a pwrite per buffer without io_uring.
+class DirectFile {
+
+    public:
+    
+        // bufsize is rounded up to the 4 KiB O_DIRECT alignment
+        DirectFile(const std::string &fname, size_t depth = 4, size_t bufsize = 4<<20);
+        
+        virtual ~DirectFile();
+        
+        void write(const void *data, size_t size);
+        
+        // Writes the partial last buffer, waits for all writes, trims the 
+        // alignment padding, and syncs the file. No writes may follow.
+        void close();
+        
+        inline size_t bytes() { return written; }
+        
+        inline bool isDirect() { return direct; }
+        
+        inline bool isUring() { return ring >= 0; }
+        
+    protected:
+    
+        std::string fname;
+        int fd, ring;
+        bool direct, registered;
+        size_t bufsize, written;
+        
+        std::vector<char*> buffers;
+        std::vector<bool> busy;
+        size_t cur, fill, inflight;
+        uint64_t offset; // file offset of the current buffer
+        
+        // io_uring rings mapped from the kernel
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+        
+        void setupRing(size_t depth);
+        
+        void submit(size_t buf, size_t len);
+        
+        // Retires completed writes, blocking for one if wait is set
+        void reap(bool wait);
+        
+        void closeRing();
+        
+        void release();
+
+};
+
+#endif
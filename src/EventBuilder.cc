@@ -0,0 +1,238 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <iostream>
+#include <cstdlib>
+
+#include "EventBuilder.hh"
+
+using namespace std;
+using namespace H5;
+
+static const size_t max_offsets = 128;
+static const size_t max_orphans = 8;
+
+static inline void orphan(locator &loc) {
+    loc.file = -1;
+    loc.index = -1;
+    loc.pattern = -1;
+}
+
+EventBuilder::EventBuilder(const string &_master, const string &_fast, uint16_t _test_mask, uint16_t _comp_mask, size_t _max_offset) : master(_master), fast(_fast), test_mask(_test_mask), comp_mask(_comp_mask), max_offset(_max_offset) {
+    have_last = false;
+    total_events = 0;
+    master_retrigger = fast_retrigger = 0;
+    offsets = master_offsets = 0;
+    orphans = master_orphans = fast_orphans = 0;
+}
+
+EventBuilder::~EventBuilder() {
+
+}
+
+void EventBuilder::push(const built_event &ev) {
+    events.push_back(ev);
+    last = ev;
+    have_last = true;
+}
+
+void EventBuilder::build(int fidx, const vector<uint16_t> &master_patterns, const vector<uint16_t> &fast_patterns, size_t master_first, size_t fast_first) {
+    build(fidx,master_patterns,master_first,fidx,fast_patterns,fast_first);
+}
+
+void EventBuilder::buildMaster(int fidx, const vector<uint16_t> &patterns, size_t first) {
+    build(fidx,patterns,first,-1,vector<uint16_t>(),0);
+}
+
+void EventBuilder::buildFast(int fidx, const vector<uint16_t> &patterns, size_t first) {
+    build(-1,vector<uint16_t>(),0,fidx,patterns,first);
+}
+
+void EventBuilder::build(int master_fidx, const vector<uint16_t> &master_patterns, size_t master_first, int fast_fidx, const vector<uint16_t> &fast_patterns, size_t fast_first) {
+
+    size_t mi = 0, fi = 0;
+    //pending triggers of one card pair with new ones of the other
+    while ((master_overflow.size() || mi < master_patterns.size()) && (fast_overflow.size() || fi < fast_patterns.size())) {
+       
+        //offline these abort, but a run should keep going
+        if (orphans > max_orphans) {
+            cout << "****" << master << "/" << fast << " too many orphans in a row" << endl;
+            orphans = 0;
+        }
+        if (offsets > max_offsets) {
+            cout << "****" << master << "/" << fast << " stuck on an offset" << endl;
+            offsets = 0;
+        }
+
+        // Populate event with pending or next independently
+        built_event ev;
+        if (master_overflow.size()) {
+            ev.master = master_overflow.front();
+            master_overflow.pop_front();
+        } else {
+            ev.master.file = master_fidx;
+            ev.master.index = master_first + mi;
+            ev.master.pattern = master_patterns[mi];
+            mi++;
+        }
+        if (fast_overflow.size()) {
+            ev.fast = fast_overflow.front();
+            fast_overflow.pop_front();
+        } else {
+            ev.fast.file = fast_fidx;
+            ev.fast.index = fast_first + fi;
+            ev.fast.pattern = fast_patterns[fi];
+            fi++;
+        }
+        
+        if ((ev.master.pattern & test_mask) == (ev.fast.pattern & test_mask)) {
+            orphans = 0;
+            offsets = 0;
+            push(ev);
+            continue;
+        }
+        
+        // One of the two triggers might be an orphan
+        if (ev.master.pattern + 16 == ev.fast.pattern) {
+            offsets++;
+            master_offsets++;
+            orphans = 0;
+            push(ev);
+            continue;
+        }
+        offsets = 0;
+
+        cout << "Discontinuity found - " << master << "_file: " << ev.master.file << " " << master << "_index:" << ev.master.index;
+        cout << " " << fast << "_file: " << ev.fast.file << " " << fast << "_index:" << ev.fast.index << endl;
+
+        if (have_last) {
+            const uint16_t cmpat = ev.master.pattern;
+            const uint16_t lmpat = last.master.pattern;
+            if (cmpat-16 == lmpat || cmpat+16 == lmpat || cmpat == lmpat) {
+                cout << "\t" << master << " retrigger was orphaned" << endl;
+                fast_overflow.push_front(ev.fast);
+                orphan(ev.fast);
+                master_retrigger++;
+                orphans = 0;
+                push(ev);
+                continue;
+            } else if (ev.fast.pattern == last.fast.pattern) {
+                cout << "\t" << fast << " retrigger was orphaned" << endl;
+                master_overflow.push_front(ev.master);
+                orphan(ev.master);
+                fast_retrigger++;
+                orphans = 0;
+                push(ev);
+                continue;
+            }
+        }
+        
+        bool invert = (size_t)abs((ev.fast.pattern & comp_mask) - (ev.master.pattern & comp_mask)) > max_offset;
+        if (((ev.fast.pattern & comp_mask) > (ev.master.pattern & comp_mask)) != invert) {
+            cout << "\t" << master << " was orphaned" << endl;
+            fast_overflow.push_front(ev.fast);
+            orphan(ev.fast);
+            master_orphans++;
+        } else {
+            cout << "\t" << fast << " was orphaned" << endl;
+            master_overflow.push_front(ev.master);
+            orphan(ev.master);
+            fast_orphans++;
+        }
+        orphans++;
+        push(ev);
+         
+    }
+    
+    for (; mi < master_patterns.size(); mi++) {
+        locator m;
+        m.file = master_fidx;
+        m.index = master_first + mi;
+        m.pattern = master_patterns[mi];
+        master_overflow.push_back(m);
+    }
+    
+    for (; fi < fast_patterns.size(); fi++) {
+        locator f;
+        f.file = fast_fidx;
+        f.index = fast_first + fi;
+        f.pattern = fast_patterns[fi];
+        fast_overflow.push_back(f);
+    }
+    
+}
+
+void EventBuilder::flush() {
+    //can only have orphans in one or the other overflow
+    for ( ; master_overflow.size(); master_overflow.pop_front()) {
+        built_event ev;
+        ev.master = master_overflow.front();
+        orphan(ev.fast);
+        master_orphans++;
+        push(ev);
+    }
+    for ( ; fast_overflow.size(); fast_overflow.pop_front()) {
+        built_event ev;
+        ev.fast = fast_overflow.front();
+        orphan(ev.master);
+        fast_orphans++;
+        push(ev);
+    }
+}
+
+void EventBuilder::writeOut(OutputBatch &batch, size_t chunk) {
+
+    cout << "\t/event_index" << endl;
+    
+    // event_index, master_file, master_index, fast_file, fast_index
+    vector<int64_t> index(events.size()*5);
+    for (size_t i = 0; i < events.size(); i++) {
+        index[i*5+0] = total_events + i;
+        index[i*5+1] = events[i].master.file;
+        index[i*5+2] = events[i].master.index;
+        index[i*5+3] = events[i].fast.file;
+        index[i*5+4] = events[i].fast.index;
+    }
+    
+    batch.rows("/event_index", PredType::NATIVE_INT64, index.data(), events.size(), 5, chunk);
+    
+    //the counters so far are copied for when the batch is written
+    const string master = this->master, fast = this->fast;
+    const uint64_t counts[5] = {master_orphans, fast_orphans, master_offsets, master_retrigger, fast_retrigger};
+    batch.add([master,fast,counts](H5File &file) {
+        DataSet index_ds = file.openDataSet("/event_index");
+        
+        if (!index_ds.attrExists("master")) {
+            DataSpace scalar(0,NULL);
+            StrType strtype(PredType::C_S1, H5T_VARIABLE);
+            Attribute master_attr = index_ds.createAttribute("master",strtype,scalar);
+            master_attr.write(strtype,master);
+            Attribute fast_attr = index_ds.createAttribute("fast",strtype,scalar);
+            fast_attr.write(strtype,fast);
+        }
+        
+        outputAttribute(index_ds,"master_orphans",PredType::NATIVE_UINT64,&counts[0]);
+        outputAttribute(index_ds,"fast_orphans",PredType::NATIVE_UINT64,&counts[1]);
+        outputAttribute(index_ds,"master_offsets",PredType::NATIVE_UINT64,&counts[2]);
+        outputAttribute(index_ds,"master_retriggers",PredType::NATIVE_UINT64,&counts[3]);
+        outputAttribute(index_ds,"fast_retriggers",PredType::NATIVE_UINT64,&counts[4]);
+    });
+    
+    total_events += events.size();
+    cout << "Events: " << total_events << ", " << master << " Orphans: " << master_orphans << ", " << fast << " Orphans: " << fast_orphans << endl;
+    events.clear();
+}
@@ -0,0 +1,98 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <list>
+#include <vector>
+#include <string>
+
+#include "Output.hh"
+#include "H5Cpp.h"
+
+#ifndef EventBuilder__hh
+#define EventBuilder__hh
+
+// One card's trigger, by file number and index within that file (-1 if missing)
+typedef struct {
+    int file, index;
+    uint16_t pattern;
+} locator;
+
+typedef struct {
+    locator master, fast;
+} built_event;
+
+// Correlates the triggers of two cards from their LVDS patterns as files are
+// written, with the same orphan and retrigger handling as eventmapper
+class EventBuilder {
+
+    public:
+    
+        // test_mask compares patterns for equality, comp_mask orders them 
+        // when they differ, and larger differences than max_offset roll over
+        EventBuilder(const std::string &master, const std::string &fast, uint16_t test_mask = 0xFF, uint16_t comp_mask = 0x0F, size_t max_offset = 8);
+        
+        virtual ~EventBuilder();
+        
+        inline const std::string& getMaster() {
+            return master;
+        }
+        
+        inline const std::string& getFast() {
+            return fast;
+        }
+        
+        // Builds events from the triggers written to file number fidx along
+        // with any left over from earlier files, where the patterns start at
+        // index master_first and fast_first within that file
+        void build(int fidx, const std::vector<uint16_t> &master_patterns, const std::vector<uint16_t> &fast_patterns, size_t master_first = 0, size_t fast_first = 0);
+        
+        // As build, for cards writing files on their own schedules: triggers
+        // of one card wait until the other's arrive, and fidx numbers the 
+        // files of that card alone
+        void buildMaster(int fidx, const std::vector<uint16_t> &patterns, size_t first = 0);
+        void buildFast(int fidx, const std::vector<uint16_t> &patterns, size_t first = 0);
+        
+        // Builds all remaining triggers as orphans at the end of a run
+        void flush();
+        
+        // Records events built since the last call for /event_index, 
+        // appending to it with chunk > 0 (see outputRows)
+        void writeOut(OutputBatch &batch, size_t chunk = 0);
+        
+    protected:
+    
+        std::string master, fast;
+        uint16_t test_mask, comp_mask;
+        size_t max_offset;
+        
+        std::vector<built_event> events;
+        std::list<locator> master_overflow, fast_overflow;
+        bool have_last;
+        built_event last;
+        
+        size_t total_events;
+        size_t master_retrigger, fast_retrigger;
+        size_t offsets, master_offsets;
+        size_t orphans, master_orphans, fast_orphans;
+        
+        void push(const built_event &ev);
+        
+        void build(int master_fidx, const std::vector<uint16_t> &master_patterns, size_t master_first, int fast_fidx, const std::vector<uint16_t> &fast_patterns, size_t fast_first);
+        
+};
+
+#endif
@@ -0,0 +1,224 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <cmath>
+#include <stdexcept>
+
+#include "Generator.hh"
+
+using namespace std;
+
+Generator::Generator(const generator_config &_config) : config(_config) {
+    state = config.seed ? config.seed : 1;
+    events = 0;
+    counter = 0;
+    time = 0.0;
+}
+
+Generator::~Generator() {
+
+}
+
+size_t Generator::nextTrigger() {
+    counter++;
+    time += -log(1.0-uniform())/config.rate*1e9;
+    const double r = uniform();
+    if (r < config.missed_fraction) return 0;
+    if (r < config.missed_fraction + config.duplicate_fraction) return 2;
+    return 1;
+}
+
+void Generator::trace(uint16_t *data, size_t nsamples, uint16_t baseline, uint16_t max) {
+    const bool pulse = uniform() < config.pulse_fraction;
+    const size_t t0 = nsamples/2;
+    for (size_t i = 0; i < nsamples; i++) {
+        double val = baseline + floor(uniform()*5.0) - 2.0;
+        if (pulse && i >= t0) val -= config.pulse_height*exp(-(i-t0)/10.0)*(1.0-exp(-(i-t0+1)/2.0));
+        data[i] = val < 0 ? 0 : (val > max ? max : val);
+    }
+}
+
+V1730Generator::V1730Generator(const generator_config &config, V1730Settings &_settings) : Generator(config), settings(_settings) {
+    size_t longest = 0;
+    settings.roundRecordLengths();
+    for (size_t gr = 0; gr < 8; gr++) {
+        if (settings.groups[gr].record_length > longest) longest = settings.groups[gr].record_length;
+    }
+    samples.resize(longest);
+}
+
+V1730Generator::~V1730Generator() {
+
+}
+
+size_t V1730Generator::maxBoardAgg() {
+    size_t size = 1 + 4;
+    for (size_t ch = 0; ch < 16; ch++) {
+        if (!settings.getEnabled(ch)) continue;
+        size += 2 + settings.getRecordLength(ch)/2 + 3;
+    }
+    return size;
+}
+
+size_t V1730Generator::generate(Buffer &buffer, size_t nTriggers) {
+    const size_t free = buffer.free()/4, maxsize = maxBoardAgg();
+    uint32_t *start = (uint32_t*)buffer.wptr(), *word = start;
+    size_t n = 0;
+    for ( ; n < nTriggers && (size_t)(word-start) + 2*maxsize <= free; n++) {
+        for (size_t copies = nextTrigger(); copies > 0; copies--) {
+            word = board_agg(word);
+            events++;
+        }
+    }
+    buffer.inc((word-start)*4);
+    return n;
+}
+
+uint32_t* V1730Generator::board_agg(uint32_t *word) {
+    if (uniform() < config.pad_fraction) *word++ = 0xFFFFFFFF;
+    
+    uint32_t *boardagg = word;
+    uint32_t mask = 0;
+    word += 4;
+    for (uint32_t gr = 0; gr < 8; gr++) {
+        if (!settings.getEnabled(gr*2) && !settings.getEnabled(gr*2+1)) continue;
+        mask |= 1 << gr;
+        word = chan_agg(word,gr);
+    }
+    
+    boardagg[0] = 0xA0000000 | (word - boardagg);
+    boardagg[1] = ((counter & 0x7FFF) << 8) | mask;
+    boardagg[2] = counter & 0x7FFFFF;
+    boardagg[3] = (uint32_t)(time/2.0);
+    
+    return word;
+}
+
+uint32_t* V1730Generator::chan_agg(uint32_t *word, uint32_t gr) {
+    const size_t len = settings.getRecordLength(gr*2);
+    const size_t nsamples = settings.getListMode() ? 0 : len;
+    const uint16_t baseline = 12000;
+    
+    uint32_t *chanagg = word;
+    word += 2;
+    for (uint32_t ch = gr*2; ch < gr*2+2; ch++) {
+        if (!settings.getEnabled(ch)) continue;
+        
+        trace(samples.data(),len,baseline,0x3FFF);
+        uint32_t qshort = 0, qlong = 0;
+        for (size_t i = 0; i < len; i++) {
+            const uint32_t q = baseline > samples[i] ? baseline - samples[i] : 0;
+            if (i >= len/2 && i < len/2+20) qshort += q;
+            qlong += q;
+        }
+        
+        const uint64_t timetag = (uint64_t)(time/2.0);
+        *word++ = ((ch & 1) ? 0x80000000 : 0) | (timetag & 0x7FFFFFFF);
+        for (size_t i = 0; i < nsamples; i += 2) {
+            *word++ = samples[i] | (samples[i+1] << 16);
+        }
+        *word++ = (((timetag >> 31) & 0xFFFF) << 16) | baseline;
+        *word++ = ((qlong > 0xFFFF ? 0xFFFF : qlong) << 16) | (qshort > 0x7FFF ? 0x7FFF : qshort);
+    }
+    
+    chanagg[0] = 0x80000000 | (word - chanagg);
+    chanagg[1] = (1<<30) | (1<<29) | (1<<28) | (nsamples ? (1<<27) | (nsamples/8) : 0);
+    
+    return word;
+}
+
+V1742Generator::V1742Generator(const generator_config &config, V1742Settings &_settings) : Generator(config), settings(_settings) {
+    nSamples = settings.getNumSamples();
+}
+
+V1742Generator::~V1742Generator() {
+
+}
+
+size_t V1742Generator::maxEvent() {
+    size_t size = 1 + 4;
+    for (size_t gr = 0; gr < 4; gr++) {
+        if (!settings.getGroupEnabled(gr)) continue;
+        size += 2 + nSamples*3 + (settings.getTrReadout() ? nSamples*3/8 : 0);
+    }
+    return size;
+}
+
+size_t V1742Generator::generate(Buffer &buffer, size_t nTriggers) {
+    const size_t free = buffer.free()/4, maxsize = maxEvent();
+    uint32_t *start = (uint32_t*)buffer.wptr(), *word = start;
+    size_t n = 0;
+    for ( ; n < nTriggers && (size_t)(word-start) + 2*maxsize <= free; n++) {
+        for (size_t copies = nextTrigger(); copies > 0; copies--) {
+            word = event(word);
+            events++;
+        }
+    }
+    buffer.inc((word-start)*4);
+    return n;
+}
+
+uint32_t* V1742Generator::event(uint32_t *word) {
+    if (uniform() < config.pad_fraction) *word++ = 0xFFFFFFFF;
+    
+    uint32_t *event = word;
+    uint32_t mask = 0;
+    word += 4;
+    for (uint32_t gr = 0; gr < 4; gr++) {
+        if (!settings.getGroupEnabled(gr)) continue;
+        mask |= 1 << gr;
+        word = group(word,gr);
+    }
+    
+    event[0] = 0xA0000000 | (word - event);
+    event[1] = ((counter & 0x7FFF) << 8) | mask;
+    event[2] = counter & 0x3FFFFF;
+    event[3] = (uint32_t)(time/8.5) & 0x3FFFFFFF;
+    
+    return word;
+}
+
+uint32_t* V1742Generator::group(uint32_t *word, uint32_t gr) {
+    const bool tr = settings.getTrReadout();
+    const uint32_t size = nSamples*3;
+    const uint32_t cell_index = uniform()*1024;
+    
+    *word++ = (cell_index << 20) | ((uint32_t)settings.sampleFreq() << 16) | ((tr ? 1 : 0) << 12) | size;
+    
+    for (size_t ch = 0; ch < (tr ? 9 : 8); ch++) trace(samples[ch],nSamples,3500,0xFFF);
+    
+    uint16_t *d[8];
+    for (size_t ch = 0; ch < 8; ch++) d[ch] = samples[ch];
+    for (size_t s = 0; s < nSamples; s++, word += 3) {
+        word[0] = d[0][s] | (d[1][s] << 12) | ((d[2][s] & 0xFF) << 24);
+        word[1] = (d[2][s] >> 8) | (d[3][s] << 4) | (d[4][s] << 16) | ((d[5][s] & 0xF) << 28);
+        word[2] = (d[5][s] >> 4) | (d[6][s] << 8) | (d[7][s] << 20);
+    }
+    
+    if (tr) {
+        const uint16_t *t = samples[8];
+        for (size_t s = 0; s < nSamples; s += 8, word += 3) {
+            word[0] = t[s+0] | (t[s+1] << 12) | ((t[s+2] & 0xFF) << 24);
+            word[1] = (t[s+2] >> 8) | (t[s+3] << 4) | (t[s+4] << 16) | ((t[s+5] & 0xF) << 28);
+            word[2] = (t[s+5] >> 4) | (t[s+6] << 8) | (t[s+7] << 20);
+        }
+    }
+    
+    *word++ = (uint32_t)(time/8.5) & 0x3FFFFFFF; //group trigger time tag
+    
+    return word;
+}
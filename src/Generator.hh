@@ -0,0 +1,133 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <cstdint>
+
+#include "Buffer.hh"
+#include "V1730_dpppsd.hh"
+#include "V1742.hh"
+
+#ifndef Generator__hh
+#define Generator__hh
+
+// Shape of the synthetic data stream
+typedef struct {
+    double rate; // mean trigger rate (Hz) for the time tags
+    double pulse_fraction; // fraction of traces with an injected pulse
+    double pulse_height; // pulse amplitude in ADC counts
+    double pad_fraction; // fraction of aggregates preceded by a 0xFFFFFFFF padding word
+    double missed_fraction; // fraction of triggers dropped (counters still advance)
+    double duplicate_fraction; // fraction of triggers read out twice
+    uint32_t seed; // random seed
+} generator_config;
+
+// Writes raw readout data into a Buffer as a board would for a settings 
+// object, so decoders can be exercised without hardware
+class Generator {
+
+    public:
+    
+        Generator(const generator_config &config);
+        
+        virtual ~Generator();
+        
+        // Appends up to nTriggers triggers while they fit in the buffer and
+        // returns the number of triggers generated
+        virtual size_t generate(Buffer &buffer, size_t nTriggers) = 0;
+        
+        // Events a decoder should have found for the triggers generated
+        inline size_t eventsGenerated() {
+            return events;
+        }
+        
+    protected:
+    
+        generator_config config;
+        uint32_t state;
+        size_t events;
+        uint32_t counter;
+        double time; // ns
+        
+        // uniform in [0,1)
+        inline double uniform() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state/4294967296.0;
+        }
+        
+        // advances the trigger counter and time, returns the number of 
+        // copies of this trigger to emit (0 missed, 1 normal, 2 duplicated)
+        size_t nextTrigger();
+        
+        // fills a trace with a noisy baseline and possibly a negative pulse
+        void trace(uint16_t *data, size_t nsamples, uint16_t baseline, uint16_t max);
+        
+};
+
+// V1730 DPP-PSD board aggregates with one trigger per aggregate
+class V1730Generator : public Generator {
+
+    public:
+    
+        // rounds record lengths to the multiple of 8 programming the board would
+        V1730Generator(const generator_config &config, V1730Settings &settings);
+        
+        virtual ~V1730Generator();
+        
+        virtual size_t generate(Buffer &buffer, size_t nTriggers);
+        
+    protected:
+    
+        V1730Settings &settings;
+        std::vector<uint16_t> samples;
+        
+        uint32_t* board_agg(uint32_t *word);
+        
+        uint32_t* chan_agg(uint32_t *word, uint32_t gr);
+        
+        size_t maxBoardAgg();
+        
+};
+
+// V1742 event structures with all enabled groups
+class V1742Generator : public Generator {
+
+    public:
+    
+        V1742Generator(const generator_config &config, V1742Settings &settings);
+        
+        virtual ~V1742Generator();
+        
+        virtual size_t generate(Buffer &buffer, size_t nTriggers);
+        
+    protected:
+    
+        V1742Settings &settings;
+        uint32_t nSamples;
+        uint16_t samples[9][1024];
+        
+        uint32_t* event(uint32_t *word);
+        
+        uint32_t* group(uint32_t *word, uint32_t gr);
+        
+        size_t maxEvent();
+        
+};
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "Histograms.hh"
+
+using namespace std;
+using namespace H5;
+
+static double monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+HistogramSet::HistogramSet(const string &_card) : card(_card), merged_into(NULL), card_index(0), merged(0.0) {
+
+}
+
+HistogramSet::~HistogramSet() {
+
+}
+
+size_t HistogramSet::add(const string &name, uint32_t nbins, double lo, double hi) {
+    if (!nbins || !(hi > lo)) throw runtime_error("Histogram " + card + "/" + name + " needs bins and hi > lo");
+    def h;
+    h.name = name;
+    h.nbins = nbins;
+    h.lo = lo;
+    h.hi = hi;
+    h.scale = nbins/(hi-lo);
+    h.offset = counts.size();
+    h.total = string::npos;
+    defs.push_back(h);
+    counts.resize(counts.size()+nbins+2,0);
+    return defs.size()-1;
+}
+
+Histograms::Histograms(const string &_name, const vector<HistogramSet*> &sets, double _interval) : name(_name), interval(_interval), fd(-1) {
+    vector<string> card_names;
+    vector<pair<uint32_t,const HistogramSet::def*>> hists;
+    size_t nbins = 0;
+    for (size_t i = 0; i < sets.size(); i++) {
+        const string &card = sets[i]->card;
+        if (!card_indexes.count(card)) {
+            card_indexes[card] = card_names.size();
+            card_names.push_back(card);
+        }
+        for (size_t h = 0; h < sets[i]->defs.size(); h++) {
+            hists.push_back(make_pair(card_indexes[card],&sets[i]->defs[h]));
+            nbins += sets[i]->defs[h].nbins+2;
+        }
+    }
+    
+    const size_t bins_offset = sizeof(histogram_header) + card_names.size()*sizeof(histogram_card) + hists.size()*sizeof(histogram_entry);
+    size = bins_offset + nbins*sizeof(uint64_t);
+    if (name.empty()) {
+        mem = new char[size]();
+    } else {
+        fd = shm_open(name.c_str(),O_CREAT|O_RDWR,0644);
+        if (fd < 0) throw runtime_error("Could not open histograms " + name + ": " + strerror(errno));
+        //emptied first so readers of old histograms never see stale counts
+        if (ftruncate(fd,0) || ftruncate(fd,size)) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw runtime_error("Could not size histograms " + name + ": " + strerror(errno));
+        }
+        mem = (char*)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        if (mem == MAP_FAILED) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw runtime_error("Could not map histograms " + name + ": " + strerror(errno));
+        }
+    }
+    
+    header = (histogram_header*)mem;
+    cards = (histogram_card*)(mem + sizeof(histogram_header));
+    entries = (histogram_entry*)(cards + card_names.size());
+    bins = (uint64_t*)(mem + bins_offset);
+    for (size_t c = 0; c < card_names.size(); c++) {
+        strncpy(cards[c].name,card_names[c].c_str(),sizeof(cards[c].name)-1);
+    }
+    for (size_t i = 0, offset = 0; i < hists.size(); i++) {
+        const HistogramSet::def &h = *hists[i].second;
+        const string path = "/" + card_names[hists[i].first] + "/" + h.name;
+        if (path.size() >= sizeof(entries[i].name)) throw runtime_error("Histogram name " + path + " is too long");
+        strncpy(entries[i].name,path.c_str(),sizeof(entries[i].name)-1);
+        entries[i].card = hists[i].first;
+        entries[i].nbins = h.nbins;
+        entries[i].lo = h.lo;
+        entries[i].hi = h.hi;
+        entries[i].offset = offset;
+        entry_indexes[path] = i;
+        offset += h.nbins+2;
+    }
+    
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    start = monotonic();
+    header->version = 1;
+    header->ncards = card_names.size();
+    header->nhists = hists.size();
+    header->bins_offset = bins_offset;
+    header->started = tv.tv_sec + tv.tv_usec*1e-6;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic,"WbLShist",8);
+}
+
+Histograms::~Histograms() {
+    if (fd < 0) {
+        delete [] mem;
+    } else {
+        munmap(mem,size);
+        close(fd);
+        shm_unlink(name.c_str());
+    }
+}
+
+void Histograms::attach(HistogramSet &set) {
+    if (!card_indexes.count(set.card)) throw runtime_error("Histograms of " + set.card + " were not laid out");
+    set.card_index = card_indexes[set.card];
+    for (size_t h = 0; h < set.defs.size(); h++) {
+        HistogramSet::def &def = set.defs[h];
+        const string path = "/" + set.card + "/" + def.name;
+        def.total = string::npos;
+        if (!entry_indexes.count(path)) continue;
+        const histogram_entry &entry = entries[entry_indexes[path]];
+        if (entry.nbins == def.nbins && entry.lo == def.lo && entry.hi == def.hi) def.total = entry.offset;
+    }
+    set.merged_into = this;
+}
+
+void Histograms::merge(HistogramSet &set, bool force) {
+    const double now = monotonic();
+    if (!force && now - set.merged < interval) return;
+    set.merged = now;
+    if (set.merged_into != this) attach(set);
+    
+    //readers retry while seq is odd or has changed under them
+    histogram_card &card = cards[set.card_index];
+    const uint64_t seq = card.seq;
+    __atomic_store_n(&card.seq,seq+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t h = 0; h < set.defs.size(); h++) {
+        const HistogramSet::def &def = set.defs[h];
+        if (def.total == string::npos) continue;
+        const uint64_t *counts = &set.counts[def.offset];
+        uint64_t *totals = bins + def.total;
+        for (size_t b = 0; b < def.nbins+2; b++) totals[b] += counts[b];
+    }
+    card.updated = now - start;
+    __atomic_store_n(&card.seq,seq+2,__ATOMIC_RELEASE);
+    memset(set.counts.data(),0,set.counts.size()*sizeof(uint64_t));
+}
+
+void Histograms::snapshot(HistogramSet &set, OutputBatch &batch) {
+    merge(set,true);
+    const double seconds = cards[set.card_index].updated;
+    for (size_t h = 0; h < set.defs.size(); h++) {
+        const HistogramSet::def &def = set.defs[h];
+        if (def.total == string::npos) continue;
+        const string path = "/" + set.card + "/" + def.name + "_hist";
+        const vector<uint64_t> totals(bins + def.total, bins + def.total + def.nbins+2);
+        const double lo = def.lo, hi = def.hi;
+        cout << "\t" << path << endl;
+        batch.add([path,totals,lo,hi,seconds](H5File &file) {
+            outputRows(file,path,PredType::NATIVE_UINT64,totals.data(),totals.size(),0,0);
+            DataSet dataset = file.openDataSet(path);
+            outputAttribute(dataset,"lo",PredType::NATIVE_DOUBLE,&lo);
+            outputAttribute(dataset,"hi",PredType::NATIVE_DOUBLE,&hi);
+            outputAttribute(dataset,"seconds",PredType::NATIVE_DOUBLE,&seconds);
+        });
+    }
+}
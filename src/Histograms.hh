@@ -0,0 +1,142 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "Output.hh"
+
+#ifndef Histograms__hh
+#define Histograms__hh
+
+// Start of the shared memory of online histograms, followed by the card
+// table, the histogram table, and then the bins as uint64_t counts. 
+// Everything is in native byte order. Each card's bins are consistent if 
+// its seq was the same even number before and after copying them.
+typedef struct {
+    char magic[8]; // "WbLShist", set last when the tables are filled
+    uint32_t version; // 1
+    uint32_t ncards; // entries of the card table
+    uint32_t nhists; // entries of the histogram table
+    uint32_t spare;
+    uint64_t bins_offset; // bytes from the start of the memory to the bins
+    double started; // unix time the histograms started filling
+} histogram_header;
+
+typedef struct {
+    char name[32]; // card index, NUL terminated
+    uint64_t seq; // odd while a merge is changing the card's bins
+    double updated; // seconds after started of the last merge
+    uint64_t spare;
+} histogram_card;
+
+typedef struct {
+    char name[64]; // e.g. /master/ch0/qshorts, NUL terminated
+    uint32_t card; // index in the card table
+    uint32_t nbins; // bins from lo to hi, stored after an underflow bin and before an overflow bin
+    double lo, hi;
+    uint64_t offset; // index of the underflow bin among the bins
+} histogram_entry;
+
+class Histograms;
+
+// A card's histograms as its decoder fills them. Only the thread decoding 
+// the card touches the counts, so filling needs no atomics; counts since 
+// the last merge are moved into the shared totals by Histograms::merge.
+class HistogramSet {
+
+    friend class Histograms;
+
+    public:
+    
+        HistogramSet(const std::string &card);
+        
+        virtual ~HistogramSet();
+        
+        // Adds a histogram named relative to the card (e.g. ch0/qshorts) 
+        // returning its index for fill
+        size_t add(const std::string &name, uint32_t nbins, double lo, double hi);
+        
+        inline void fill(size_t hist, double value) {
+            const def &h = defs[hist];
+            const double bin = (value - h.lo)*h.scale;
+            counts[h.offset + (bin < 0.0 ? 0 : bin < h.nbins ? (size_t)bin+1 : h.nbins+1)]++;
+        }
+        
+    protected:
+    
+        typedef struct {
+            std::string name;
+            uint32_t nbins;
+            double lo, hi, scale;
+            size_t offset; // of the underflow bin in counts
+            size_t total; // of the underflow bin in the shared totals, or npos if not there
+        } def;
+    
+        std::string card;
+        std::vector<def> defs;
+        std::vector<uint64_t> counts;
+        Histograms *merged_into; // whose totals each def's total refers to
+        uint32_t card_index;
+        double merged; // monotonic seconds of the last merge
+    
+};
+
+// Totals of the histograms of every card, kept in POSIX shared memory for 
+// monitors (or private memory without a name), merged from each card's set
+// at most every interval seconds and snapshotted into output files.
+class Histograms {
+
+    public:
+    
+        // Lays out every histogram of sets, creating (or replacing) the 
+        // shared memory object name, which is removed again when destroyed
+        Histograms(const std::string &name, const std::vector<HistogramSet*> &sets, double interval);
+        
+        virtual ~Histograms();
+        
+        // Adds what set counted since its last merge to the totals if the 
+        // interval has passed or force is set. Only the thread filling set 
+        // may merge it. Histograms not laid out here (e.g. of channels a 
+        // scan enabled) are dropped.
+        void merge(HistogramSet &set, bool force = false);
+        
+        // Merges set and records its totals into batch as datasets beside
+        // the card's data, e.g. /master/ch0/qshorts_hist, with the bins 
+        // under lo and over hi first and last
+        void snapshot(HistogramSet &set, OutputBatch &batch);
+        
+    protected:
+    
+        std::string name;
+        double interval;
+        int fd;
+        size_t size;
+        char *mem;
+        histogram_header *header;
+        histogram_card *cards;
+        histogram_entry *entries;
+        uint64_t *bins;
+        double start; // monotonic seconds at started
+        std::map<std::string,uint32_t> card_indexes, entry_indexes;
+        
+        void attach(HistogramSet &set);
+        
+};
+
+#endif
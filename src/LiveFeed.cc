@@ -0,0 +1,192 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "LiveFeed.hh"
+
+using namespace std;
+
+static double monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+LiveFeed::LiveFeed(const string &_name, size_t ring_bytes) : name(_name), head(0), records(0), batch(0), active(0) {
+    const size_t channel_offset = sizeof(live_feed_header) + LIVE_FEED_CONSUMERS*sizeof(live_feed_consumer);
+    const size_t ring_offset = channel_offset + LIVE_FEED_CHANNELS*sizeof(live_feed_channel);
+    ring_bytes -= ring_bytes % 8;
+    if (ring_bytes < (1<<16)) throw runtime_error("Live feed " + name + " needs at least 64 KiB");
+    size = ring_offset + ring_bytes;
+    
+    fd = shm_open(name.c_str(),O_CREAT|O_RDWR,0644);
+    if (fd < 0) throw runtime_error("Could not open live feed " + name + ": " + strerror(errno));
+    //emptied first so readers of an old feed never see stale records, and
+    //writable by the group so its monitors can claim consumer slots
+    if (ftruncate(fd,0) || ftruncate(fd,size) || fchmod(fd,0664)) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw runtime_error("Could not size live feed " + name + ": " + strerror(errno));
+    }
+    mem = (char*)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw runtime_error("Could not map live feed " + name + ": " + strerror(errno));
+    }
+    
+    header = (live_feed_header*)mem;
+    consumers = (live_feed_consumer*)(mem + sizeof(live_feed_header));
+    channels = (live_feed_channel*)(mem + channel_offset);
+    ring = mem + ring_offset;
+    memset(owners,0,sizeof(owners));
+    now = checked = monotonic();
+    header->version = 2;
+    header->nchannels = 0;
+    header->ring_offset = ring_offset;
+    header->ring_size = ring_bytes;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic,"WbLSfeed",8);
+}
+
+LiveFeed::~LiveFeed() {
+    munmap(mem,size);
+    close(fd);
+    shm_unlink(name.c_str());
+}
+
+uint16_t LiveFeed::channel(const string &chname, uint32_t nsamples, uint32_t bits) {
+    for (uint32_t i = 0; i < header->nchannels; i++) {
+        if (chname == channels[i].name && channels[i].nsamples == nsamples && channels[i].bits == bits) return i;
+    }
+    const uint32_t idx = header->nchannels;
+    if (idx == LIVE_FEED_CHANNELS) throw runtime_error("Live feed " + name + " has no room for channel " + chname);
+    const size_t bytes = sizeof(live_feed_record) + nsamples*sizeof(uint16_t);
+    sizes[idx] = bytes + (8 - bytes % 8) % 8;
+    if (sizes[idx] > header->ring_size/4) throw runtime_error("Live feed " + name + " is too small for channel " + chname);
+    live_feed_channel &entry = channels[idx];
+    memset(entry.name,0,sizeof(entry.name));
+    strncpy(entry.name,chname.c_str(),sizeof(entry.name)-1);
+    entry.nsamples = nsamples;
+    entry.bits = bits;
+    next_events[idx] = 0;
+    __atomic_store_n(&header->nchannels,idx+1,__ATOMIC_RELEASE);
+    return idx;
+}
+
+void LiveFeed::record(uint16_t channel, uint16_t pattern, uint64_t time, uint64_t event, const uint16_t *samples) {
+    next_events[channel] = event+1;
+    
+    //a prescale and a rate check for each consumer decide who gets it
+    uint32_t wanted = 0;
+    for (uint32_t slots = active; slots; slots &= slots-1) {
+        const int slot = __builtin_ctz(slots);
+        if (prescales[slot] > 1 && event % prescales[slot]) continue;
+        if (intervals[slot] > 0.0) {
+            double &next = due[slot][channel];
+            if (next > now + LIVE_FEED_BURST) continue;
+            next = (next > now ? next : now) + intervals[slot];
+        }
+        wanted |= 1u << slot;
+        sent[slot]++;
+    }
+    if (!wanted) return;
+
+    const uint64_t ring_size = header->ring_size;
+    const uint32_t bytes = sizes[channel];
+    
+    //records never straddle the end of the ring
+    size_t pos = head % ring_size;
+    if (pos + bytes > ring_size) {
+        const size_t left = ring_size - pos;
+        __atomic_store_n(&header->reserve,head+left,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (left >= sizeof(live_feed_record)) {
+            live_feed_record *wrap = (live_feed_record*)(ring + pos);
+            wrap->size = left;
+            wrap->channel = LIVE_FEED_WRAP;
+        }
+        head += left;
+        pos = 0;
+    }
+    
+    //claim the bytes before overwriting them, so readers there can tell
+    __atomic_store_n(&header->reserve,head+bytes,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    live_feed_record *rec = (live_feed_record*)(ring + pos);
+    rec->size = bytes;
+    rec->channel = channel;
+    rec->pattern = pattern;
+    rec->consumers = wanted;
+    rec->spare = 0;
+    rec->time = time;
+    rec->event = event;
+    if (samples) memcpy(rec+1,samples,channels[channel].nsamples*sizeof(uint16_t));
+    head += bytes;
+    records++;
+}
+
+void LiveFeed::refresh() {
+    now = monotonic();
+    //slots of monitors that died without freeing them are freed once a 
+    //second, unless a new monitor claimed them in the meantime
+    const bool check = now - checked >= 1.0;
+    if (check) checked = now;
+    active = 0;
+    for (int slot = 0; slot < LIVE_FEED_CONSUMERS; slot++) {
+        live_feed_consumer &consumer = consumers[slot];
+        int32_t pid = __atomic_load_n(&consumer.pid,__ATOMIC_ACQUIRE);
+        if (pid && check && kill(pid,0) && errno == ESRCH) {
+            __atomic_compare_exchange_n(&consumer.pid,&pid,0,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED);
+            continue;
+        }
+        if (!pid) continue;
+        if (pid != owners[slot]) {
+            owners[slot] = pid;
+            sent[slot] = consumer.sent;
+            for (int i = 0; i < LIVE_FEED_CHANNELS; i++) due[slot][i] = 0.0;
+        }
+        const double rate = *(volatile double*)&consumer.rate;
+        prescales[slot] = __atomic_load_n(&consumer.prescale,__ATOMIC_RELAXED);
+        intervals[slot] = rate > 0.0 ? 1.0/rate : 0.0;
+        active |= 1u << slot;
+    }
+}
+
+void LiveFeed::publish() {
+    //the batch goes out under the consumer table it was sampled for
+    if (head != batch) {
+        for (uint32_t slots = active; slots; slots &= slots-1) {
+            const int slot = __builtin_ctz(slots);
+            __atomic_store_n(&consumers[slot].sent,sent[slot],__ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&header->records,records,__ATOMIC_RELAXED);
+        __atomic_store_n(&header->batch,batch,__ATOMIC_RELAXED);
+        __atomic_store_n(&header->head,head,__ATOMIC_RELEASE);
+        batch = head;
+    }
+    refresh();
+}
@@ -0,0 +1,149 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <string>
+#include <stdint.h>
+
+#ifndef LiveFeed__hh
+#define LiveFeed__hh
+
+// Entries in the channel table of a live feed
+#define LIVE_FEED_CHANNELS 256
+
+// Monitors that can read a live feed at once, one bit each of a record's
+// consumers
+#define LIVE_FEED_CONSUMERS 32
+
+// Seconds of a consumer's rate a channel may send at once after being quiet
+#define LIVE_FEED_BURST 0.1
+
+// Channel of the record filling the end of the ring, after which records
+// continue from its start. Less room than a record header also means this.
+#define LIVE_FEED_WRAP 0xFFFF
+
+// Start of the shared memory of a live feed, followed by the consumer table,
+// the channel table, and then the ring. Everything is in native byte order. Readers follow
+// head, and a record at position p of the ring (p % ring_size bytes in) is
+// intact if reserve <= p + ring_size once it has been copied out.
+typedef struct {
+    char magic[8]; // "WbLSfeed", set last when the feed is ready
+    uint32_t version; // 2
+    uint32_t nchannels; // entries of the channel table in use
+    uint64_t ring_offset; // bytes from the start of the memory to the ring
+    uint64_t ring_size; // bytes in the ring, a multiple of 8
+    uint64_t reserve; // bytes ever claimed in the ring, raised before writing
+    uint64_t head; // bytes ever published in the ring, raised after writing
+    uint64_t records; // records ever published, for any consumer
+    uint64_t batch; // position of the last published batch, where lapped readers resume
+} live_feed_header;
+
+// A monitor claims a free slot of the consumer table by writing its sampling
+// and then its pid there, and may change the sampling whenever it likes. 
+// Only events it asked for are published for it, and the DAQ frees slots 
+// of processes that have gone away. Monitors claiming slots at the same
+// time must agree among themselves, e.g. by locking the table.
+typedef struct {
+    int32_t pid; // process reading the feed with this slot, 0 when free
+    uint32_t prescale; // only events of each card numbered a multiple of this (0 or 1 for all)
+    double rate; // at most this many records per second of each channel (0 for no limit)
+    uint64_t sent; // records ever published for this slot, written by the DAQ
+} live_feed_consumer;
+
+typedef struct {
+    char name[48]; // e.g. /master/ch0 or /fast/gr0/ch3, NUL terminated
+    uint32_t nsamples; // samples following each record of the channel
+    uint32_t bits; // significant bits of each sample
+} live_feed_channel;
+
+// One record of the ring, followed by the nsamples uint16_t samples of its
+// channel and padding to a multiple of 8 bytes.
+typedef struct {
+    uint32_t size; // bytes in the record, samples, and padding
+    uint16_t channel; // index in the channel table
+    uint16_t pattern; // LVDS pattern
+    uint32_t consumers; // bit n set if published for slot n of the consumer table
+    uint32_t spare;
+    uint64_t time; // trigger time tag as the decoder stores it
+    uint64_t event; // events of this card published before this one
+} live_feed_record;
+
+// Publishes decoded events into a POSIX shared memory ring for monitors. 
+// Writing never waits on readers, who instead notice when they have been
+// lapped, so a slow monitor only misses events. Each record is published only
+// if some monitor's sampling wants it, decided in constant time per monitor.
+class LiveFeed {
+
+    public:
+    
+        // Creates (or replaces) the shared memory object name, which is 
+        // removed again when the feed is destroyed
+        LiveFeed(const std::string &name, size_t ring_bytes);
+        
+        virtual ~LiveFeed();
+        
+        // Adds a channel to the table, returning its index for records, or
+        // the index it already has if a decoder replacing another (e.g. at
+        // a scan point) adds it again with the same samples. With other 
+        // samples it is added again under the same name.
+        uint16_t channel(const std::string &name, uint32_t nsamples, uint32_t bits);
+        
+        // One past the last event recorded for channel, so that a decoder 
+        // replacing another continues its event numbers
+        inline uint64_t events(uint16_t channel) {
+            return next_events[channel];
+        }
+        
+        // Copies a record of channel into the ring, unseen by readers until
+        // publish, if the sampling of any consumer keeps it; samples may be
+        // NULL for channels without samples
+        void record(uint16_t channel, uint16_t pattern, uint64_t time, uint64_t event, const uint16_t *samples);
+        
+        // Makes the records since the last publish visible to readers, and
+        // picks up changes to the consumer table
+        void publish();
+        
+    protected:
+    
+        // Reads the consumer table and the clock sampling decisions use
+        void refresh();
+    
+        std::string name;
+        int fd;
+        size_t size;
+        char *mem, *ring;
+        live_feed_header *header;
+        live_feed_consumer *consumers;
+        live_feed_channel *channels;
+        uint32_t sizes[LIVE_FEED_CHANNELS]; //record bytes of each channel
+        uint64_t next_events[LIVE_FEED_CHANNELS];
+        uint64_t head, records; //written but maybe not yet published
+        uint64_t batch; //position of the first record since the last publish
+        
+        //consumer table as of the last refresh
+        uint32_t active; //slots with a consumer
+        int32_t owners[LIVE_FEED_CONSUMERS];
+        uint32_t prescales[LIVE_FEED_CONSUMERS];
+        double intervals[LIVE_FEED_CONSUMERS]; //seconds between records of a channel, 0 for no limit
+        uint64_t sent[LIVE_FEED_CONSUMERS];
+        //earliest time of the next record of each consumer and channel 
+        //not counting bursts, or 0 if none was sent since the slot was claimed
+        double due[LIVE_FEED_CONSUMERS][LIVE_FEED_CHANNELS];
+        double now, checked; //monotonic seconds at the last refresh and liveness check
+    
+};
+
+#endif
@@ -0,0 +1,398 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <sstream>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "Output.hh"
+#include "DirectFile.hh"
+
+using namespace std;
+using namespace H5;
+
+bool readOutputFilters(RunTable &table, output_filters &filters, uint32_t bits) {
+    filters.deflate = table.isMember("compression") ? table["compression"].cast<int>() : 0;
+    filters.shuffle = table.isMember("shuffle") ? table["shuffle"].cast<bool>() : filters.deflate > 0;
+    filters.nbit = table.isMember("nbit") && table["nbit"].cast<bool>() ? bits : 0;
+    const int threads = table.isMember("compression_threads") ? table["compression_threads"].cast<int>() : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 0) throw runtime_error("compression_threads must be 0 or more");
+    filters.threads = threads ? threads : 1;
+    if (filters.deflate < 0 || filters.deflate > 9) throw runtime_error("compression must be a zlib level 0-9");
+    if (filters.deflate && !H5Zfilter_avail(H5Z_FILTER_DEFLATE)) throw runtime_error("HDF5 was built without deflate");
+    if (filters.nbit && !H5Zfilter_avail(H5Z_FILTER_NBIT)) throw runtime_error("HDF5 was built without nbit");
+    return filters.deflate || filters.shuffle || filters.nbit;
+}
+
+Group outputGroup(H5File &file, const string &path) {
+    if (H5Lexists(file.getId(), path.c_str(), H5P_DEFAULT) > 0) return file.openGroup(path);
+    return file.createGroup(path);
+}
+
+void outputAttribute(H5Object &obj, const string &name, const PredType &type, const void *value) {
+    if (obj.attrExists(name)) {
+        obj.openAttribute(name).write(type,value);
+    } else {
+        DataSpace scalar(0,NULL);
+        obj.createAttribute(name,type,scalar).write(type,value);
+    }
+}
+
+size_t outputRows(H5File &file, const string &path) {
+    if (H5Lexists(file.getId(), path.c_str(), H5P_DEFAULT) <= 0) return 0;
+    hsize_t dims[2];
+    file.openDataSet(path).getSpace().getSimpleExtentDims(dims);
+    return dims[0];
+}
+
+// One chunk to shuffle and deflate as the HDF5 pipeline would
+typedef struct {
+    const char *data; // rows of this chunk
+    size_t bytes; // bytes of rows present, the rest of the chunk is fill
+    vector<char> out;
+    bool failed;
+} chunk_task;
+
+typedef struct {
+    vector<chunk_task> *tasks;
+    size_t first, stride;
+    size_t chunkbytes, typesize;
+    const output_filters *filters;
+} chunk_thread_data;
+
+static void filterChunk(chunk_task &task, size_t chunkbytes, size_t typesize, const output_filters &filters) {
+    vector<char> raw(chunkbytes,0);
+    memcpy(raw.data(),task.data,task.bytes);
+    if (filters.shuffle && typesize > 1) {
+        //byte b of every element is grouped together
+        vector<char> shuffled(chunkbytes);
+        const size_t n = chunkbytes/typesize;
+        for (size_t b = 0; b < typesize; b++) {
+            char *dest = shuffled.data() + b*n;
+            const char *src = raw.data() + b;
+            for (size_t i = 0; i < n; i++) dest[i] = src[i*typesize];
+        }
+        raw.swap(shuffled);
+    }
+    task.failed = false;
+    if (filters.deflate) {
+        uLongf size = compressBound(chunkbytes);
+        task.out.resize(size);
+        task.failed = compress2((Bytef*)task.out.data(),&size,(const Bytef*)raw.data(),chunkbytes,filters.deflate) != Z_OK;
+        task.out.resize(size);
+    } else {
+        task.out.swap(raw);
+    }
+}
+
+static void* chunk_thread(void *_data) {
+    chunk_thread_data *data = (chunk_thread_data*)_data;
+    vector<chunk_task> &tasks = *data->tasks;
+    for (size_t i = data->first; i < tasks.size(); i += data->stride) {
+        filterChunk(tasks[i],data->chunkbytes,data->typesize,*data->filters);
+    }
+    return NULL;
+}
+
+void outputRows(H5File &file, const string &path, const PredType &type, const void *data, size_t nEvents, size_t rowlen, size_t chunk, const output_filters *filters) {
+    const int rank = rowlen ? 2 : 1;
+    hsize_t dims[2] = {nEvents, rowlen};
+    
+    const bool filtered = filters && (filters->deflate || filters->shuffle || filters->nbit);
+    const size_t rowbytes = (rowlen ? rowlen : 1)*type.getSize();
+    if (chunk) {
+        //tiny chunks of per-event values make appends very slow
+        chunk = max(chunk,(size_t)(64<<10)/rowbytes);
+    } else if (filtered) {
+        //equal chunks of at most 1 MiB so no chunk is mostly fill
+        const size_t maxrows = max((size_t)1,(size_t)(1<<20)/rowbytes);
+        const size_t nchunks = max((size_t)1,(nEvents+maxrows-1)/maxrows);
+        chunk = max((size_t)1,(nEvents+nchunks-1)/nchunks);
+    }
+    
+    if (!chunk) {
+        DataSpace space(rank, dims);
+        DataSet dataset = file.createDataSet(path, type, space);
+        if (nEvents) dataset.write(data, type);
+        return;
+    }
+    
+    DataSet dataset;
+    hsize_t offset[2] = {0, 0};
+    if (H5Lexists(file.getId(), path.c_str(), H5P_DEFAULT) > 0) {
+        dataset = file.openDataSet(path);
+        hsize_t cur[2];
+        dataset.getSpace().getSimpleExtentDims(cur);
+        offset[0] = cur[0];
+        hsize_t size[2] = {cur[0]+nEvents, rowlen};
+        dataset.extend(size);
+    } else {
+        hsize_t maxdims[2] = {H5S_UNLIMITED, rowlen};
+        hsize_t chunkdims[2] = {chunk, rowlen};
+        DataSpace space(rank, dims, maxdims);
+        DSetCreatPropList props;
+        props.setChunk(rank, chunkdims);
+        if (filtered) {
+            //nbit packs first, leaving shuffle and deflate the packed bytes
+            IntType filetype(type);
+            if (filters->nbit) {
+                filetype.setPrecision(filters->nbit);
+                props.setNbit();
+            }
+            if (filters->shuffle) props.setShuffle();
+            if (filters->deflate) props.setDeflate(filters->deflate);
+            dataset = file.createDataSet(path, filetype, space, props);
+        } else {
+            dataset = file.createDataSet(path, type, space, props);
+        }
+    }
+    if (!nEvents) return;
+    
+    //rows in a chunk already holding data must go through the pipeline
+    size_t piped = nEvents;
+    if (filtered && !filters->nbit) piped = min(nEvents,(size_t)((chunk - offset[0]%chunk)%chunk));
+    
+    if (piped) {
+        hsize_t count[2] = {piped, rowlen};
+        DataSpace filespace = dataset.getSpace();
+        filespace.selectHyperslab(H5S_SELECT_SET, count, offset);
+        DataSpace memspace(rank, count);
+        dataset.write(data, type, memspace, filespace);
+    }
+    if (piped == nEvents) return;
+    
+    //the remaining chunks start empty, so they are filtered here in parallel
+    vector<chunk_task> tasks;
+    for (size_t row = piped; row < nEvents; row += chunk) {
+        chunk_task task = chunk_task();
+        task.data = (const char*)data + row*rowbytes;
+        task.bytes = min(chunk,nEvents-row)*rowbytes;
+        tasks.push_back(task);
+    }
+    
+    chunk_thread_data proto;
+    proto.tasks = &tasks;
+    proto.chunkbytes = chunk*rowbytes;
+    proto.typesize = type.getSize();
+    proto.filters = filters;
+    const size_t nthreads = min((size_t)filters->threads,tasks.size());
+    if (nthreads <= 1) {
+        proto.first = 0;
+        proto.stride = 1;
+        chunk_thread(&proto);
+    } else {
+        vector<pthread_t> workers(nthreads);
+        vector<chunk_thread_data> threaddata(nthreads,proto);
+        for (size_t t = 0; t < nthreads; t++) {
+            threaddata[t].first = t;
+            threaddata[t].stride = nthreads;
+            if (pthread_create(&workers[t],NULL,&chunk_thread,&threaddata[t])) throw runtime_error("Could not start compression thread");
+        }
+        for (size_t t = 0; t < nthreads; t++) {
+            pthread_join(workers[t],NULL);
+        }
+    }
+    
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (tasks[i].failed) throw runtime_error("Could not deflate a chunk of " + path);
+        hsize_t chunkoffset[2] = {offset[0] + piped + i*chunk, 0};
+        if (H5Dwrite_chunk(dataset.getId(),H5P_DEFAULT,0,chunkoffset,tasks[i].out.size(),tasks[i].out.data()) < 0) throw runtime_error("Could not write a chunk of " + path);
+    }
+}
+
+static void* image_malloc(size_t size, H5FD_file_image_op_t op, void *udata) {
+    return ((core_image*)udata)->mem = malloc(size);
+}
+
+static void* image_memcpy(void *dest, const void *src, size_t size, H5FD_file_image_op_t op, void *udata) {
+    return memcpy(dest,src,size);
+}
+
+static void* image_realloc(void *ptr, size_t size, H5FD_file_image_op_t op, void *udata) {
+    return ((core_image*)udata)->mem = realloc(ptr,size);
+}
+
+static herr_t image_free(void *ptr, H5FD_file_image_op_t op, void *udata) {
+    if (((core_image*)udata)->mem == ptr) ((core_image*)udata)->mem = NULL;
+    free(ptr);
+    return 0;
+}
+
+static void* image_udata_copy(void *udata) {
+    return udata;
+}
+
+static herr_t image_udata_free(void *udata) {
+    return 0;
+}
+
+H5File* outputCoreFile(const string &fname, core_image &image) {
+    image.mem = NULL;
+    FileAccPropList fapl;
+    fapl.setCore(64<<20,false);
+    H5FD_file_image_callbacks_t callbacks = {image_malloc, image_memcpy, image_realloc, image_free, image_udata_copy, image_udata_free, &image};
+    if (H5Pset_file_image_callbacks(fapl.getId(),&callbacks) < 0) throw runtime_error("Could not set file image callbacks");
+    return new H5File(fname, H5F_ACC_TRUNC, FileCreatPropList::DEFAULT, fapl);
+}
+
+size_t outputImageSize(H5File &file, core_image &image) {
+    file.flush(H5F_SCOPE_GLOBAL);
+    //the image ends at the end of allocated space, short of the core buffer
+    const ssize_t size = H5Fget_file_image(file.getId(),NULL,0);
+    if (size < 0 || !image.mem) throw runtime_error("Could not get the image of " + file.getFileName());
+    return size;
+}
+
+uint32_t outputImage(const string &fname, core_image &image, size_t size, size_t depth) {
+    DirectFile out(fname,depth);
+    out.write(image.mem,size);
+    out.close();
+    //the image is still in memory, so this costs no reads
+    uint32_t crc = crc32(0L,Z_NULL,0);
+    for (size_t pos = 0; pos < size; pos += 1<<30) {
+        crc = crc32(crc,(const Bytef*)image.mem+pos,min(size-pos,(size_t)1<<30));
+    }
+    return crc;
+}
+
+uint32_t outputImage(H5File &file, core_image &image, size_t depth) {
+    return outputImage(file.getFileName(),image,outputImageSize(file,image),depth);
+}
+
+string outputPartName(const string &fname) {
+    return fname + ".part";
+}
+
+static void syncdir(const string &fname) {
+    const size_t slash = fname.rfind('/');
+    const string dir = slash == string::npos ? "." : slash ? fname.substr(0,slash) : "/";
+    int fd = open(dir.c_str(),O_RDONLY|O_DIRECTORY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+void outputFinalize(const string &fname, const file_summary &summary, const uint32_t *crc) {
+    const string part = outputPartName(fname);
+    struct stat st;
+    if (stat(part.c_str(),&st)) throw runtime_error("Could not stat " + part);
+    
+    uint32_t sum;
+    if (crc) {
+        sum = *crc;
+    } else {
+        int fd = open(part.c_str(),O_RDONLY);
+        if (fd < 0) throw runtime_error("Could not read back " + part);
+        vector<char> buf(4<<20);
+        sum = crc32(0L,Z_NULL,0);
+        for (;;) {
+            ssize_t len = read(fd,buf.data(),buf.size());
+            if (len < 0) {
+                close(fd);
+                throw runtime_error("Could not read back " + part);
+            }
+            if (len == 0) break;
+            sum = crc32(sum,(const Bytef*)buf.data(),len);
+        }
+        close(fd);
+    }
+    
+    //the sidecar is a RunDB table, readable with the run configuration
+    const size_t slash = fname.rfind('/');
+    ostringstream out;
+    char hex[16];
+    snprintf(hex,sizeof(hex),"0x%08X",sum);
+    out << "{\nname: \"FILE\",\n";
+    out << "index: \"" << (slash == string::npos ? fname : fname.substr(slash+1)) << "\",\n";
+    out << "bytes: " << (uint64_t)st.st_size << ",\n";
+    out << "crc32: " << hex << ",\n";
+    out << "cards: [";
+    for (size_t i = 0; i < summary.cards.size(); i++) out << (i ? ", \"" : "\"") << summary.cards[i] << "\"";
+    out << "],\nevents: [";
+    for (size_t i = 0; i < summary.events.size(); i++) out << (i ? ", " : "") << summary.events[i];
+    out << "],\nseconds: " << summary.seconds << ",\n";
+    out << "finished_unix_timestamp: " << time(NULL) << ",\n}\n";
+    const string text = out.str();
+    
+    const string sidecar = fname + ".sum", sidepart = outputPartName(sidecar);
+    int fd = open(sidepart.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd < 0) throw runtime_error("Could not open " + sidepart);
+    if (write(fd,text.data(),text.size()) != (ssize_t)text.size() || fsync(fd)) {
+        close(fd);
+        throw runtime_error("Could not write " + sidepart);
+    }
+    close(fd);
+    if (rename(sidepart.c_str(),sidecar.c_str())) throw runtime_error("Could not rename " + sidepart);
+    if (rename(part.c_str(),fname.c_str())) throw runtime_error("Could not rename " + part);
+    syncdir(fname);
+}
+
+OutputBatch::OutputBatch() : nbytes(0) {
+
+}
+
+OutputBatch::~OutputBatch() {
+
+}
+
+void OutputBatch::group(const string &path) {
+    ops.push_back([path](H5File &file) {
+        outputGroup(file,path);
+    });
+}
+
+void OutputBatch::attribute(const string &path, const string &name, const PredType &type, const void *value, size_t size) {
+    //predefined types are static, so only a pointer is kept
+    const PredType *ptype = &type;
+    shared_ptr<vector<char>> copy(new vector<char>((const char*)value,(const char*)value+size));
+    ops.push_back([path,name,ptype,copy](H5File &file) {
+        Group group = outputGroup(file,path);
+        outputAttribute(group,name,*ptype,copy->data());
+    });
+}
+
+void OutputBatch::rows(const string &path, const PredType &type, const void *data, size_t size, size_t nEvents, size_t rowlen, size_t chunk, const output_filters *filters) {
+    const PredType *ptype = &type;
+    size *= nEvents*(rowlen ? rowlen : 1);
+    shared_ptr<vector<char>> copy(new vector<char>((const char*)data,(const char*)data+size));
+    const bool filtered = filters != NULL;
+    output_filters filtercopy;
+    if (filtered) filtercopy = *filters;
+    ops.push_back([path,ptype,copy,nEvents,rowlen,chunk,filtered,filtercopy](H5File &file) {
+        outputRows(file,path,*ptype,copy->data(),nEvents,rowlen,chunk,filtered ? &filtercopy : NULL);
+    });
+    nbytes += size;
+}
+
+void OutputBatch::add(const function<void(H5File&)> &op) {
+    ops.push_back(op);
+}
+
+void OutputBatch::write(H5File &file) {
+    for (size_t i = 0; i < ops.size(); i++) {
+        ops[i](file);
+    }
+}
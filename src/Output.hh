@@ -0,0 +1,143 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "RunDB.hh"
+#include "H5Cpp.h"
+
+#ifndef Output__hh
+#define Output__hh
+
+// HDF5 filters for sample datasets, which need chunked storage
+typedef struct {
+    int deflate; // zlib level 1-9 (0 disables)
+    bool shuffle; // byte shuffle ahead of deflate
+    uint32_t nbit; // significant bits to pack samples to (0 disables)
+    uint32_t threads; // shuffle and deflate chunks in parallel without nbit
+} output_filters;
+
+// Reads compression, shuffle, nbit, and compression_threads from a digitizer
+// table where samples have the given significant bits, and returns true if 
+// any filter is used
+bool readOutputFilters(RunTable &table, output_filters &filters, uint32_t bits);
+
+// Returns the group at path, creating it on first use
+H5::Group outputGroup(H5::H5File &file, const std::string &path);
+
+// Writes a scalar attribute, replacing the value if it already exists
+void outputAttribute(H5::H5Object &obj, const std::string &name, const H5::PredType &type, const void *value);
+
+// Number of rows in the dataset at path (0 if it does not exist)
+size_t outputRows(H5::H5File &file, const std::string &path);
+
+// Writes nEvents rows of rowlen values (0 for a 1D dataset) to path. With 
+// chunk = 0 a dataset of exactly nEvents rows is created. Otherwise the 
+// dataset is created chunked by chunk rows (at least 64 KiB) with an 
+// unlimited first dimension and later calls extend it, appending the rows 
+// with a hyperslab write.
+// Filters force chunking, in equal chunks of up to 1 MiB if chunk is 0.
+// Without nbit, chunks are shuffled and deflated by filters.threads threads
+// and written directly, bypassing the serial HDF5 filter pipeline.
+void outputRows(H5::H5File &file, const std::string &path, const H5::PredType &type, const void *data, size_t nEvents, size_t rowlen, size_t chunk, const output_filters *filters = NULL);
+
+// Memory of a file built by the core driver, tracked so its image can be
+// written out in place rather than copied
+typedef struct {
+    void *mem;
+} core_image;
+
+// Creates fname in memory with the core driver, tracking its memory in image
+H5::H5File* outputCoreFile(const std::string &fname, core_image &image);
+
+// Writes a file from outputCoreFile to its name through DirectFile with 
+// depth writes in flight, returning the CRC-32 of the image
+uint32_t outputImage(H5::H5File &file, core_image &image, size_t depth);
+
+// The two halves of the above: flushing a file from outputCoreFile and 
+// sizing its image, then writing the image to fname, which makes no HDF5
+// calls and so needs no lock where several threads share HDF5
+size_t outputImageSize(H5::H5File &file, core_image &image);
+uint32_t outputImage(const std::string &fname, core_image &image, size_t size, size_t depth);
+
+// Name a file is written under until outputFinalize renames it, so files
+// with their final names are always complete
+std::string outputPartName(const std::string &fname);
+
+// What the sidecar of a finished file records besides its size and CRC-32
+typedef struct {
+    std::vector<std::string> cards;
+    std::vector<uint64_t> events; // per card
+    double seconds; // wall time covered by the file
+} file_summary;
+
+// Writes <fname>.sum describing the synced part file of fname, then renames
+// the part file to fname. The sidecar is renamed into place first, so both
+// appear atomically. The CRC-32 is read back from the file unless given.
+void outputFinalize(const std::string &fname, const file_summary &summary, const uint32_t *crc = NULL);
+
+// Output operations recorded with copies of their data, so decoders can 
+// release events immediately and the file can be written by another thread.
+// Recording makes no HDF5 calls, so it is safe alongside a writer thread.
+class OutputBatch {
+
+    public:
+    
+        OutputBatch();
+        
+        virtual ~OutputBatch();
+        
+        // As outputGroup
+        void group(const std::string &path);
+        
+        // As outputAttribute on the group at path
+        template <typename T> 
+        inline void attribute(const std::string &path, const std::string &name, const H5::PredType &type, const T *value) {
+            attribute(path,name,type,value,sizeof(T));
+        }
+        
+        // As outputRows
+        template <typename T> 
+        inline void rows(const std::string &path, const H5::PredType &type, const T *data, size_t nEvents, size_t rowlen, size_t chunk, const output_filters *filters = NULL) {
+            rows(path,type,data,sizeof(T),nEvents,rowlen,chunk,filters);
+        }
+        
+        // Any other operation, which must own the data it needs
+        void add(const std::function<void(H5::H5File&)> &op);
+        
+        // Applies the operations in the order they were recorded
+        void write(H5::H5File &file);
+        
+        // Data held by the recorded operations
+        inline size_t bytes() {
+            return nbytes;
+        }
+        
+    protected:
+    
+        std::vector<std::function<void(H5::H5File&)>> ops;
+        size_t nbytes;
+        
+        void attribute(const std::string &path, const std::string &name, const H5::PredType &type, const void *value, size_t size);
+        
+        void rows(const std::string &path, const H5::PredType &type, const void *data, size_t size, size_t nEvents, size_t rowlen, size_t chunk, const output_filters *filters);
+        
+};
+
+#endif
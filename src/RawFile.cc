@@ -0,0 +1,85 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "RawFile.hh"
+#include "Digitizer.hh"
+
+using namespace std;
+
+RawFile::RawFile(const string &_base, size_t direct_depth) : base(_base), raw(-1), idx(-1), written(0), rawdirect(NULL), idxdirect(NULL) {
+    rawcrc = idxcrc = crc32(0L,Z_NULL,0);
+    const string rawpart = outputPartName(base+".raw"), idxpart = outputPartName(base+".idx");
+    if (direct_depth) {
+        rawdirect = new DirectFile(rawpart,direct_depth);
+        try {
+            idxdirect = new DirectFile(idxpart,direct_depth,1<<20);
+        } catch (runtime_error &e) {
+            delete rawdirect;
+            throw;
+        }
+        return;
+    }
+    raw = open(rawpart.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (raw < 0) throw runtime_error("Could not open " + rawpart);
+    idx = open(idxpart.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (idx < 0) {
+        close(raw);
+        throw runtime_error("Could not open " + idxpart);
+    }
+}
+
+RawFile::~RawFile() {
+    if (rawdirect) delete rawdirect;
+    if (idxdirect) delete idxdirect;
+    if (raw >= 0) close(raw);
+    if (idx >= 0) close(idx);
+}
+
+void RawFile::append(const char *data, size_t size, vector<raw_index_entry> &entries) {
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].offset += written;
+        entries[i].aggregate += written;
+    }
+    if (rawdirect) {
+        rawdirect->write(data,size);
+        if (entries.size()) idxdirect->write(entries.data(),entries.size()*sizeof(raw_index_entry));
+    } else {
+        //whole readout buffers go out in one write to keep the disk streaming
+        writeall(raw,data,size);
+        if (entries.size()) writeall(idx,entries.data(),entries.size()*sizeof(raw_index_entry));
+    }
+    written += size;
+    rawcrc = crc32(rawcrc,(const Bytef*)data,size);
+    idxcrc = crc32(idxcrc,(const Bytef*)entries.data(),entries.size()*sizeof(raw_index_entry));
+}
+
+void RawFile::finish(const file_summary &summary) {
+    if (rawdirect) {
+        rawdirect->close();
+        idxdirect->close();
+    } else {
+        fsync(raw);
+        fsync(idx);
+    }
+    outputFinalize(base+".raw",summary,&rawcrc);
+    outputFinalize(base+".idx",summary,&idxcrc);
+}
@@ -0,0 +1,74 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "DirectFile.hh"
+#include "Output.hh"
+
+#ifndef RawFile__hh
+#define RawFile__hh
+
+// One record of a raw file's side index, in native byte order. Offsets are
+// bytes from the start of the raw file.
+typedef struct {
+    uint64_t offset; // first word of the event
+    uint64_t aggregate; // first word of the board aggregate holding the event
+    uint64_t time; // trigger time tag as the decoder would store it
+    uint32_t size; // bytes in the event
+    uint32_t count; // board aggregate or event counter
+    uint16_t channel; // V1730 channel, or V1742 group mask
+    uint16_t pattern; // LVDS pattern
+    uint32_t reserved;
+} raw_index_entry;
+
+// Appends readout buffers verbatim to <base>.raw and their index records to
+// <base>.idx, so decoding can be done offline. Both are written under their
+// part names and keep a running CRC-32 for their sidecars.
+class RawFile {
+
+    public:
+    
+        // With direct_depth > 0 both files are written through DirectFile
+        // with that many writes in flight
+        RawFile(const std::string &base, size_t direct_depth = 0);
+        
+        virtual ~RawFile();
+        
+        // Writes size bytes of readout data and entries, whose offsets are
+        // relative to data and are shifted to the position in the file
+        void append(const char *data, size_t size, std::vector<raw_index_entry> &entries);
+        
+        // Flushes both files to disk and finalizes them with summary, after
+        // which nothing may be appended
+        void finish(const file_summary &summary);
+        
+        inline size_t bytes() { return written; }
+        
+    protected:
+    
+        std::string base;
+        int raw, idx;
+        size_t written;
+        uint32_t rawcrc, idxcrc;
+        DirectFile *rawdirect, *idxdirect;
+
+};
+
+#endif
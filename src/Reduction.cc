@@ -0,0 +1,162 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include "Reduction.hh"
+
+using namespace std;
+using namespace H5;
+
+static int reductionField(RunTable &table, const string &key, size_t idx) {
+    json::Value &val = table[key];
+    if (val.getType() == json::TARRAY) return val[idx].cast<int>();
+    return val.cast<int>();
+}
+
+bool readReductionConfig(RunTable &table, reduction_config &config, size_t idx) {
+    if (!table.isMember("sigstart")) return false;
+    config.sigstart = reductionField(table,"sigstart",idx);
+    config.sigend = reductionField(table,"sigend",idx);
+    config.pedstart = reductionField(table,"pedstart",idx);
+    config.pedend = reductionField(table,"pedend",idx);
+    if (table.isMember("threshold")) {
+        json::Value &val = table["threshold"];
+        config.threshold = val.getType() == json::TARRAY ? val[idx].cast<double>() : val.cast<double>();
+    } else {
+        config.threshold = 0.0;
+    }
+    config.cfdwindow = table.isMember("cfdwindow") ? reductionField(table,"cfdwindow",idx) : -1;
+    return true;
+}
+
+Reducer::Reducer(const reduction_config &_config, size_t _nsamples, double _V_adc, double _ps_sample) : 
+    config(_config), nsamples(_nsamples), V_adc(_V_adc), ps_sample(_ps_sample) {
+    
+    if (config.pedstart < 0 || config.pedend <= config.pedstart || (size_t)config.pedend > nsamples) 
+        throw runtime_error("Reduction pedestal window must lie within " + to_string(nsamples) + " samples");
+    if (config.sigstart < 1 || config.sigend <= config.sigstart || (size_t)config.sigend > nsamples) 
+        throw runtime_error("Reduction signal window must lie within 1 to " + to_string(nsamples) + " samples");
+    if (config.cfdwindow != -1 && (config.cfdwindow < 0 || config.threshold <= 0.0)) 
+        throw runtime_error("Reduction cfdwindow must be at least 0 and needs a positive threshold (negative pulses)");
+    
+    //convert threshold from mV to ADC here
+    thresh_adc = config.threshold / (V_adc*1000.0);
+}
+
+Reducer::~Reducer() {
+
+}
+
+void Reducer::reduce(const uint16_t *data) {
+    
+    //simple integer sums so the compiler can vectorize them
+    uint32_t pedsum = 0, sigsum = 0;
+    for (int j = config.pedstart; j < config.pedend; j++) pedsum += data[j];
+    for (int j = config.sigstart; j < config.sigend; j++) sigsum += data[j];
+    
+    const double ped = (double)pedsum / (config.pedend - config.pedstart);
+    pedmean.push_back(1000.0*V_adc*ped);
+    sigcharge.push_back(-ps_sample * V_adc * (sigsum - ped * (config.sigend - config.sigstart)));
+    
+    if (thresh_adc > 0.0) { //downward going pulses
+        double time = -1.0;
+        for (int j = config.sigstart; j < config.sigend; j++) {
+            if (ped - data[j] > thresh_adc) {
+                if (config.cfdwindow != -1) {
+                    //as integrator: half the peak within cfdwindow after the
+                    //threshold crossing, searched for within cfdwindow of it
+                    const int end = min(config.sigend-1,j+config.cfdwindow);
+                    const int begin = max(config.sigstart,j-config.cfdwindow);
+                    double peak = ped;
+                    for (int k = j; k <= end; k++) if (data[k] < peak) peak = data[k];
+                    const double cfd = round((ped-peak)*0.5);
+                    if (cfd < thresh_adc) continue;
+                    for (int k = begin; k <= end; k++) {
+                        if (ped - data[k] > cfd) {
+                            const double prev = ped - data[k-1];
+                            const double cur = ped - data[k];
+                            time = ps_sample*((cfd-prev)/(cur-prev)+k);
+                            break;
+                        }
+                    }
+                    if (time != -1.0) break;
+                    continue;
+                }
+                const double prev = ped - data[j-1];
+                const double cur = ped - data[j];
+                time = ps_sample*((thresh_adc-prev)/(cur-prev)+j);
+                break;
+            }
+        }
+        crossing.push_back(time);
+    } else if (thresh_adc < 0.0) { //upward going pulses
+        double time = -1.0;
+        for (int j = config.sigstart; j < config.sigend; j++) {
+            if (ped - data[j] < thresh_adc) {
+                const double prev = data[j-1] - ped;
+                const double cur = data[j] - ped;
+                time = ps_sample*((-thresh_adc-prev)/(cur-prev)+j);
+                break;
+            }
+        }
+        crossing.push_back(time);
+    }
+    
+}
+
+void Reducer::writeOut(OutputBatch &batch, const string &groupname, size_t nEvents, size_t chunk) {
+    
+    int32_t ival;
+    double dval;
+    
+    ival = config.pedstart;
+    batch.attribute(groupname,"pedstart",PredType::NATIVE_INT32,&ival);
+    
+    ival = config.pedend;
+    batch.attribute(groupname,"pedend",PredType::NATIVE_INT32,&ival);
+    
+    ival = config.sigstart;
+    batch.attribute(groupname,"sigstart",PredType::NATIVE_INT32,&ival);
+    
+    ival = config.sigend;
+    batch.attribute(groupname,"sigend",PredType::NATIVE_INT32,&ival);
+    
+    dval = config.threshold;
+    batch.attribute(groupname,"crossing_threshold",PredType::NATIVE_DOUBLE,&dval);
+    
+    ival = config.cfdwindow;
+    batch.attribute(groupname,"cfdwindow",PredType::NATIVE_INT32,&ival);
+    
+    cout << "\t" << groupname << "/pedmean" << endl;
+    batch.rows(groupname+"/pedmean", PredType::NATIVE_DOUBLE, pedmean.data(), nEvents, 0, chunk);
+    pedmean.erase(pedmean.begin(), pedmean.begin()+nEvents);
+    
+    cout << "\t" << groupname << "/sigcharge" << endl;
+    batch.rows(groupname+"/sigcharge", PredType::NATIVE_DOUBLE, sigcharge.data(), nEvents, 0, chunk);
+    sigcharge.erase(sigcharge.begin(), sigcharge.begin()+nEvents);
+    
+    if (thresh_adc != 0.0) {
+        cout << "\t" << groupname << "/crossing" << endl;
+        batch.rows(groupname+"/crossing", PredType::NATIVE_DOUBLE, crossing.data(), nEvents, 0, chunk);
+        crossing.erase(crossing.begin(), crossing.begin()+nEvents);
+    }
+    
+}
@@ -0,0 +1,71 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <string>
+
+#include "RunDB.hh"
+#include "Output.hh"
+#include "H5Cpp.h"
+
+#ifndef Reduction__hh
+#define Reduction__hh
+
+// Parameters for extracting pedestal, charge, and threshold crossing times
+// from traces as they are decoded, using the same definitions as integrator
+typedef struct {
+    int pedstart, pedend; // samples to average for the pedestal
+    int sigstart, sigend; // samples to integrate for the charge
+    double threshold; // mV past pedestal for crossing time (positive for negative pulses, 0 disables)
+    int cfdwindow; // samples searched for the peak to time at half its height instead (-1 disables)
+} reduction_config;
+
+// Reads reduction settings from a table (scalars or arrays indexed by idx)
+// and returns true if the table requests a reduction
+bool readReductionConfig(RunTable &table, reduction_config &config, size_t idx = 0);
+
+class Reducer {
+
+    public:
+    
+        Reducer(const reduction_config &config, size_t nsamples, double V_adc, double ps_sample);
+        
+        virtual ~Reducer();
+        
+        // Appends pedmean, sigcharge, and crossing for one trace
+        void reduce(const uint16_t *data);
+        
+        // Number of reduced events buffered
+        inline size_t reduced() { 
+            return sigcharge.size(); 
+        }
+        
+        // Records the first nEvents reduced values for groupname and drops 
+        // them (appending to chunked datasets if chunk is nonzero)
+        void writeOut(OutputBatch &batch, const std::string &groupname, size_t nEvents, size_t chunk = 0);
+        
+    protected:
+    
+        reduction_config config;
+        size_t nsamples;
+        double V_adc, ps_sample, thresh_adc;
+        
+        std::vector<double> pedmean, sigcharge, crossing;
+        
+};
+
+#endif
@@ -16,6 +16,7 @@
  */
 
 #include <fstream>
+#include <sstream>
 
 #include "RunDB.hh"
 
@@ -34,6 +35,19 @@ void RunDB::addFile(string file) {
     json::Reader reader(dbfile);
     dbfile.close();
     
+    addTables(reader);
+    
+}
+
+void RunDB::addString(const string &str) {
+
+    json::Reader reader(str);
+    addTables(reader);
+    
+}
+
+void RunDB::addTables(json::Reader &reader) {
+
     json::Value next;
     while (reader.getValue(next)) {
         if (next.getType() != json::TOBJECT) throw runtime_error("DB contains non-object values");
@@ -76,3 +90,18 @@ vector<RunTable> RunDB::getGroup(string name) {
     }
     return group;
 }
+
+vector<RunTable> RunDB::getIndexed(string index) {
+    vector<RunTable> tables;
+    for (map<string,map<string,RunTable>>::iterator iter = db.begin(); iter != db.end(); iter++) {
+        if (iter->second.count(index)) tables.push_back(iter->second[index]);
+    }
+    return tables;
+}
+
+string RunTable::toJSON() const {
+    ostringstream out;
+    json::Writer writer(out);
+    writer.putValue(*this);
+    return out.str();
+}
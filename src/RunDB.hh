@@ -58,6 +58,9 @@ class RunTable : protected json::Value {
             return index;
         }
         
+        // The table as JSON text, to tell whether two tables differ
+        std::string toJSON() const;
+        
     protected:
     
         std::string name, index;
@@ -74,6 +77,9 @@ class RunDB {
 
         void addFile(std::string file);
         
+        // Adds the tables in a string, such as a run_config attribute
+        void addString(const std::string &str);
+        
         bool tableExists(std::string name, std::string index = "");
         
         RunTable getTable(std::string name, std::string index = "");
@@ -82,9 +88,14 @@ class RunDB {
         
         std::vector<RunTable> getGroup(std::string name);
         
+        // Every table with this index, whatever its name, in name order
+        std::vector<RunTable> getIndexed(std::string index);
+        
     protected:
     
         std::map<std::string,std::map<std::string,RunTable>> db;
+        
+        void addTables(json::Reader &reader);
 
 };
 
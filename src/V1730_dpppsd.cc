@@ -20,6 +20,7 @@
 #include <stdexcept>
  
 #include "V1730_dpppsd.hh"
+#include "Output.hh"
 
 using namespace std;
 
@@ -39,6 +40,11 @@ V1730Settings::V1730Settings() : DigitizerSettings("") {
     card.external_trg_out = 0; // 1 bit
     card.software_trg_out = 0; // 1 bit
     card.max_board_agg_blt = 5;
+    store_samples = true;
+    filters.deflate = 0;
+    filters.shuffle = false;
+    filters.nbit = 0;
+    filters.threads = 1;
     
     for (uint32_t ch = 0; ch < 16; ch++) {
         chanDefaults(ch);
@@ -64,6 +70,17 @@ V1730Settings::V1730Settings(RunTable &digitizer, RunDB &db) : DigitizerSettings
     card.software_trg_out = digitizer["external_trigger_out"].cast<bool>() ? 1 : 0; // 1 bit
     card.max_board_agg_blt = digitizer["aggregates_per_transfer"].cast<int>(); 
     
+    //list mode only reads out time tag, baseline, and charges (no waveforms)
+    if (digitizer.isMember("list_mode") && digitizer["list_mode"].cast<bool>()) {
+        card.oscilloscope_mode = 0; // 1 bit
+    }
+    
+    //waveforms can be dropped from the output when reductions are enough
+    store_samples = digitizer.isMember("store_samples") ? digitizer["store_samples"].cast<bool>() : true;
+    
+    //samples are 14 bit
+    readOutputFilters(digitizer,filters,14);
+    
     for (int ch = 0; ch < 16; ch++) {
         if (ch%2 == 0) {
             string grname = "GR"+to_string(ch/2);
@@ -113,6 +130,8 @@ V1730Settings::V1730Settings(RunTable &digitizer, RunDB &db) : DigitizerSettings
             chans[ch].shaped_trigger_width = channel["shaped_trigger_width"].cast<int>(); // 10 bit
             chans[ch].trigger_holdoff = channel["trigger_holdoff"].cast<int>(); // 10* bit
             chans[ch].trigger_config = channel["trigger_type"].cast<int>(); // 2 bit (see docs)
+            
+            reduce[ch] = readReductionConfig(channel,reductions[ch]);
         }
     }
 }
@@ -121,6 +140,12 @@ V1730Settings::~V1730Settings() {
 
 }
         
+void V1730Settings::roundRecordLengths() {
+    for (size_t gr = 0; gr < 8; gr++) {
+        if (groups[gr].record_length % 8) groups[gr].record_length = (groups[gr].record_length/8+1)*8;
+    }
+}
+        
 void V1730Settings::validate() { //FIXME validate bit fields too
     for (int ch = 0; ch < 16; ch++) {
         if (ch % 2 == 0) {
@@ -158,6 +183,7 @@ void V1730Settings::chanDefaults(uint32_t ch) {
     chans[ch].baseline_mean = 3; // 3 bit (fixed,16,64,256,1024)
     chans[ch].self_trigger = 1; // 1 bit (0->enabled, 1->disabled)
     chans[ch].dc_offset = 0x8000; // 16 bit (-1V to 1V)
+    reduce[ch] = false;
 }
 
 void V1730Settings::groupDefaults(uint32_t gr) {
@@ -256,7 +282,8 @@ bool V1730::program(DigitizerSettings &_settings) {
         }
         
         if (settings.chans[ch].enabled) {
-            buffer_sizes[ch/2] = (2 + settings.groups[ch/2].record_length/8)*settings.groups[ch/2].ev_per_buffer;
+            const uint32_t wave_locs = settings.getListMode() ? 0 : settings.groups[ch/2].record_length/8;
+            buffer_sizes[ch/2] = (2 + wave_locs)*settings.groups[ch/2].ev_per_buffer;
         }
         
         write32(REG_NEV_AGGREGATE|(ch<<8),settings.groups[ch/2].ev_per_buffer);
@@ -308,6 +335,30 @@ bool V1730::program(DigitizerSettings &_settings) {
     return true;
 }
 
+bool V1730::retune(DigitizerSettings &_current, DigitizerSettings &_next, const vector<string> &keys) {
+    V1730Settings &current = dynamic_cast<V1730Settings&>(_current);
+    V1730Settings &next = dynamic_cast<V1730Settings&>(_next);
+    
+    //CH tables also set triggering and gates, which program() orders itself
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] != "trigger_threshold" && keys[i] != "dc_offset") return false;
+    }
+    
+    for (int ch = 0; ch < 16; ch++) {
+        if (!current.chans[ch].enabled) continue;
+        if (current.chans[ch].trg_threshold != next.chans[ch].trg_threshold) {
+            current.chans[ch].trg_threshold = next.chans[ch].trg_threshold;
+            write32(REG_DPP_TRG_THRESHOLD|(ch<<8),current.chans[ch].trg_threshold);
+        }
+        if (current.chans[ch].dc_offset != next.chans[ch].dc_offset) {
+            current.chans[ch].dc_offset = next.chans[ch].dc_offset;
+            write32(REG_DC_OFFSET|(ch<<8),current.chans[ch].dc_offset);
+        }
+    }
+    
+    return true;
+}
+
 void V1730::softTrig() {
     write32(REG_SOFTWARE_TRIGGER,0xDEADBEEF);
 }
@@ -369,21 +420,28 @@ size_t V1730::readoutBLT_evtsz(char *buffer, size_t buffer_size) {
 V1730Decoder::V1730Decoder(size_t _eventBuffer, V1730Settings &_settings) : eventBuffer(_eventBuffer), settings(_settings) {
 
     dispatch_index = decode_counter = chanagg_counter = boardagg_counter = 0;
+    feed_events = 0;
     
     for (size_t ch = 0; ch < 16; ch++) {
         if (settings.getEnabled(ch)) {
             chan2idx[ch] = nsamples.size();
             idx2chan[nsamples.size()] = ch;
-            nsamples.push_back(settings.getRecordLength(ch));
+            nsamples.push_back(settings.getListMode() ? 0 : settings.getRecordLength(ch));
             grabbed.push_back(0);
             if (eventBuffer > 0) {
-                grabs.push_back(new uint16_t[eventBuffer*nsamples.back()]);
+                grabs.push_back(nsamples.back() ? new uint16_t[eventBuffer*nsamples.back()] : NULL);
                 patterns.push_back(new uint16_t[eventBuffer]);
                 baselines.push_back(new uint16_t[eventBuffer]);
                 qshorts.push_back(new uint16_t[eventBuffer]);
                 qlongs.push_back(new uint16_t[eventBuffer]);
                 times.push_back(new uint64_t[eventBuffer]);
             }
+            reduction_config config;
+            if (settings.getReduction(ch,config) && nsamples.back() && eventBuffer > 0) {
+                reducers.push_back(new Reducer(config,nsamples.back(),2.0/pow(2.0,14.0),2000.0));
+            } else {
+                reducers.push_back(NULL);
+            }
         }
     }
     
@@ -400,6 +458,9 @@ V1730Decoder::~V1730Decoder() {
         delete [] qlongs[i];
         delete [] times[i];
     }
+    for (size_t i = 0; i < reducers.size(); i++) {
+        if (reducers[i]) delete reducers[i];
+    }
 }
 
 void V1730Decoder::decode(Buffer &buf) {
@@ -422,6 +483,63 @@ void V1730Decoder::decode(Buffer &buf) {
     }
 }
 
+size_t V1730Decoder::index(const char *data, size_t size, vector<raw_index_entry> &entries) {
+    if (size % 4) throw runtime_error("Readout of " + settings.getIndex() + " is not whole words");
+    const uint32_t *start = (const uint32_t*)data, *end = start + size/4;
+    
+    size_t triggers = 0; //events of the first enabled channel
+    for (const uint32_t *boardagg = start; boardagg < end; ) {
+        if (boardagg[0] == 0xFFFFFFFF) {
+            boardagg++; //sometimes padded
+            continue;
+        }
+        if ((boardagg[0] & 0xF0000000) != 0xA0000000) 
+            throw runtime_error("Board aggregate missing tag");
+        const uint32_t aggsize = boardagg[0] & 0x0FFFFFFF;
+        const uint32_t *aggend = boardagg + aggsize;
+        if (aggsize < 4 || aggend > end) throw runtime_error("Board aggregate overruns readout of " + settings.getIndex());
+        
+        const uint16_t pattern = (boardagg[1] >> 8) & 0x7FFF;
+        const uint32_t mask = boardagg[1] & 0xFF;
+        const uint32_t count = boardagg[2] & 0x7FFFFF;
+        
+        const uint32_t *chanagg = boardagg+4;
+        for (uint32_t gr = 0; gr < 8; gr++) {
+            if (!(mask & (1 << gr))) continue;
+            if (chanagg+2 > aggend) throw runtime_error("Channel aggregate overruns board aggregate");
+            if (!(chanagg[0] & 0x80000000)) throw runtime_error("Channel format not found");
+            const uint32_t chsize = chanagg[0] & 0x7FFF;
+            if (chanagg + chsize > aggend) throw runtime_error("Channel aggregate overruns board aggregate");
+            const uint32_t format = chanagg[1];
+            const uint32_t samples = format & (1<<27) ? (format & 0xFFF)*8 : 0;
+            const uint32_t evsize = samples/2+3;
+            
+            for (const uint32_t *event = chanagg+2; (size_t)(event-chanagg+1) < chsize; event += evsize) {
+                const uint32_t chan = gr*2 + (event[0] & 0x80000000 ? 1 : 0);
+                if (!chan2idx.count(chan)) throw runtime_error("Received data for disabled channel (" + to_string(chan) + ")");
+                const uint32_t idx = chan2idx[chan];
+                if (nsamples[idx] != samples) throw runtime_error("Number of samples received " + to_string(samples) + " does not match expected " + to_string(nsamples[idx]) + " (" + to_string(chan) + ")");
+                if (event + evsize > chanagg + chsize) throw runtime_error("Event overruns channel aggregate");
+                
+                raw_index_entry entry;
+                entry.offset = (event-start)*4;
+                entry.aggregate = (boardagg-start)*4;
+                entry.time = ((uint64_t)(event[0] & 0x7FFFFFFF)) | (((uint64_t)(event[1+samples/2+0]&0xFFFF0000))<<15);
+                entry.size = evsize*4;
+                entry.count = count;
+                entry.channel = chan;
+                entry.pattern = pattern;
+                entry.reserved = 0;
+                entries.push_back(entry);
+                if (idx == 0) triggers++;
+            }
+            chanagg += chsize;
+        }
+        boardagg = aggend;
+    }
+    return triggers;
+}
+
 size_t V1730Decoder::eventsReady() {
     size_t grabs = grabbed[0];
     for (size_t idx = 1; idx < grabbed.size(); idx++) {
@@ -430,121 +548,118 @@ size_t V1730Decoder::eventsReady() {
     return grabs;
 }
 
-// length, lvdsidx, dsize, nsamples, samples[], strlen, strname[]
-
-void V1730Decoder::dispatch(int nfd, int *fds) {
+void V1730Decoder::dispatch(LiveFeed &feed) {
     
-    size_t ready = eventsReady();
+    if (!eventBuffer || nsamples.empty()) return;
     
-    for ( ; dispatch_index < ready; dispatch_index++) {
+    if (feed_channels.empty()) {
         for (size_t i = 0; i < nsamples.size(); i++) {
-            uint8_t lvdsidx = patterns[i][dispatch_index] & 0xFF; 
-            uint8_t dsize = 2;
-            uint16_t nsamps = nsamples[i];
-            uint16_t *samples = &grabs[i][nsamps*dispatch_index];
-            string strname = "/"+settings.getIndex()+"/ch" + to_string(idx2chan[i]);
-            uint16_t strlen = strname.length();
-            uint16_t length = 2+strlen+2+nsamps*2+1+1;
-            for (int j = 0; j < nfd; j++) {
-                writeall(fds[j],&length,2);
-                writeall(fds[j],&lvdsidx,1);
-                writeall(fds[j],&dsize,1);
-                writeall(fds[j],&nsamps,2);
-                writeall(fds[j],samples,nsamps*2);
-                writeall(fds[j],&strlen,2);
-                writeall(fds[j],strname.c_str(),strlen);
-            }
+            feed_channels.push_back(feed.channel("/"+settings.getIndex()+"/ch"+to_string(idx2chan[i]),nsamples[i],14));
+            if (feed.events(feed_channels.back()) > feed_events) feed_events = feed.events(feed_channels.back());
+        }
+    }
+    
+    const size_t ready = eventsReady();
+    for ( ; dispatch_index < ready; dispatch_index++, feed_events++) {
+        for (size_t i = 0; i < nsamples.size(); i++) {
+            const uint16_t *samples = nsamples[i] ? &grabs[i][nsamples[i]*dispatch_index] : NULL;
+            feed.record(feed_channels[i],patterns[i][dispatch_index],times[i][dispatch_index],feed_events,samples);
         }
     }
 }
 
+HistogramSet* V1730Decoder::newHistograms() {
+    if (!eventBuffer || nsamples.empty()) return NULL;
+    HistogramSet *set = new HistogramSet(settings.getIndex());
+    hist_channels.clear();
+    for (size_t i = 0; i < nsamples.size(); i++) {
+        const string ch = "ch" + to_string(idx2chan[i]);
+        hist_channels.push_back(set->add(ch+"/qshorts",4096,0.0,32768.0));
+        set->add(ch+"/qlongs",4096,0.0,65536.0);
+        set->add(ch+"/psd",1200,-0.1,1.1);
+    }
+    hist_patterns = set->add("patterns",65536,0.0,65536.0);
+    return set;
+}
+
+bool V1730Decoder::getPatterns(size_t nEvents, vector<uint16_t> &_patterns) {
+    //all channels see card-wide triggers, so use the first enabled one
+    if (patterns.empty()) return false;
+    _patterns.assign(patterns[0],patterns[0]+nEvents);
+    return true;
+}
+
 using namespace H5;
 
-void V1730Decoder::writeOut(H5File &file, size_t nEvents) {
+void V1730Decoder::writeOut(OutputBatch &batch, size_t nEvents) {
 
     cout << "\t/" << settings.getIndex() << endl;
 
-    Group cardgroup = file.createGroup("/"+settings.getIndex());
-        
-    DataSpace scalar(0,NULL);
+    batch.group("/"+settings.getIndex());
     
     double dval;
     uint32_t ival;
     
-    Attribute bits = cardgroup.createAttribute("bits",PredType::NATIVE_UINT32,scalar);
     ival = 14;
-    bits.write(PredType::NATIVE_INT32,&ival);
+    batch.attribute("/"+settings.getIndex(),"bits",PredType::NATIVE_UINT32,&ival);
     
-    Attribute ns_sample = cardgroup.createAttribute("ns_sample",PredType::NATIVE_DOUBLE,scalar);
     dval = 2.0;
-    ns_sample.write(PredType::NATIVE_DOUBLE,&dval);
+    batch.attribute("/"+settings.getIndex(),"ns_sample",PredType::NATIVE_DOUBLE,&dval);
     
     for (size_t i = 0; i < nsamples.size(); i++) {
     
         string chname = "ch" + to_string(idx2chan[i]);
-        Group group = cardgroup.createGroup(chname);
         string groupname = "/"+settings.getIndex()+"/"+chname;
+        batch.group(groupname);
         
         cout << "\t" << groupname << endl;
         
-        Attribute offset = group.createAttribute("offset",PredType::NATIVE_UINT32,scalar);
         ival = settings.getDCOffset(idx2chan[i]);
-        offset.write(PredType::NATIVE_UINT32,&ival);
+        batch.attribute(groupname,"offset",PredType::NATIVE_UINT32,&ival);
         
-        Attribute samples = group.createAttribute("samples",PredType::NATIVE_UINT32,scalar);
-        ival = settings.getRecordLength(idx2chan[i]);
-        samples.write(PredType::NATIVE_UINT32,&ival);
+        ival = nsamples[i];
+        batch.attribute(groupname,"samples",PredType::NATIVE_UINT32,&ival);
         
-        Attribute presamples = group.createAttribute("presamples",PredType::NATIVE_UINT32,scalar);
         ival = settings.getPreSamples(idx2chan[i]);
-        presamples.write(PredType::NATIVE_UINT32,&ival);
+        batch.attribute(groupname,"presamples",PredType::NATIVE_UINT32,&ival);
         
-        Attribute threshold = group.createAttribute("threshold",PredType::NATIVE_UINT32,scalar);
         ival = settings.getThreshold(idx2chan[i]);
-        threshold.write(PredType::NATIVE_UINT32,&ival);
+        batch.attribute(groupname,"threshold",PredType::NATIVE_UINT32,&ival);
         
-        hsize_t dimensions[2];
-        dimensions[0] = nEvents;
-        dimensions[1] = nsamples[i];
-        
-        DataSpace samplespace(2, dimensions);
-        DataSpace metaspace(1, dimensions);
-        
-        cout << "\t" << groupname << "/samples" << endl;
-        DataSet samples_ds = file.createDataSet(groupname+"/samples", PredType::NATIVE_UINT16, samplespace);
-        samples_ds.write(grabs[i], PredType::NATIVE_UINT16);
-        memmove(grabs[i],grabs[i]+nEvents*nsamples[i],nsamples[i]*sizeof(uint16_t)*(grabbed[i]-nEvents));
+        if (nsamples[i]) { // no waveforms in list mode
+            if (settings.getStoreSamples()) {
+                cout << "\t" << groupname << "/samples" << endl;
+                batch.rows(groupname+"/samples", PredType::NATIVE_UINT16, grabs[i], nEvents, nsamples[i], chunk, &settings.getFilters());
+            }
+            memmove(grabs[i],grabs[i]+nEvents*nsamples[i],nsamples[i]*sizeof(uint16_t)*(grabbed[i]-nEvents));
+        }
         
         cout << "\t" << groupname << "/patterns" << endl;
-        DataSet patterns_ds = file.createDataSet(groupname+"/patterns", PredType::NATIVE_UINT16, metaspace);
-        patterns_ds.write(patterns[i], PredType::NATIVE_UINT16);
+        batch.rows(groupname+"/patterns", PredType::NATIVE_UINT16, patterns[i], nEvents, 0, chunk);
         memmove(patterns[i],patterns[i]+nEvents,sizeof(uint16_t)*(grabbed[i]-nEvents));
         
         cout << "\t" << groupname << "/baselines" << endl;
-        DataSet baselines_ds = file.createDataSet(groupname+"/baselines", PredType::NATIVE_UINT16, metaspace);
-        baselines_ds.write(baselines[i], PredType::NATIVE_UINT16);
+        batch.rows(groupname+"/baselines", PredType::NATIVE_UINT16, baselines[i], nEvents, 0, chunk);
         memmove(baselines[i],baselines[i]+nEvents,sizeof(uint16_t)*(grabbed[i]-nEvents));
         
         cout << "\t" << groupname << "/qshorts" << endl;
-        DataSet qshorts_ds = file.createDataSet(groupname+"/qshorts", PredType::NATIVE_UINT16, metaspace);
-        qshorts_ds.write(qshorts[i], PredType::NATIVE_UINT16);
+        batch.rows(groupname+"/qshorts", PredType::NATIVE_UINT16, qshorts[i], nEvents, 0, chunk);
         memmove(qshorts[i],qshorts[i]+nEvents,sizeof(uint16_t)*(grabbed[i]-nEvents));
         
         cout << "\t" << groupname << "/qlongs" << endl;
-        DataSet qlongs_ds = file.createDataSet(groupname+"/qlongs", PredType::NATIVE_UINT16, metaspace);
-        qlongs_ds.write(qlongs[i], PredType::NATIVE_UINT16);
+        batch.rows(groupname+"/qlongs", PredType::NATIVE_UINT16, qlongs[i], nEvents, 0, chunk);
         memmove(qlongs[i],qlongs[i]+nEvents,sizeof(uint16_t)*(grabbed[i]-nEvents));
 
         cout << "\t" << groupname << "/times" << endl;
-        DataSet times_ds = file.createDataSet(groupname+"/times", PredType::NATIVE_UINT64, metaspace);
-        times_ds.write(times[i], PredType::NATIVE_UINT64);
+        batch.rows(groupname+"/times", PredType::NATIVE_UINT64, times[i], nEvents, 0, chunk);
         memmove(times[i],times[i]+nEvents,sizeof(uint64_t)*(grabbed[i]-nEvents));
         
+        if (reducers[i]) reducers[i]->writeOut(batch,groupname,nEvents,chunk);
+        
         grabbed[i] -= nEvents;
     }
     
-    dispatch_index -= nEvents;
-    if (dispatch_index < 0) dispatch_index = 0;
+    dispatch_index = dispatch_index > nEvents ? dispatch_index - nEvents : 0;
 }
 
 uint32_t* V1730Decoder::decode_chan_agg(uint32_t *chanagg, uint32_t group, uint16_t pattern) {
@@ -555,7 +670,8 @@ uint32_t* V1730Decoder::decode_chan_agg(uint32_t *chanagg, uint32_t group, uint1
     
     const uint32_t size = chanagg[0] & 0x7FFF;
     const uint32_t format = chanagg[1];
-    const uint32_t samples = (format & 0xFFF)*8;
+    const bool waveform_enable = format & (1<<27);
+    const uint32_t samples = waveform_enable ? (format & 0xFFF)*8 : 0; //list mode has no waveform words
     
     /*
     //Metadata
@@ -563,7 +679,6 @@ uint32_t* V1730Decoder::decode_chan_agg(uint32_t *chanagg, uint32_t group, uint1
     const bool charge_enable =format & (1<<30);
     const bool time_enable = format & (1<<29);
     const bool baseline_enable = format & (1<<28);
-    const bool waveform_enable = format & (1<<27);
     const uint32_t extras = (format >> 24) & 0x7;
     const uint32_t analog_probe = (format >> 22) & 0x3;
     const uint32_t digital_probe_2 = (format >> 19) & 0x7;
@@ -597,11 +712,22 @@ uint32_t* V1730Decoder::decode_chan_agg(uint32_t *chanagg, uint32_t group, uint1
                 //uint8_t dp21 = (*word >> 31) & 0x1;
             }
             
+            if (reducers[idx]) reducers[idx]->reduce(data);
+            
             patterns[idx][ev] = pattern;
             baselines[idx][ev] = event[1+samples/2+0] & 0xFFFF;
             qshorts[idx][ev] = event[1+samples/2+1] & 0x7FFF;
             qlongs[idx][ev] = (event[1+samples/2+1] >> 16) & 0xFFFF;
             times[idx][ev] = ((uint64_t)(event[0] & 0x7FFFFFFF)) | (((uint64_t)(event[1+samples/2+0]&0xFFFF0000))<<15);
+            
+            if (histograms) {
+                const double qshort = qshorts[idx][ev], qlong = qlongs[idx][ev];
+                histograms->fill(hist_channels[idx]+0,qshort);
+                histograms->fill(hist_channels[idx]+1,qlong);
+                if (qlong > 0.0) histograms->fill(hist_channels[idx]+2,(qlong-qshort)/qlong);
+                //counted once per trigger, from the channel getPatterns uses
+                if (idx == 0) histograms->fill(hist_patterns,pattern);
+            }
         } else {
             grabbed[idx]++;
         }
@@ -23,6 +23,8 @@
 #include "VMEBridge.hh"
 #include "Digitizer.hh"
 #include "RunDB.hh"
+#include "Reduction.hh"
+#include "Output.hh"
 #include "json.hh"
 
 #ifndef V1730_dpppsd__hh
@@ -128,6 +130,7 @@ typedef struct {
 
 class V1730Settings : public DigitizerSettings {
     friend class V1730;
+    friend class V1730Generator;
 
     public:
     
@@ -139,6 +142,10 @@ class V1730Settings : public DigitizerSettings {
         
         void validate();
         
+        // Rounds record lengths up to the multiples of 8 the board uses, as
+        // programming does, for decoding without the board
+        void roundRecordLengths();
+        
         inline bool getEnabled(uint32_t ch) {
             return chans[ch].enabled;
         }
@@ -159,6 +166,23 @@ class V1730Settings : public DigitizerSettings {
             return chans[ch].trg_threshold;
         }
         
+        inline bool getListMode() {
+            return !card.oscilloscope_mode;
+        }
+        
+        inline bool getStoreSamples() {
+            return store_samples;
+        }
+        
+        inline bool getReduction(uint32_t ch, reduction_config &config) {
+            config = reductions[ch];
+            return reduce[ch];
+        }
+        
+        inline const output_filters& getFilters() {
+            return filters;
+        }
+        
         inline std::string getIndex() {
             return index;
         }
@@ -169,6 +193,11 @@ class V1730Settings : public DigitizerSettings {
         V1730_group_config groups[8];
         V1730_chan_config chans[16];
         
+        bool store_samples;
+        output_filters filters;
+        bool reduce[16];
+        reduction_config reductions[16];
+        
         void chanDefaults(uint32_t ch);
         
         void groupDefaults(uint32_t gr);
@@ -235,6 +264,8 @@ class V1730 : public Digitizer {
 
         virtual bool program(DigitizerSettings &settings);
         
+        virtual bool retune(DigitizerSettings &current, DigitizerSettings &next, const std::vector<std::string> &keys);
+        
         virtual void softTrig();
         
         virtual void startAcquisition();
@@ -263,11 +294,17 @@ class V1730Decoder : public Decoder {
         
         virtual void decode(Buffer &buffer);
         
+        virtual size_t index(const char *data, size_t size, std::vector<raw_index_entry> &entries);
+        
         virtual size_t eventsReady();
         
-        virtual void writeOut(H5::H5File &file, size_t nEvents);
+        using Decoder::writeOut;
         
-        virtual void dispatch(int nfd, int *fds);
+        virtual void writeOut(OutputBatch &batch, size_t nEvents);
+        
+        virtual void dispatch(LiveFeed &feed);
+        
+        virtual bool getPatterns(size_t nEvents, std::vector<uint16_t> &patterns);
 
     protected:
         
@@ -275,6 +312,8 @@ class V1730Decoder : public Decoder {
         V1730Settings &settings;
         
         size_t dispatch_index;
+        std::vector<uint16_t> feed_channels; //live feed index of each channel
+        uint64_t feed_events;
         
         size_t decode_counter;
         size_t chanagg_counter;
@@ -288,6 +327,12 @@ class V1730Decoder : public Decoder {
         std::vector<size_t> grabbed;
         std::vector<uint16_t*> grabs, baselines, qshorts, qlongs, patterns;
         std::vector<uint64_t*> times;
+        std::vector<Reducer*> reducers;
+        
+        std::vector<size_t> hist_channels; //qshorts, qlongs, and psd histograms of each channel
+        size_t hist_patterns;
+        
+        virtual HistogramSet* newHistograms();
 
         uint32_t* decode_chan_agg(uint32_t *chanagg, uint32_t group, uint16_t pattern);
 
@@ -16,10 +16,14 @@
  */
  
 #include <cmath>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
+#include <sys/stat.h>
  
 #include "V1742.hh"
+#include "Output.hh"
 
 using namespace std;
 
@@ -44,6 +48,15 @@ V1742Settings::V1742Settings() : DigitizerSettings("") {
         groupDefaults(gr);
     }
     card.max_event_blt = 10; //8 bit events per transfer
+    card.zs_threshold = 0; //disabled
+    card.zs_pre = 0;
+    card.zs_post = 0;
+    store_samples = true;
+    calib_at_decode = true;
+    filters.deflate = 0;
+    filters.shuffle = false;
+    filters.nbit = 0;
+    filters.threads = 1;
 }
 
 V1742Settings::V1742Settings(RunTable &dgtz, RunDB &db) : DigitizerSettings(dgtz.getIndex()) {
@@ -75,10 +88,29 @@ V1742Settings::V1742Settings(RunTable &dgtz, RunDB &db) : DigitizerSettings(dgtz
             for (uint32_t ch = 0; ch < 8; ch++) {
                 card.dc_offset[ch+gr*8] = round((-offsets[ch]+1.0)/2.0*pow(2.0,16.0)); //16 bit channel offsets
                 card.channel_mask[gr][ch] = chmask[ch];
+                reduce[ch+gr*8] = readReductionConfig(group,reductions[ch+gr*8],ch);
             }  
         }
     }
     card.max_event_blt = 10; //8 bit events per transfer
+    if (dgtz.isMember("zs_threshold")) {
+        card.zs_threshold = dgtz["zs_threshold"].cast<int>(); //counts from pedestal
+        card.zs_pre = dgtz["zs_pre"].cast<int>(); //samples before crossing
+        card.zs_post = dgtz["zs_post"].cast<int>(); //samples after crossing
+    } else {
+        card.zs_threshold = 0;
+        card.zs_pre = 0;
+        card.zs_post = 0;
+    }
+    
+    //waveforms can be dropped from the output when reductions are enough
+    store_samples = dgtz.isMember("store_samples") ? dgtz["store_samples"].cast<bool>() : true;
+    
+    //calibrating each event as it is decoded keeps writeOut to pure I/O
+    calib_at_decode = dgtz.isMember("calib_at_decode") ? dgtz["calib_at_decode"].cast<bool>() : true;
+    
+    //samples are 12 bit, and DRS4 corrections clamp to 12 bits
+    readOutputFilters(dgtz,filters,12);
     
 }
 
@@ -90,6 +122,7 @@ void V1742Settings::groupDefaults(uint32_t gr) {
     card.group_enable[gr] = 0; //1 bit bool
     for (uint32_t ch = 0; ch < 8; ch++) {
         card.dc_offset[ch+gr*8] = 0x8000; //16 bit channel offsets
+        reduce[ch+gr*8] = false;
     }
 }
         
@@ -104,6 +137,8 @@ void V1742Settings::validate() {
     if (card.software_trigger_out & (~0x1)) throw runtime_error("software_trigger_out must be 1 bit");
     if (card.external_trigger_out & (~0x1)) throw runtime_error("external_trigger_out must be 1 bit");
     if (card.post_trigger > 1023) throw runtime_error("post_trigger must be < 1024");
+    if (card.zs_threshold > 4095) throw runtime_error("zs_threshold must be < 4096");
+    if (card.zs_pre > 1023 || card.zs_post > 1023) throw runtime_error("zs_pre and zs_post must be < 1024");
     for (uint32_t gr = 0; gr < 4; gr++) {
         if (card.group_enable[gr] & (~0x1)) throw runtime_error("external_trigger_enable must be 1 bit");
     }
@@ -112,15 +147,31 @@ void V1742Settings::validate() {
 
 V1742calib::V1742calib(CAEN_DGTZ_DRS4Correction_t *dat) {
     for (size_t gr = 0; gr < 4; gr++) {
-        CAEN_DGTZ_DRS4Correction_t &cal = dat[gr];
+        loadGroup(gr,dat[gr].cell,dat[gr].nsample,dat[gr].time);
+    }
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+}
+
+V1742calib::V1742calib(const calib_file_tables &tables) {
+    for (size_t gr = 0; gr < 4; gr++) {
+        loadGroup(gr,tables.cell[gr],tables.nsample[gr],tables.time[gr]);
+    }
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+}
+
+void V1742calib::loadGroup(size_t gr, const int16_t cell[9][1024], const int8_t nsample[9][1024], const float time[1024]) {
+    for (size_t i = 0; i < 1024; i++) {
+        groups[gr].cell_delay[i] = time[i];
+    }
+    for (size_t ch = 0; ch < 9; ch++) {
         for (size_t i = 0; i < 1024; i++) {
-            groups[gr].cell_delay[i] = cal.time[i];
-        }
-        for (size_t ch = 0; ch < 9; ch++) {
-            for (size_t i = 0; i < 1024; i++) {
-                groups[gr].chans[ch].cell_offset[i] = cal.cell[ch][i];
-                groups[gr].chans[ch].seq_offset[i] = cal.nsample[ch][i];
-            }
+            //offsets are applied modulo 2^16 so they are stored that way
+            //and the cell table is repeated to avoid wrapping the index
+            groups[gr].chans[ch].cell_offset[i] = cell[ch][i];
+            groups[gr].chans[ch].cell_offset[i+1024] = cell[ch][i];
+            groups[gr].chans[ch].seq_offset[i] = nsample[ch][i];
         }
     }
 }
@@ -129,49 +180,126 @@ V1742calib::~V1742calib() {
 
 }
 
+typedef struct {
+    V1742calib *calib;
+    std::vector<V1742calib::calib_task> *tasks;
+    size_t first, stride;
+} calib_thread_data;
+
+void* V1742calib::calib_thread(void *_data) {
+    calib_thread_data *data = (calib_thread_data*)_data;
+    std::vector<calib_task> &tasks = *data->tasks;
+    for (size_t i = data->first; i < tasks.size(); i += data->stride) {
+        data->calib->calibrateTask(tasks[i]);
+    }
+    return NULL;
+}
+
 void V1742calib::calibrate(uint16_t *samples[4][8], uint16_t *trn_samples[4], size_t sampPerEv, uint16_t *start_index[4], bool grActive[4], bool trActive[4], size_t numEv) {
     
     cout << "\tCalibrating V1742 data..." << endl;
     
+    //split active groups into event ranges for each thread
+    vector<calib_task> tasks;
+    const size_t per_task = numEv/threads + 1;
     for (size_t gr = 0; gr < 4; gr++) {
         if (!grActive[gr]) continue;
-        for (size_t ev = 0; ev < numEv; ev++) {
-            uint16_t *samps[9];
-            uint16_t cellidx = start_index[gr][ev];
-            for (size_t ch = 0; ch < (trActive[gr] ? 9 : 8); ch++) {
-                if (ch < 8) {
-                    samps[ch] = samples[gr][ch]+ev*sampPerEv;
-                } else {
-                    samps[ch] = trn_samples[gr]+ev*sampPerEv;
-                }
-                //Apply CAEN offsets 
-                for (size_t i = 0; i < sampPerEv; i++) {
-                    if (samps[ch][i] == 0 || samps[ch][i] == 4095) continue; //don't correct rails
-                    samps[ch][i] = samps[ch][i] - groups[gr].chans[ch].seq_offset[i] - groups[gr].chans[ch].cell_offset[(cellidx+i)%1024];
-                    if (samps[ch][i] >= 0xF000) {
-                        samps[ch][i] = 0; //fix correction below lower rail
-                    } else if (samps[ch][i] >= 0x0FFF) {
-                        samps[ch][i] = 0x0FFF; //fix correction above upper rail 
-                    }
-                }
+        for (size_t ev = 0; ev < numEv; ev += per_task) {
+            calib_task task;
+            task.gr = gr;
+            for (size_t ch = 0; ch < 8; ch++) task.samples[ch] = samples[gr][ch];
+            task.samples[8] = trActive[gr] ? trn_samples[gr] : NULL;
+            task.start_index = start_index[gr];
+            task.sampPerEv = sampPerEv;
+            task.first = ev;
+            task.last = ev + per_task < numEv ? ev + per_task : numEv;
+            tasks.push_back(task);
+        }
+    }
+    
+    const size_t nthreads = tasks.size() < threads ? tasks.size() : threads;
+    if (nthreads <= 1) {
+        for (size_t i = 0; i < tasks.size(); i++) calibrateTask(tasks[i]);
+        return;
+    }
+    
+    vector<pthread_t> workers(nthreads);
+    vector<calib_thread_data> data(nthreads);
+    for (size_t t = 0; t < nthreads; t++) {
+        data[t].calib = this;
+        data[t].tasks = &tasks;
+        data[t].first = t;
+        data[t].stride = nthreads;
+        if (pthread_create(&workers[t],NULL,&calib_thread,&data[t])) throw runtime_error("Could not start calibration thread");
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        pthread_join(workers[t],NULL);
+    }
+
+}
+
+void V1742calib::calibrateTask(const calib_task &task) {
+    const size_t nch = task.samples[8] ? 9 : 8;
+    for (size_t ev = task.first; ev < task.last; ev++) {
+        uint16_t *samps[9];
+        for (size_t ch = 0; ch < nch; ch++) samps[ch] = task.samples[ch]+ev*task.sampPerEv;
+        calibrateEvent(task.gr, samps, nch, task.sampPerEv, task.start_index[ev]);
+    }
+}
+
+// Counts channels with a spike signature starting at sample i
+static inline int spikes(uint16_t *samps[9], size_t nch, size_t sampPerEv, size_t i) {
+    int identified = 0;
+    for (size_t ch = 0; ch < nch; ch++) {
+        if (samps[ch][i]-samps[ch][(i+1)%sampPerEv] > 30 && samps[ch][(i+3)%sampPerEv]-samps[ch][(i+2)%sampPerEv] > 30) {
+            identified++;
+        }
+    }
+    return identified;
+}
+
+void V1742calib::calibrateEvent(size_t gr, uint16_t *samps[9], size_t nch, size_t sampPerEv, uint16_t cellidx) {
+    
+    //Apply CAEN offsets with branchless loops over contiguous tables
+    for (size_t ch = 0; ch < nch; ch++) {
+        uint16_t *s = samps[ch];
+        const uint16_t *seq = groups[gr].chans[ch].seq_offset;
+        const uint16_t *cell = groups[gr].chans[ch].cell_offset + cellidx;
+        for (size_t i = 0; i < sampPerEv; i++) {
+            const uint16_t raw = s[i];
+            uint16_t cor = raw - seq[i] - cell[i];
+            cor = cor >= 0xF000 ? 0 : (cor > 0x0FFF ? 0x0FFF : cor); //fix correction past rails
+            s[i] = (raw == 0 || raw == 4095) ? raw : cor; //don't correct rails
+        }
+    }
+    
+    //Tally spike signatures for all samples up front, wrapping only at the end
+    uint8_t identified[1024];
+    memset(identified,0,sampPerEv);
+    const size_t nowrap = sampPerEv > 3 ? sampPerEv - 3 : 0;
+    for (size_t ch = 0; ch < nch; ch++) {
+        const uint16_t *s = samps[ch];
+        for (size_t i = 0; i < nowrap; i++) {
+            identified[i] += ((int)s[i]-(int)s[i+1] > 30) & ((int)s[i+3]-(int)s[i+2] > 30);
+        }
+    }
+    for (size_t i = nowrap; i < sampPerEv; i++) identified[i] = spikes(samps,nch,sampPerEv,i);
+    
+    //Corrections are applied in order, and each one changes the tally of 
+    //the samples that overlap it, so those are recounted before use
+    for (size_t i = 0; i < sampPerEv; i++) {
+        if (identified[i] > 4) {
+            for (size_t ch = 0; ch < 8; ch++) {
+                samps[ch][(i+1)%sampPerEv] += 53;
+                samps[ch][(i+2)%sampPerEv] += 53;
             }
-            for (size_t i = 0; i < sampPerEv; i++) {
-                int identified = 0;
-                for (size_t ch = 0; ch < (trActive[gr] ? 9 : 8); ch++) {
-                    if (samps[ch][i]-samps[ch][(i+1)%sampPerEv] > 30 && samps[ch][(i+3)%sampPerEv]-samps[ch][(i+2)%sampPerEv] > 30) {
-                        identified++;
-                    }
-                }
-                if (identified > 4) {
-                    for (size_t ch = 0; ch < 8; ch++) {
-                        samps[ch][(i+1)%sampPerEv] += 53;
-                        samps[ch][(i+2)%sampPerEv] += 53;
-                    }
-                }
+            const size_t overlap[4] = {i+1, i+2, i+sampPerEv-1, i+sampPerEv-2};
+            for (size_t j = 0; j < 4; j++) {
+                const size_t k = overlap[j]%sampPerEv;
+                if (k > i) identified[k] = spikes(samps,nch,sampPerEv,k);
             }
         }
     }
-
 }
 
 V1742::V1742(VMEBridge &_bridge, uint32_t _baseaddr) : Digitizer(_bridge,_baseaddr) {
@@ -251,6 +379,41 @@ bool V1742::program(DigitizerSettings &_settings) {
     return true;
 }
 
+bool V1742::retune(DigitizerSettings &_current, DigitizerSettings &_next, const vector<string> &keys) {
+    V1742Settings &current = dynamic_cast<V1742Settings&>(_current);
+    V1742Settings &next = dynamic_cast<V1742Settings&>(_next);
+    
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] != "dc_offsets" && keys[i] != "tr0_threshold" && keys[i] != "tr1_threshold" && keys[i] != "tr0_dc_offset" && keys[i] != "tr1_dc_offset") return false;
+    }
+    
+    if (current.card.tr0_threshold != next.card.tr0_threshold) {
+        current.card.tr0_threshold = next.card.tr0_threshold;
+        write32(REG_TR_THRESHOLD|(0<<8),current.card.tr0_threshold);
+    }
+    if (current.card.tr1_threshold != next.card.tr1_threshold) {
+        current.card.tr1_threshold = next.card.tr1_threshold;
+        write32(REG_TR_THRESHOLD|(2<<8),current.card.tr1_threshold);
+    }
+    if (current.card.tr0_dc_offset != next.card.tr0_dc_offset) {
+        current.card.tr0_dc_offset = next.card.tr0_dc_offset;
+        write32(REG_TR_DC_OFFSET|(0<<8),current.card.tr0_dc_offset);
+    }
+    if (current.card.tr1_dc_offset != next.card.tr1_dc_offset) {
+        current.card.tr1_dc_offset = next.card.tr1_dc_offset;
+        write32(REG_TR_DC_OFFSET|(2<<8),current.card.tr1_dc_offset);
+    }
+    for (uint32_t gr = 0; gr < 4; gr++) {
+        for (uint32_t ch = 0; ch < 8; ch++) {
+            if (current.card.dc_offset[ch+gr*8] == next.card.dc_offset[ch+gr*8]) continue;
+            current.card.dc_offset[ch+gr*8] = next.card.dc_offset[ch+gr*8];
+            write32(REG_DC_OFFSET|(gr<<8),(ch<<16) | ((uint32_t)current.card.dc_offset[ch+gr*8]));
+        }
+    }
+    
+    return true;
+}
+
 void V1742::softTrig() {
     write32(REG_SOFTWARE_TRIGGER,0xDEADBEEF);
 }
@@ -281,25 +444,31 @@ bool V1742::checkTemps(vector<uint32_t> &temps, uint32_t danger) {
     return over;
 }
 
-V1742calib* V1742::staticGetCalib(V1742SampleFreq freq, int link, uint32_t baseaddr) {
-    int handle = 0;
-    int res = CAEN_DGTZ_OpenDigitizer(CAEN_DGTZ_USB, link, 0, baseaddr, &handle);
-    if (res != 0) throw runtime_error("getCalib: Could not open digitizer "+to_string(res));
-    
-    CAEN_DGTZ_DRS4Correction_t corr[4];
+// Reads the DRS4 tables for one sample frequency from an open digitizer
+static void getCorrectionTables(int handle, V1742SampleFreq freq, CAEN_DGTZ_DRS4Correction_t corr[4]) {
+    int res;
     switch (freq) {
         case GHz_5:
-            res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_5GHz,&corr);
+            res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_5GHz,corr);
             break;
         case GHz_2_5:
-            res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_2_5GHz,&corr);
+            res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_2_5GHz,corr);
             break;
         case GHz_1:
-            res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_1GHz,&corr);
+            res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_1GHz,corr);
             break;
         default: throw runtime_error("getCalib: Invalid sample rate");
     }
     if (res != 0) throw runtime_error("getCalib: Could not get calibration data "+to_string(res));
+}
+
+V1742calib* V1742::staticGetCalib(V1742SampleFreq freq, int link, uint32_t baseaddr) {
+    int handle = 0;
+    int res = CAEN_DGTZ_OpenDigitizer(CAEN_DGTZ_USB, link, 0, baseaddr, &handle);
+    if (res != 0) throw runtime_error("getCalib: Could not open digitizer "+to_string(res));
+    
+    CAEN_DGTZ_DRS4Correction_t corr[4];
+    getCorrectionTables(handle,freq,corr);
     
     res = CAEN_DGTZ_CloseDigitizer(handle);
     if (res != 0) throw runtime_error("getCalib: Could not close digitizer "+to_string(res));
@@ -307,6 +476,69 @@ V1742calib* V1742::staticGetCalib(V1742SampleFreq freq, int link, uint32_t basea
     return new V1742calib(corr);
 }
 
+// Cached tables are stale if they are older than max_age days (0 never 
+// expires) or, when the board info is known, were read from other firmware
+static bool calibFresh(const calib_file_header &header, double max_age, CAEN_DGTZ_BoardInfo_t *info) {
+    if (max_age > 0 && difftime(time(NULL),header.created) > max_age*86400.0) return false;
+    if (info && (strncmp(header.roc_firmware,info->ROC_FirmwareRel,sizeof(header.roc_firmware)) || strncmp(header.amc_firmware,info->AMC_FirmwareRel,sizeof(header.amc_firmware)))) return false;
+    return true;
+}
+
+// Returns calibration from a fresh cache file for this board, or NULL
+static V1742calib* loadCachedCalib(const string &fname, uint32_t serial, V1742SampleFreq freq, double max_age, CAEN_DGTZ_BoardInfo_t *info) {
+    if (access(fname.c_str(),R_OK)) return NULL;
+    try {
+        CalibFile file(fname);
+        if (file.header().serial == serial && file.hasTables(freq) && calibFresh(file.header(),max_age,info)) {
+            cout << "\tUsing cached calibration " << fname << endl;
+            return new V1742calib(file.tables(freq));
+        }
+    } catch (runtime_error &e) {
+        cout << "\tIgnoring cached calibration: " << e.what() << endl;
+    }
+    return NULL;
+}
+
+V1742calib* V1742::cachedGetCalib(V1742SampleFreq freq, int link, uint32_t baseaddr, const string &cachedir, double max_age, bool refresh, uint32_t serial) {
+    V1742calib *calib;
+    
+    //a known serial avoids opening the board at all
+    if (serial && !refresh && (calib = loadCachedCalib(calibFileName(cachedir,serial,freq),serial,freq,max_age,NULL))) {
+        return calib;
+    }
+    
+    int handle = 0;
+    int res = CAEN_DGTZ_OpenDigitizer(CAEN_DGTZ_USB, link, 0, baseaddr, &handle);
+    if (res != 0) throw runtime_error("getCalib: Could not open digitizer "+to_string(res));
+    
+    CAEN_DGTZ_BoardInfo_t info;
+    res = CAEN_DGTZ_GetInfo(handle,&info);
+    if (res != 0) throw runtime_error("getCalib: Could not get board info "+to_string(res));
+    if (serial && serial != info.SerialNumber) cout << "\tV1742 serial " << info.SerialNumber << " does not match configured " << serial << endl;
+    
+    const string fname = calibFileName(cachedir,info.SerialNumber,freq);
+    if (refresh || !(calib = loadCachedCalib(fname,info.SerialNumber,freq,max_age,&info))) {
+        cout << "\tReading calibration for V1742 serial " << info.SerialNumber << endl;
+        CAEN_DGTZ_DRS4Correction_t corr[4];
+        getCorrectionTables(handle,freq,corr);
+        calib = new V1742calib(corr);
+        
+        calib_file_header header;
+        header.serial = info.SerialNumber;
+        strncpy(header.roc_firmware,info.ROC_FirmwareRel,sizeof(header.roc_firmware));
+        strncpy(header.amc_firmware,info.AMC_FirmwareRel,sizeof(header.amc_firmware));
+        header.created = time(NULL);
+        CAEN_DGTZ_DRS4Correction_t *tables[3] = {NULL, NULL, NULL};
+        tables[freq] = corr;
+        if (mkdir(cachedir.c_str(),0755) && errno != EEXIST) throw runtime_error("getCalib: Could not create calibration cache " + cachedir);
+        CalibFile::write(fname,header,tables);
+    }
+    
+    res = CAEN_DGTZ_CloseDigitizer(handle);
+    if (res != 0) throw runtime_error("getCalib: Could not close digitizer "+to_string(res));
+    
+    return calib;
+}
 
 V1742calib* V1742::getCalib(V1742SampleFreq freq) {
     //This ***will not work*** here due to a bug in CAENDigitizer
@@ -317,6 +549,8 @@ V1742calib* V1742::getCalib(V1742SampleFreq freq) {
 V1742Decoder::V1742Decoder(size_t _eventBuffer, V1742calib *_calib, V1742Settings &_settings) : eventBuffer(_eventBuffer), calib(_calib), settings(_settings) {
 
     dispatch_index = group_counter = event_counter = decode_counter = 0;
+    feed_events = 0;
+    zs_time = calib_time = 0.0;
     
     nSamples = settings.getNumSamples();
     for (size_t gr = 0; gr < 4; gr++) {
@@ -337,6 +571,13 @@ V1742Decoder::V1742Decoder(size_t _eventBuffer, V1742calib *_calib, V1742Setting
         }
         for (size_t ch = 0; ch < 8; ch++) {
             chActive[gr][ch] = settings.getChannelMask(gr,ch);
+            zs_pedestal[gr][ch] = 0;
+            reduction_config config;
+            if (grActive[gr] && chActive[gr][ch] && eventBuffer && settings.getReduction(gr,ch,config)) {
+                reducers[gr][ch] = new Reducer(config,nSamples,1.0/pow(2.0,12.0),1000.0*settings.nsPerSample());
+            } else {
+                reducers[gr][ch] = NULL;
+            }
         }
     }
     
@@ -356,7 +597,11 @@ V1742Decoder::V1742Decoder(size_t _eventBuffer, V1742calib *_calib, V1742Setting
 }
 
 V1742Decoder::~V1742Decoder() {
-    if (calib) delete calib;
+    for (size_t gr = 0; gr < 4; gr++) {
+        for (size_t ch = 0; ch < 8; ch++) {
+            if (reducers[gr][ch]) delete reducers[gr][ch];
+        }
+    }
     if (eventBuffer) {
         for (size_t gr = 0; gr < 4; gr++) {
             if (grActive[gr]) {
@@ -394,6 +639,52 @@ void V1742Decoder::decode(Buffer &buffer) {
     }
 }
     
+size_t V1742Decoder::index(const char *data, size_t size, vector<raw_index_entry> &entries) {
+    if (size % 4) throw runtime_error("Readout of " + settings.getIndex() + " is not whole words");
+    const uint32_t *start = (const uint32_t*)data, *end = start + size/4;
+    
+    size_t triggers = 0;
+    for (const uint32_t *event = start; event < end; ) {
+        if (event[0] == 0xFFFFFFFF) {
+            event++; //sometimes padded
+            continue;
+        }
+        if ((event[0] & 0xF0000000) != 0xA0000000) 
+            throw runtime_error("Event structure missing tag");
+        const uint32_t evsize = event[0] & 0xFFFFFFF;
+        const uint32_t *evend = event + evsize;
+        if (evsize < 4 || evend > end) throw runtime_error("Event structure overruns readout of " + settings.getIndex());
+        
+        const uint32_t mask = event[1] & 0xF;
+        const uint32_t *group = event+4;
+        for (uint32_t gr = 0; gr < 4; gr++) {
+            if (!(mask & (1 << gr))) continue;
+            if (!grActive[gr]) throw runtime_error("Recieved group data for inactive group (" + to_string(gr) + ")");
+            if (group >= evend) throw runtime_error("Group structure overruns event");
+            const uint32_t tr = (group[0] >> 12) & 0x1;
+            const uint32_t gsize = group[0] & 0xFFF;
+            if (gsize/3 != nSamples) throw runtime_error("Recieved sample length " + to_string(gsize/3) + " does not match expected " + to_string(nSamples) + " (" + to_string(gr) + ")");
+            if (tr && !settings.getTrReadout()) throw runtime_error("Received TR"+to_string(gr/2)+" data when not marked for readout (" + to_string(gr) + ")");
+            group += 2 + gsize + (tr ? gsize/8 : 0);
+        }
+        if (group > evend) throw runtime_error("Group structure overruns event");
+        
+        raw_index_entry entry;
+        entry.offset = entry.aggregate = (event-start)*4;
+        entry.time = event[3];
+        entry.size = evsize*4;
+        entry.count = event[2] & 0x3FFFFF;
+        entry.channel = mask;
+        entry.pattern = (event[1] & 0x7FFF00) >> 8;
+        entry.reserved = 0;
+        entries.push_back(entry);
+        triggers++;
+        
+        event = evend;
+    }
+    return triggers;
+}
+
 uint32_t* V1742Decoder::decode_event_structure(uint32_t *event) {
     if (event[0] == 0xFFFFFFFF) {
         event++; //sometimes padded
@@ -438,9 +729,14 @@ uint32_t* V1742Decoder::decode_event_structure(uint32_t *event) {
                 trigger_count[gr][ev] = count;
             }
             groups = decode_group_structure(groups,gr);
+            if (eventBuffer && calib && settings.getCalibAtDecode()) calibrate_event(gr,ev);
+            if (eventBuffer && settings.getZSThreshold()) zero_suppress(gr,ev);
+            if (histograms) fill_histograms(gr,ev);
         }
     } 
     
+    if (histograms) histograms->fill(hist_patterns,pattern);
+    
     return event+size;
 
 }
@@ -499,6 +795,117 @@ uint32_t* V1742Decoder::decode_group_structure(uint32_t *group, uint32_t gr) {
     
 }
 
+// Finds windows around samples further than zs_threshold from a running 
+// pedestal, padded by zs_pre and zs_post, for each active channel of an event
+void V1742Decoder::zero_suppress(uint32_t gr, size_t ev) {
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC,&start_time);
+    
+    const int threshold = settings.getZSThreshold()*16;
+    const size_t pre = settings.getZSPre(), post = settings.getZSPost();
+    const size_t nped = nSamples < 16 ? nSamples : 16;
+    
+    for (size_t ch = 0; ch < 8; ch++) {
+        if (!chActive[gr][ch]) continue;
+        const uint16_t *data = samples[gr][ch] + ev*nSamples;
+        
+        //track the pedestal with the first samples of each trace
+        uint32_t ped = 0;
+        for (size_t s = 0; s < nped; s++) ped += data[s];
+        ped = ped*16/nped;
+        if (zs_pedestal[gr][ch] == 0) {
+            zs_pedestal[gr][ch] = ped;
+        } else {
+            zs_pedestal[gr][ch] = (zs_pedestal[gr][ch]*15 + ped)/16;
+        }
+        const int pedestal = zs_pedestal[gr][ch];
+        
+        std::vector<uint16_t> &windows = zs_windows[gr][ch];
+        uint32_t nwindows = 0;
+        size_t begin = 0, end = 0;
+        for (size_t s = 0; s < nSamples; s++) {
+            if (abs(data[s]*16 - pedestal) <= threshold) continue;
+            const size_t lo = s > pre ? s - pre : 0;
+            const size_t hi = s + post + 1 < nSamples ? s + post + 1 : nSamples;
+            if (nwindows && lo <= end) {
+                end = hi;
+            } else {
+                if (nwindows) {
+                    windows.push_back(begin);
+                    windows.push_back(end-begin);
+                }
+                begin = lo;
+                end = hi;
+                nwindows++;
+            }
+        }
+        if (nwindows) {
+            windows.push_back(begin);
+            windows.push_back(end-begin);
+        }
+        zs_nwindows[gr][ch].push_back(nwindows);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC,&end_time);
+    zs_time += (end_time.tv_sec - start_time.tv_sec)+1e-9*(end_time.tv_nsec - start_time.tv_nsec);
+}
+
+// Applies the DRS4 corrections to one freshly unpacked event while it is 
+// still in cache, and feeds the reductions that need calibrated traces
+void V1742Decoder::calibrate_event(uint32_t gr, size_t ev) {
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC,&start_time);
+    
+    uint16_t *samps[9];
+    for (size_t ch = 0; ch < 8; ch++) samps[ch] = samples[gr][ch] + ev*nSamples;
+    if (trnActive[gr]) samps[8] = trn_samples[gr] + ev*nSamples;
+    calib->calibrateEvent(gr, samps, trnActive[gr] ? 9 : 8, nSamples, start_index[gr][ev]);
+    
+    for (size_t ch = 0; ch < 8; ch++) {
+        if (reducers[gr][ch]) reducers[gr][ch]->reduce(samps[ch]);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC,&end_time);
+    calib_time += (end_time.tv_sec - start_time.tv_sec)+1e-9*(end_time.tv_nsec - start_time.tv_nsec);
+}
+
+HistogramSet* V1742Decoder::newHistograms() {
+    if (!eventBuffer || !(grActive[0] || grActive[1] || grActive[2] || grActive[3])) return NULL;
+    HistogramSet *set = new HistogramSet(settings.getIndex());
+    for (size_t gr = 0; gr < 4; gr++) {
+        for (size_t ch = 0; ch < 8; ch++) {
+            if (!grActive[gr] || !chActive[gr][ch]) continue;
+            const string name = "gr" + to_string(gr) + "/ch" + to_string(ch);
+            hist_channels[gr][ch] = set->add(name+"/amplitude",4096,0.0,4096.0);
+            set->add(name+"/baseline",4096,0.0,4096.0);
+        }
+    }
+    hist_patterns = set->add("patterns",65536,0.0,65536.0);
+    return set;
+}
+
+// Histograms the baseline (mean of the first samples) and the largest 
+// excursion from it of each channel of a decoded event, which are only DRS4
+// corrected with calib_at_decode
+void V1742Decoder::fill_histograms(uint32_t gr, size_t ev) {
+    const size_t nbase = nSamples < 16 ? nSamples : 16;
+    for (size_t ch = 0; ch < 8; ch++) {
+        if (!chActive[gr][ch]) continue;
+        const uint16_t *data = samples[gr][ch] + ev*nSamples;
+        uint32_t sum = 0;
+        for (size_t i = 0; i < nbase; i++) sum += data[i];
+        const double baseline = (double)sum/nbase;
+        uint16_t lo = data[0], hi = data[0];
+        for (size_t i = 1; i < nSamples; i++) {
+            if (data[i] < lo) lo = data[i];
+            if (data[i] > hi) hi = data[i];
+        }
+        const double amplitude = baseline - lo > hi - baseline ? baseline - lo : hi - baseline;
+        histograms->fill(hist_channels[gr][ch]+0,amplitude);
+        histograms->fill(hist_channels[gr][ch]+1,baseline);
+    }
+}
+
 size_t V1742Decoder::eventsReady() {
     size_t grabs = INT64_MAX;//eventBuffer;
     for (size_t gr = 0; gr < 4; gr++) {
@@ -507,138 +914,200 @@ size_t V1742Decoder::eventsReady() {
     return grabs;
 }
 
-// length, lvdsidx, dsize, nsamples, samples[], strlen, strname[]
-
-void V1742Decoder::dispatch(int nfd, int *fds) {
+void V1742Decoder::dispatch(LiveFeed &feed) {
     
-    size_t ready = eventsReady();
+    if (!eventBuffer || !(grActive[0] || grActive[1] || grActive[2] || grActive[3])) return;
     
-    for ( ; dispatch_index < ready; dispatch_index++) {
+    if (feed_channels.empty()) {
+        for (size_t gr = 0; gr < 4; gr++) {
+            for (size_t ch = 0; ch < 8; ch++) {
+                const bool active = grActive[gr] && chActive[gr][ch];
+                feed_channels.push_back(active ? feed.channel("/"+settings.getIndex()+"/gr"+to_string(gr)+"/ch"+to_string(ch),nSamples,12) : 0);
+                if (active && feed.events(feed_channels.back()) > feed_events) feed_events = feed.events(feed_channels.back());
+            }
+        }
+    }
+    
+    //samples are as decoded, so only DRS4 corrected with calib_at_decode
+    const size_t ready = eventsReady();
+    for ( ; dispatch_index < ready; dispatch_index++, feed_events++) {
         for (size_t gr = 0; gr < 4; gr++) {
             if (!grActive[gr]) continue;
             for (size_t ch = 0; ch < 8; ch++) {
                 if (!chActive[gr][ch]) continue;
-                uint8_t lvdsidx = patterns[gr][dispatch_index] & 0xFF; 
-                uint8_t dsize = 2;
-                uint16_t nsamps = nSamples;
-                uint16_t *samps = &samples[gr][ch][nsamps*dispatch_index];
-                string strname = "/"+settings.getIndex()+"/gr" + to_string(gr) + "/ch" + to_string(ch);
-                uint16_t strlen = strname.length();
-                uint16_t length = 2+strlen+2+nsamps*2+1+1;
-                for (int j = 0; j < nfd; j++) {
-                    writeall(fds[j],&length,2);
-                    writeall(fds[j],&lvdsidx,1);
-                    writeall(fds[j],&dsize,1);
-                    writeall(fds[j],&nsamps,2);
-                    writeall(fds[j],samps,nsamps*2);
-                    writeall(fds[j],&strlen,2);
-                    writeall(fds[j],strname.c_str(),strlen);
-                }
+                feed.record(feed_channels[gr*8+ch],patterns[gr][dispatch_index],trigger_time[gr][dispatch_index],feed_events,&samples[gr][ch][nSamples*dispatch_index]);
             }
         }
     }
 }
 
+bool V1742Decoder::getPatterns(size_t nEvents, vector<uint16_t> &_patterns) {
+    if (!eventBuffer) return false;
+    for (size_t gr = 0; gr < 4; gr++) {
+        if (!grActive[gr]) continue;
+        _patterns.assign(patterns[gr],patterns[gr]+nEvents);
+        return true;
+    }
+    return false;
+}
+
 using namespace H5;
 
-void V1742Decoder::writeOut(H5File &file, size_t nEvents) {
+void V1742Decoder::writeOut(OutputBatch &batch, size_t nEvents) {
 
-    if (calib) calib->calibrate(samples, trn_samples, nSamples, start_index, grActive, trnActive, nEvents);
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC,&start_time);
+
+    if (calib && settings.getCalibAtDecode()) {
+        cout << "\tV1742 data calibrated at decode in " << calib_time << " s" << endl;
+        calib_time = 0.0;
+    } else {
+        if (calib) calib->calibrate(samples, trn_samples, nSamples, start_index, grActive, trnActive, nEvents);
+        
+        //reductions need calibrated traces
+        for (size_t gr = 0; gr < 4; gr++) {
+            for (size_t ch = 0; ch < 8; ch++) {
+                if (!reducers[gr][ch]) continue;
+                for (size_t ev = 0; ev < nEvents; ev++) {
+                    reducers[gr][ch]->reduce(samples[gr][ch]+ev*nSamples);
+                }
+            }
+        }
+    }
 
     cout << "\t/" << settings.getIndex() << endl;
 
-    Group cardgroup = file.createGroup("/"+settings.getIndex());
-        
-    DataSpace scalar(0,NULL);
+    batch.group("/"+settings.getIndex());
     
     double dval;
     uint32_t ival;
     
-    Attribute bits = cardgroup.createAttribute("bits",PredType::NATIVE_UINT32,scalar);
     ival = 12;
-    bits.write(PredType::NATIVE_INT32,&ival);
+    batch.attribute("/"+settings.getIndex(),"bits",PredType::NATIVE_UINT32,&ival);
     
-    Attribute ns_sample = cardgroup.createAttribute("ns_sample",PredType::NATIVE_DOUBLE,scalar);
     dval = settings.nsPerSample();
-    ns_sample.write(PredType::NATIVE_DOUBLE,&dval);
-            
-    Attribute _samples = cardgroup.createAttribute("samples",PredType::NATIVE_UINT32,scalar);
+    batch.attribute("/"+settings.getIndex(),"ns_sample",PredType::NATIVE_DOUBLE,&dval);
+    
     ival = nSamples;
-    _samples.write(PredType::NATIVE_UINT32,&ival);
+    batch.attribute("/"+settings.getIndex(),"samples",PredType::NATIVE_UINT32,&ival);
+    
+    const bool zs = settings.getZSThreshold() != 0;
+    size_t zs_kept = 0, zs_total = 0;
+    if (zs) {
+        ival = settings.getZSThreshold();
+        batch.attribute("/"+settings.getIndex(),"zs_threshold",PredType::NATIVE_UINT32,&ival);
+        ival = settings.getZSPre();
+        batch.attribute("/"+settings.getIndex(),"zs_pre",PredType::NATIVE_UINT32,&ival);
+        ival = settings.getZSPost();
+        batch.attribute("/"+settings.getIndex(),"zs_post",PredType::NATIVE_UINT32,&ival);
+    }
     
     for (size_t gr = 0; gr < 4; gr++) {
         if (!grActive[gr]) continue;
         string grname = "gr" + to_string(gr);
-        Group grgroup = cardgroup.createGroup(grname);
         string grgroupname = "/"+settings.getIndex()+"/"+grname;
+        batch.group(grgroupname);
         
         cout << "\t" << grgroupname << endl;
-
-        hsize_t dimensions[2];
-        dimensions[0] = nEvents;
-        dimensions[1] = nSamples;
-        
-        DataSpace samplespace(2, dimensions);
-        DataSpace metaspace(1, dimensions);
         
         for (size_t ch = 0; ch < 8; ch++) {
             if (!chActive[gr][ch]) continue;
             string chname = "ch" + to_string(ch);
-            Group chgroup = grgroup.createGroup(chname);
             string chgroupname = "/"+settings.getIndex()+"/"+grname+"/"+chname;
+            batch.group(chgroupname);
             
             cout << "\t" << chgroupname << endl;
         
-            Attribute offset = chgroup.createAttribute("offset",PredType::NATIVE_UINT32,scalar);
             ival = settings.getDCOffset(gr*8+ch);
-            offset.write(PredType::NATIVE_UINT32,&ival);
+            batch.attribute(chgroupname,"offset",PredType::NATIVE_UINT32,&ival);
             
-            cout << "\t" << chgroupname << "/samples" << endl;
-            DataSet samples_ds = file.createDataSet(chgroupname+"/samples", PredType::NATIVE_UINT16, samplespace);
-            samples_ds.write(samples[gr][ch], PredType::NATIVE_UINT16);
+            if (zs) {
+                // zs_offsets[i]:zs_offsets[i+1] indexes the (start,length) 
+                // zs_windows of event i, whose samples are packed in zs_values
+                vector<uint32_t> &nwindows = zs_nwindows[gr][ch];
+                vector<uint16_t> &windows = zs_windows[gr][ch];
+                vector<uint64_t> offsets(nEvents+1);
+                vector<uint16_t> values;
+                offsets[0] = 0;
+                for (size_t ev = 0; ev < nEvents; ev++) {
+                    offsets[ev+1] = offsets[ev] + nwindows[ev];
+                    const uint16_t *data = samples[gr][ch] + ev*nSamples;
+                    for (size_t w = offsets[ev]; w < offsets[ev+1]; w++) {
+                        values.insert(values.end(), data+windows[2*w], data+windows[2*w]+windows[2*w+1]);
+                    }
+                }
+                zs_kept += values.size();
+                zs_total += nEvents*nSamples;
+                const size_t nwritten = offsets[nEvents];
+                
+                //when appending, offsets continue from the windows already
+                //written and the leading offset is already in the file, 
+                //which is only known when the batch is written
+                cout << "\t" << chgroupname << "/zs_offsets" << endl;
+                const size_t rows = chunk;
+                batch.add([chgroupname,offsets,nEvents,rows](H5File &file) {
+                    const size_t wbase = outputRows(file,chgroupname+"/zs_windows");
+                    const bool first = outputRows(file,chgroupname+"/zs_offsets") == 0;
+                    vector<uint64_t> based(offsets);
+                    for (size_t ev = 0; ev <= nEvents; ev++) based[ev] += wbase;
+                    outputRows(file, chgroupname+"/zs_offsets", PredType::NATIVE_UINT64, first ? based.data() : based.data()+1, first ? nEvents+1 : nEvents, 0, rows);
+                });
+                cout << "\t" << chgroupname << "/zs_windows" << endl;
+                batch.rows(chgroupname+"/zs_windows", PredType::NATIVE_UINT16, windows.data(), nwritten, 2, chunk);
+                cout << "\t" << chgroupname << "/zs_values" << endl;
+                batch.rows(chgroupname+"/zs_values", PredType::NATIVE_UINT16, values.data(), values.size(), 0, chunk, &settings.getFilters());
+                
+                windows.erase(windows.begin(), windows.begin()+2*nwritten);
+                nwindows.erase(nwindows.begin(), nwindows.begin()+nEvents);
+            } else if (settings.getStoreSamples()) {
+                cout << "\t" << chgroupname << "/samples" << endl;
+                batch.rows(chgroupname+"/samples", PredType::NATIVE_UINT16, samples[gr][ch], nEvents, nSamples, chunk, &settings.getFilters());
+            }
+            if (reducers[gr][ch]) reducers[gr][ch]->writeOut(batch,chgroupname,nEvents,chunk);
             memmove(samples[gr][ch],samples[gr][ch]+nEvents*nSamples,sizeof(uint16_t)*nSamples*(grGrabbed[gr]-nEvents));
         }
         
         if (trnActive[gr]) {
             string chname = "tr";
-            Group chgroup = grgroup.createGroup(chname);
             string chgroupname = "/"+settings.getIndex()+"/"+grname+"/"+chname;
+            batch.group(chgroupname);
             
             cout << "\t" << chgroupname << endl;
         
-            Attribute offset = chgroup.createAttribute("offset",PredType::NATIVE_UINT32,scalar);
             ival = settings.getTrDCOffset(gr/2);
-            offset.write(PredType::NATIVE_UINT32,&ival);
+            batch.attribute(chgroupname,"offset",PredType::NATIVE_UINT32,&ival);
             
             cout << "\t" << chgroupname << "/samples" << endl;
-            DataSet samples_ds = file.createDataSet(chgroupname+"/samples", PredType::NATIVE_UINT16, samplespace);
-            samples_ds.write(trn_samples[gr], PredType::NATIVE_UINT16);
+            batch.rows(chgroupname+"/samples", PredType::NATIVE_UINT16, trn_samples[gr], nEvents, nSamples, chunk, &settings.getFilters());
             memmove(trn_samples[gr],trn_samples[gr]+nEvents*nSamples,sizeof(uint16_t)*nSamples*(grGrabbed[gr]-nEvents));
         }
             
         cout << "\t" << grgroupname << "/start_index" << endl;
-        DataSet start_index_ds = file.createDataSet(grgroupname+"/start_index", PredType::NATIVE_UINT16, metaspace);
-        start_index_ds.write(start_index[gr], PredType::NATIVE_UINT16);
+        batch.rows(grgroupname+"/start_index", PredType::NATIVE_UINT16, start_index[gr], nEvents, 0, chunk);
         memmove(start_index[gr],start_index[gr]+nEvents,sizeof(uint16_t)*(grGrabbed[gr]-nEvents));
         
         cout << "\t" << grgroupname << "/patterns" << endl;
-        DataSet patterns_ds = file.createDataSet(grgroupname+"/patterns", PredType::NATIVE_UINT16, metaspace);
-        patterns_ds.write(patterns[gr], PredType::NATIVE_UINT16);
+        batch.rows(grgroupname+"/patterns", PredType::NATIVE_UINT16, patterns[gr], nEvents, 0, chunk);
         memmove(patterns[gr],patterns[gr]+nEvents,sizeof(uint16_t)*(grGrabbed[gr]-nEvents));
             
         cout << "\t" << grgroupname << "/trigger_time" << endl;
-        DataSet trigger_time_ds = file.createDataSet(grgroupname+"/trigger_time", PredType::NATIVE_UINT32, metaspace);
-        trigger_time_ds.write(trigger_time[gr], PredType::NATIVE_UINT32);
+        batch.rows(grgroupname+"/trigger_time", PredType::NATIVE_UINT32, trigger_time[gr], nEvents, 0, chunk);
         memmove(trigger_time[gr],trigger_time[gr]+nEvents,sizeof(uint32_t)*(grGrabbed[gr]-nEvents));
         
         cout << "\t" << grgroupname << "/trigger_count" << endl;
-        DataSet trigger_count_ds = file.createDataSet(grgroupname+"/trigger_count", PredType::NATIVE_UINT32, metaspace);
-        trigger_count_ds.write(trigger_count[gr], PredType::NATIVE_UINT32);
+        batch.rows(grgroupname+"/trigger_count", PredType::NATIVE_UINT32, trigger_count[gr], nEvents, 0, chunk);
         memmove(trigger_count[gr],trigger_count[gr]+nEvents,sizeof(uint32_t)*(grGrabbed[gr]-nEvents));
         
         grGrabbed[gr] -= nEvents;
     }
     
-    dispatch_index -= nEvents;
-    if (dispatch_index < 0) dispatch_index = 0;
+    if (zs) {
+        cout << "\tZero suppression kept " << zs_kept << " / " << zs_total << " samples (compression " << (zs_kept ? (double)zs_total/zs_kept : 0.0) << "x) costing " << zs_time << " s" << endl;
+        zs_time = 0.0;
+    }
+    
+    dispatch_index = dispatch_index > nEvents ? dispatch_index - nEvents : 0;
+    
+    clock_gettime(CLOCK_MONOTONIC,&end_time);
+    cout << "\t" << settings.getIndex() << " prepared " << nEvents << " events in " << (end_time.tv_sec - start_time.tv_sec)+1e-9*(end_time.tv_nsec - start_time.tv_nsec) << " s" << endl;
 }
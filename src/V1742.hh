@@ -24,6 +24,9 @@
 #include "VMEBridge.hh"
 #include "Digitizer.hh"
 #include "RunDB.hh"
+#include "Reduction.hh"
+#include "CalibFile.hh"
+#include "Output.hh"
 #include "json.hh"
 
 #ifndef V1742__hh
@@ -49,6 +52,9 @@ typedef struct {
     uint8_t group_enable[4]; //1 bit bool
     uint8_t max_event_blt; //8 bit events per transfer
     bool channel_mask[4][8]; //1 bit bool
+    uint16_t zs_threshold; //counts from pedestal to keep (0 disables zero suppression)
+    uint16_t zs_pre; //samples to keep before a threshold crossing
+    uint16_t zs_post; //samples to keep after a threshold crossing
 } V1742_card_config;
 
 enum V1742SampleFreq {GHz_5, GHz_2_5, GHz_1};
@@ -114,6 +120,35 @@ class V1742Settings : public DigitizerSettings  {
             return card.dc_offset[ch];
         }
         
+        inline uint32_t getZSThreshold() {
+            return card.zs_threshold;
+        }
+        
+        inline uint32_t getZSPre() {
+            return card.zs_pre;
+        }
+        
+        inline uint32_t getZSPost() {
+            return card.zs_post;
+        }
+        
+        inline bool getStoreSamples() {
+            return store_samples;
+        }
+        
+        inline bool getCalibAtDecode() {
+            return calib_at_decode;
+        }
+        
+        inline bool getReduction(uint32_t gr, uint32_t ch, reduction_config &config) {
+            config = reductions[gr*8+ch];
+            return reduce[gr*8+ch];
+        }
+        
+        inline const output_filters& getFilters() {
+            return filters;
+        }
+        
         inline uint32_t getTrDCOffset(uint32_t tr) {
             switch (tr) {
                 case 0: return card.tr0_dc_offset;
@@ -126,6 +161,12 @@ class V1742Settings : public DigitizerSettings  {
     
         V1742_card_config card;
         
+        bool store_samples;
+        bool calib_at_decode;
+        output_filters filters;
+        bool reduce[32];
+        reduction_config reductions[32];
+        
         void groupDefaults(uint32_t group);
         
 };
@@ -135,17 +176,41 @@ class V1742calib {
     public:
         V1742calib(CAEN_DGTZ_DRS4Correction_t *dat);
         
+        V1742calib(const calib_file_tables &tables);
+        
         virtual ~V1742calib();
         
         virtual void calibrate(uint16_t *samples[4][8], uint16_t *trn_samples[4], size_t sampPerEv, uint16_t *start_index[4], bool grActive[4], bool trActive[4], size_t num);
         
+        inline void setThreads(size_t _threads) {
+            threads = _threads ? _threads : 1;
+        }
+        
+        virtual void calibrateEvent(size_t gr, uint16_t *samps[9], size_t nch, size_t sampPerEv, uint16_t cellidx);
+        
+        //a range of events in one group to calibrate
+        typedef struct {
+            size_t gr;
+            uint16_t *samples[9]; //NULL tr if inactive
+            uint16_t *start_index;
+            size_t sampPerEv, first, last;
+        } calib_task;
+        
     protected:
         struct {
             struct {
-                int cell_offset[1024], seq_offset[1024];
+                uint16_t cell_offset[2048], seq_offset[1024]; //cell offsets repeated twice
             } chans[9]; 
             int cell_delay[1024];   
         } groups[4];
+        
+        size_t threads;
+        
+        void loadGroup(size_t gr, const int16_t cell[9][1024], const int8_t nsample[9][1024], const float time[1024]);
+        
+        static void* calib_thread(void *data);
+        
+        void calibrateTask(const calib_task &task);
 
 };
 
@@ -193,6 +258,8 @@ class V1742 : public Digitizer {
         
         virtual bool program(DigitizerSettings &settings);
         
+        virtual bool retune(DigitizerSettings &current, DigitizerSettings &next, const std::vector<std::string> &keys);
+        
         virtual void softTrig();
         
         virtual void startAcquisition();
@@ -209,6 +276,9 @@ class V1742 : public Digitizer {
         
         static V1742calib* staticGetCalib(V1742SampleFreq freq, int link, uint32_t baseaddr);
         
+        //uses tables in cachedir unless missing, stale, or refresh is set
+        static V1742calib* cachedGetCalib(V1742SampleFreq freq, int link, uint32_t baseaddr, const std::string &cachedir, double max_age, bool refresh, uint32_t serial = 0);
+        
 };
 
 class V1742Decoder : public Decoder {
@@ -221,19 +291,27 @@ class V1742Decoder : public Decoder {
         
         virtual void decode(Buffer &buffer);
         
+        virtual size_t index(const char *data, size_t size, std::vector<raw_index_entry> &entries);
+        
         virtual size_t eventsReady();
         
-        virtual void writeOut(H5::H5File &file, size_t nEvents);
+        using Decoder::writeOut;
         
-        virtual void dispatch(int nfd, int *fds);
+        virtual void writeOut(OutputBatch &batch, size_t nEvents);
+        
+        virtual void dispatch(LiveFeed &feed);
+        
+        virtual bool getPatterns(size_t nEvents, std::vector<uint16_t> &patterns);
 
     protected:
         
         size_t eventBuffer;
-        V1742calib *calib;
+        V1742calib *calib; //borrowed, owned by whoever fetched the tables
         V1742Settings &settings;
         
         size_t dispatch_index;
+        std::vector<uint16_t> feed_channels; //live feed index of each channel
+        uint64_t feed_events;
         size_t decode_size;
         size_t group_counter,event_counter,decode_counter;
         struct timespec last_decode_time;
@@ -251,10 +329,30 @@ class V1742Decoder : public Decoder {
         uint32_t *trigger_time[4];
         bool trnActive[4];
         uint16_t *trn_samples[4];
+        Reducer *reducers[4][8];
+        
+        //zero suppression state, windows are (start,length) pairs
+        uint32_t zs_pedestal[4][8]; //running pedestal scaled by 16
+        std::vector<uint32_t> zs_nwindows[4][8];
+        std::vector<uint16_t> zs_windows[4][8];
+        double zs_time;
+        
+        double calib_time;
+        
+        size_t hist_channels[4][8]; //amplitude and baseline histograms of each channel
+        size_t hist_patterns;
+        
+        virtual HistogramSet* newHistograms();
         
         uint32_t* decode_event_structure(uint32_t *event);
         
         uint32_t* decode_group_structure(uint32_t *group, uint32_t gr);
+        
+        void zero_suppress(uint32_t gr, size_t ev);
+        
+        void calibrate_event(uint32_t gr, size_t ev);
+        
+        void fill_histograms(uint32_t gr, size_t ev);
 
 };
 
@@ -25,7 +25,12 @@
 #include <cmath>
 #include <csignal>
 #include <cstring>
+#include <cerrno>
 #include <fstream>
+#include <deque>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "RunDB.hh"
 #include "VMEBridge.hh"
@@ -33,6 +38,8 @@
 #include "V1742.hh"
 #include "V65XX.hh"
 #include "LeCroy6Zi.hh"
+#include "EventBuilder.hh"
+#include "RawFile.hh"
 
 using namespace std;
 using namespace H5;
@@ -44,6 +51,10 @@ bool decode_running;
 
 class RunType {
     public:
+        RunType() : maxBytes(0), maxSeconds(0.0), full(false), fileBytes(0), paused(false) { }
+        
+        virtual ~RunType() { }
+        
         //called just before readout begins
         virtual void begin() = 0;
         
@@ -57,29 +68,68 @@ class RunType {
         virtual string fname() = 0;
         
         //add any runtype metadata to output file
-        virtual void write(H5File &file) = 0;
+        virtual void write(OutputBatch &batch) = 0;
         
         //called after data is written to add more data or prepare for next file
         virtual bool keepgoing() = 0;
         
+        //with independent cards, called after writeout for each card with the
+        //events in its open file, true if the card should write it now
+        virtual bool cardWriteout(size_t card, size_t evtsInFile) = 0;
+        
+        //names the nth file of a card writing on its own schedule
+        virtual string cardFname(const string &card, size_t nfile) = 0;
+        
+        //limits on the readout bytes and wall time of each file (0 for none)
+        void setFileLimits(size_t _maxBytes, double _maxSeconds) {
+            maxBytes = _maxBytes;
+            maxSeconds = _maxSeconds;
+        }
+        
+        //called alongside writeout with the readout bytes and seconds in the
+        //current file, true if a limit requires writing it regardless
+        bool fileFull(size_t bytes, double seconds) {
+            fileBytes = bytes;
+            full = !paused && ((maxBytes && bytes >= maxBytes) || (maxSeconds > 0.0 && seconds >= maxSeconds));
+            return full;
+        }
+        
+        //true between files while readout is stopped, when events decoded
+        //are stale and must not be appended to the next file
+        inline bool isPaused() { return paused; }
+        
+    protected:
+        size_t maxBytes;
+        double maxSeconds;
+        bool full; //result of the last fileFull
+        size_t fileBytes; //readout in the current file at the last fileFull
+        bool paused; //readout is stopped between files, so limits cannot apply
+        
+        inline bool limited() { return maxBytes || maxSeconds > 0.0; }
+        
 };
 
 // Gets fixed numbers of events, optionally splitting into multiple files (repeating)
 // nEvents is the number of events to grab for all cards (0 for continuious run)
 // nRepeat is the number of times to repeat (0 for once, 1 for once, N for multiple)
+// With file limits a cycle may span several files, numbered after the cycle
 class NEventsRun : public RunType {
     protected:
         string basename;
-        size_t nEvents, nRepeat, curCycle;
+        size_t nEvents, nRepeat, curCycle, curPart;
         double total;
         struct timespec cur_time, last_time;
+        vector<size_t> carried, last; //events of the cycle in earlier parts, and in this one
+        bool reached;
         
     public: 
         NEventsRun(string _basename, size_t _nEvents, size_t _nRepeat = 0) : 
             basename(_basename),
             nEvents(_nEvents), 
             nRepeat(_nRepeat), 
-            curCycle(0) { }
+            curCycle(0),
+            curPart(0),
+            reached(false) { }
         
         virtual ~NEventsRun() {
         }
@@ -91,11 +141,14 @@ class NEventsRun : public RunType {
         virtual bool writeout(std::vector<size_t> &evtsReady) {
             total = 0.0;
             bool writeout = nEvents > 0;
+            carried.resize(evtsReady.size());
             for (size_t i = 0; i < evtsReady.size(); i++) {
                 total += evtsReady[i];
-                if (evtsReady[i] < nEvents) writeout = false;
+                if (carried[i] + evtsReady[i] < nEvents) writeout = false;
             }
             total /= evtsReady.size();
+            last = evtsReady;
+            reached = writeout;
             
             if (nRepeat) cout << "Cycle " << curCycle+1 << " / " << nRepeat << endl;
             
@@ -107,30 +160,32 @@ class NEventsRun : public RunType {
         }
         
         virtual string fname() {
-            if (nRepeat > 0) {
-                return basename + "." + to_string(curCycle);
-            } else {
-                return basename;
-            }
+            string name = basename;
+            if (nRepeat > 0) name += "." + to_string(curCycle);
+            if (limited()) name += "." + to_string(curPart);
+            return name;
         }
         
-        virtual void write(H5File &file) {
+        virtual void write(OutputBatch &batch) {
             double time_int = (cur_time.tv_sec - last_time.tv_sec)+1e-9*(cur_time.tv_nsec - last_time.tv_nsec);
             
-            DataSpace scalar(0,NULL);
-            Group root = file.openGroup("/");
-            
-            Attribute runtime = root.createAttribute("file_runtime",PredType::NATIVE_DOUBLE,scalar);
-            runtime.write(PredType::NATIVE_DOUBLE,&time_int);
+            batch.attribute("/","file_runtime",PredType::NATIVE_DOUBLE,&time_int);
             
             uint32_t timestamp = time(NULL);
-            Attribute tstampattr = root.createAttribute("creation_time",PredType::NATIVE_UINT32,scalar);
-            tstampattr.write(PredType::NATIVE_UINT32,&timestamp);
+            batch.attribute("/","creation_time",PredType::NATIVE_UINT32,&timestamp);
 
 			last_time = cur_time;
         }
         
         virtual bool keepgoing() {
+            if (full && !reached && !stop) {
+                //a file limit split the cycle, which goes on in the next part
+                for (size_t i = 0; i < carried.size(); i++) carried[i] += last[i];
+                curPart++;
+                return true;
+            }
+            carried.assign(carried.size(),0);
+            curPart = 0;
             if (nRepeat > 0) {
                 last_time = cur_time;
                 curCycle++;
@@ -139,10 +194,22 @@ class NEventsRun : public RunType {
                 return false;
             }
         }
+        
+        virtual bool cardWriteout(size_t card, size_t evtsInFile) {
+            return nEvents > 0 && evtsInFile >= nEvents;
+        }
+        
+        virtual string cardFname(const string &card, size_t nfile) {
+            return basename + "." + card + "." + to_string(nfile);
+        }
 };
 
 //Runs for a specified amount of time (seconds) splitting files by a certain 
-//number of events (0 means all one file - but watch your buffers). 
+//number of events (0 means all one file - but watch your buffers) or by the
+//file limits. Adaptive runs instead size each file from the event rate and
+//readout per event of the last, aiming at a target size and interval with
+//the events per file as the most the buffers hold.
+
 //Assumes event rate is faster than runtime, i.e. the acquisition will stop on 
 //the first event after time runs out.
 class TimedRun : public RunType {
@@ -151,13 +218,26 @@ class TimedRun : public RunType {
         size_t runtime, evtsPerFile, curCycle;
         double total;
         struct timespec cur_time, last_time, begin_time;
+        size_t maxPerFile, fewest, most; //adaptive cap, and events of the quietest and busiest card
+        double targetBytes, targetSeconds; //adaptive goals for each file (0 for none)
         
     public: 
         TimedRun(string _basename, size_t _runtime, size_t _evtsPerFile) : 
             basename(_basename),
             runtime(_runtime), 
             evtsPerFile(_evtsPerFile), 
-            curCycle(0) { }
+            curCycle(0),
+            maxPerFile(0),
+            targetBytes(0.0),
+            targetSeconds(0.0) { }
+        
+        //sizes files for about target_mb of readout every target_seconds,
+        //whichever is reached first, with the current events per file as cap
+        void adapt(double target_mb, double target_seconds) {
+            maxPerFile = evtsPerFile;
+            targetBytes = target_mb*1048576.0;
+            targetSeconds = target_seconds;
+        }
         
         virtual ~TimedRun() {
         }
@@ -169,10 +249,14 @@ class TimedRun : public RunType {
         
         virtual bool writeout(std::vector<size_t> &evtsReady) {
             total = 0.0;
+            fewest = evtsReady.size() ? evtsReady[0] : 0;
+            most = 0;
             bool writeout = evtsPerFile > 0;
             for (size_t i = 0; i < evtsReady.size(); i++) {
                 total += evtsReady[i];
                 if (evtsReady[i] < evtsPerFile) writeout = false;
+                fewest = min(fewest,evtsReady[i]);
+                most = max(most,evtsReady[i]);
             }
             total /= evtsReady.size();
             
@@ -182,6 +266,14 @@ class TimedRun : public RunType {
             double time_int = (cur_time.tv_sec - last_time.tv_sec)+1e-9*(cur_time.tv_nsec - last_time.tv_nsec);
             cout << "Avg rate " << total/time_int << " Hz" << endl;
             
+            //a rate change overshooting the goals twice over, or any card 
+            //filling its buffers, ends the file early
+            if (maxPerFile) {
+                if (most >= maxPerFile) writeout = true;
+                if (targetSeconds > 0.0 && time_int >= 2.0*targetSeconds) writeout = true;
+                if (targetBytes > 0.0 && fileBytes >= 2.0*targetBytes) writeout = true;
+            }
+            
             time_int = (cur_time.tv_sec - begin_time.tv_sec)+1e-9*(cur_time.tv_nsec - begin_time.tv_nsec);
             if (time_int >= runtime) writeout = true;
             
@@ -189,36 +281,201 @@ class TimedRun : public RunType {
         }
         
         virtual string fname() {
-            if (evtsPerFile > 0) {
+            if (evtsPerFile > 0 || limited()) {
                 return basename + "." + to_string(curCycle);
             } else {
                 return basename;
             }
         }
         
-        virtual void write(H5File &file) {
+        virtual void write(OutputBatch &batch) {
             double time_int = (cur_time.tv_sec - last_time.tv_sec)+1e-9*(cur_time.tv_nsec - last_time.tv_nsec);
             
-            DataSpace scalar(0,NULL);
-            Group root = file.openGroup("/");
-            
-            Attribute runtime = root.createAttribute("file_runtime",PredType::NATIVE_DOUBLE,scalar);
-            runtime.write(PredType::NATIVE_DOUBLE,&time_int);
+            batch.attribute("/","file_runtime",PredType::NATIVE_DOUBLE,&time_int);
 
             
             uint32_t timestamp = time(NULL);
-            Attribute tstampattr = root.createAttribute("creation_time",PredType::NATIVE_UINT32,scalar);
-            tstampattr.write(PredType::NATIVE_UINT32,&timestamp);
+            batch.attribute("/","creation_time",PredType::NATIVE_UINT32,&timestamp);
 
+            if (maxPerFile) {
+                const uint64_t perfile = evtsPerFile;
+                batch.attribute("/","events_per_file",PredType::NATIVE_UINT64,&perfile);
+                resize(time_int);
+            }
 
 			last_time = cur_time;
         }
         
+        //the quietest card decides when files are written, so its rate and
+        //the readout of all cards per event size the next file
+        void resize(double time_int) {
+            if (!fewest || time_int <= 0.0) return;
+            size_t next = maxPerFile;
+            if (targetSeconds > 0.0) next = min(next,(size_t)(fewest/time_int*targetSeconds));
+            if (targetBytes > 0.0 && fileBytes) next = min(next,(size_t)(targetBytes*total/fileBytes));
+            evtsPerFile = max(next,(size_t)1);
+            cout << "Next file " << evtsPerFile << " events (" << fewest/time_int << " Hz, " << fileBytes/total/1024.0 << " KiB/event)" << endl;
+        }
+        
         virtual bool keepgoing() {
-            if (evtsPerFile > 0) curCycle++;
+            if (evtsPerFile > 0 || limited()) curCycle++;
             double time_int = (cur_time.tv_sec - begin_time.tv_sec)+1e-9*(cur_time.tv_nsec - begin_time.tv_nsec);
             return time_int < runtime;
         }
+        
+        virtual bool cardWriteout(size_t card, size_t evtsInFile) {
+            return evtsPerFile > 0 && evtsInFile >= evtsPerFile;
+        }
+        
+        virtual string cardFname(const string &card, size_t nfile) {
+            return basename + "." + card + "." + to_string(nfile);
+        }
+};
+
+//one setting swept by a scan: key (a.b for nested members) of the table
+//name[index] takes values[n] at the nth point
+typedef struct {
+    string table, index, key;
+    vector<json::Value> values;
+} scan_param;
+
+//Steps through points of settings, taking nEvents events (or seconds of 
+//running when nEvents is 0) at each into its own file. Between points the
+//run type waits, dropping nothing and writing nothing, while the readout loop
+//stops the cards, applies the next point, and rearms them. File limits split
+//a point into parts as for NEventsRun.
+class ScanRun : public RunType {
+    protected:
+        string basename;
+        size_t nEvents;
+        double seconds;
+        vector<scan_param> params;
+        size_t nPoints, curPoint, curPart;
+        double total;
+        struct timespec cur_time, last_time, point_time;
+        vector<size_t> carried, last; //events of the point in earlier parts, and in this one
+        bool reached;
+        
+    public: 
+        ScanRun(string _basename, size_t _nEvents, double _seconds, const vector<scan_param> &_params) : 
+            basename(_basename),
+            nEvents(_nEvents),
+            seconds(_seconds),
+            params(_params),
+            nPoints(_params.size() ? _params[0].values.size() : 0),
+            curPoint(0),
+            curPart(0),
+            reached(false) { }
+        
+        virtual ~ScanRun() {
+        }
+        
+        virtual void begin() {
+            clock_gettime(CLOCK_MONOTONIC,&last_time);
+            point_time = last_time;
+        }
+        
+        virtual bool writeout(std::vector<size_t> &evtsReady) {
+            if (paused) return false;
+            
+            total = 0.0;
+            bool writeout = nEvents > 0;
+            carried.resize(evtsReady.size());
+            for (size_t i = 0; i < evtsReady.size(); i++) {
+                total += evtsReady[i];
+                if (carried[i] + evtsReady[i] < nEvents) writeout = false;
+            }
+            total /= evtsReady.size();
+            last = evtsReady;
+            
+            cout << "Point " << curPoint+1 << " / " << nPoints << endl;
+            
+            clock_gettime(CLOCK_MONOTONIC,&cur_time);
+            double time_int = (cur_time.tv_sec - last_time.tv_sec)+1e-9*(cur_time.tv_nsec - last_time.tv_nsec);
+            cout << "Avg rate " << total/time_int << " Hz" << endl;
+            
+            time_int = (cur_time.tv_sec - point_time.tv_sec)+1e-9*(cur_time.tv_nsec - point_time.tv_nsec);
+            if (!nEvents && time_int >= seconds) writeout = true;
+            
+            reached = writeout;
+            return writeout;
+        }
+        
+        virtual string fname() {
+            string name = basename + "." + to_string(curPoint);
+            if (limited()) name += "." + to_string(curPart);
+            return name;
+        }
+        
+        virtual void write(OutputBatch &batch) {
+            double time_int = (cur_time.tv_sec - last_time.tv_sec)+1e-9*(cur_time.tv_nsec - last_time.tv_nsec);
+            
+            batch.attribute("/","file_runtime",PredType::NATIVE_DOUBLE,&time_int);
+            
+            uint32_t timestamp = time(NULL);
+            batch.attribute("/","creation_time",PredType::NATIVE_UINT32,&timestamp);
+            
+            const uint32_t point = curPoint;
+            batch.attribute("/","scan_point",PredType::NATIVE_UINT32,&point);
+            
+            //the settings of this point, as table[index].key: value lines
+            stringstream out;
+            json::Writer writer(out);
+            for (size_t i = 0; i < params.size(); i++) {
+                out << params[i].table << "[" << params[i].index << "]." << params[i].key << ": ";
+                writer.putValue(params[i].values[curPoint]);
+            }
+            const string settings = out.str();
+            batch.add([settings](H5File &file) {
+                DataSpace scalar(0,NULL);
+                StrType dtype(PredType::C_S1, settings.size());
+                Group root = file.openGroup("/");
+                Attribute attr = root.createAttribute("scan_settings",dtype,scalar);
+                attr.write(dtype,settings.c_str());
+            });
+            
+            last_time = cur_time;
+        }
+        
+        virtual bool keepgoing() {
+            if (full && !reached && !stop) {
+                //a file limit split the point, which goes on in the next part
+                for (size_t i = 0; i < carried.size(); i++) carried[i] += last[i];
+                curPart++;
+                return true;
+            }
+            carried.assign(carried.size(),0);
+            curPart = 0;
+            curPoint++;
+            paused = curPoint < nPoints;
+            return paused;
+        }
+        
+        virtual bool cardWriteout(size_t card, size_t evtsInFile) {
+            return false;
+        }
+        
+        virtual string cardFname(const string &card, size_t nfile) {
+            return basename + "." + card + "." + to_string(nfile);
+        }
+        
+        //with the readout lock held: true once a point is written and the 
+        //next one should be applied
+        bool pending() {
+            return paused;
+        }
+        
+        //index of the point being acquired, or to apply when pending
+        size_t point() {
+            return curPoint;
+        }
+        
+        //with the readout lock held, once the cards are rearmed
+        void resume() {
+            paused = false;
+            clock_gettime(CLOCK_MONOTONIC,&point_time);
+            last_time = point_time;
+        }
 };
 
 void int_handler(int x) {
@@ -226,6 +483,37 @@ void int_handler(int x) {
     stop = true;
 }
 
+static double seconds_since(const struct timespec &since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (now.tv_sec - since.tv_sec)+1e-9*(now.tv_nsec - since.tv_nsec);
+}
+
+struct write_queue;
+
+// A batch of events for the writer thread and what to do with its file
+typedef struct {
+    string fname; //nonempty to create this file before writing the batch
+    OutputBatch *batch;
+    bool finish; //close, fsync, and finalize the file after the batch
+    size_t events;
+    file_summary summary; //for the sidecar when finishing
+    vector<pair<write_queue*,size_t>> after; //finalize once these queues finished this many files
+} write_job;
+
+// Bounded queue between the decode and writer threads
+typedef struct write_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t pushed, popped;
+    deque<write_job> jobs;
+    size_t capacity;
+    bool done; //no more jobs will be pushed
+    size_t bytes; //held by queued batches
+    size_t direct_depth; //>0 builds whole files in memory and writes them with DirectFile
+    size_t finished; //files finished, or dropped after a failure
+    pthread_mutex_t *hdf5; //held for HDF5 calls when writers share the library
+} write_queue;
+
 typedef struct {
     vector<Buffer*> *buffers;
     vector<Decoder*> *decoders;
@@ -233,14 +521,311 @@ typedef struct {
     pthread_cond_t *newdata;
     string config;
     RunType *runtype;
+    EventBuilder *builder; //NULL if not building events
+    size_t builder_master, builder_fast; //decoder indexes
+    size_t chunk; //0 writes each file at once, otherwise appends chunks
+    size_t write_queue_size; //batches decoded ahead of the writer
+    size_t direct_depth; //O_DIRECT writes in flight (0 for buffered output)
+    bool direct_hdf5; //also build whole HDF5 files in memory to write them with O_DIRECT
+    bool raw; //record readout verbatim instead of decoding
+    bool per_card; //write each card to its own file, linked from a master file
+    bool independent; //per-card files roll on each card's own schedule
+    vector<string> cards; //digitizer indexes, naming raw files
+    LiveFeed *feed; //NULL if not publishing events for monitors
+    Histograms *hists; //NULL if decoders are not histogramming
 } decode_thread_data;
 
+//records the metadata every file has
+static void output_metadata(OutputBatch &batch, const string &config) {
+    batch.add([config](H5File &file) {
+        DataSpace scalar(0,NULL);
+        Group root = file.openGroup("/");
+       
+        StrType configdtype(PredType::C_S1, config.size());
+        Attribute configattr = root.createAttribute("run_config",configdtype,scalar);
+        configattr.write(configdtype,config.c_str());
+        
+        int epochtime = time(NULL);
+        Attribute timestamp = root.createAttribute("created_unix_timestamp",PredType::NATIVE_INT,scalar);
+        timestamp.write(PredType::NATIVE_INT,&epochtime);
+    });
+}
+
+//blocks while the queue is full, returning the seconds spent waiting
+static double queue_push(write_queue *queue, const write_job &job) {
+    struct timespec wait_start, wait_end;
+    clock_gettime(CLOCK_MONOTONIC,&wait_start);
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->jobs.size() >= queue->capacity) {
+        pthread_cond_wait(&queue->popped,&queue->mutex);
+    }
+    queue->jobs.push_back(job);
+    queue->bytes += job.batch->bytes();
+    pthread_cond_signal(&queue->pushed);
+    pthread_mutex_unlock(&queue->mutex);
+    clock_gettime(CLOCK_MONOTONIC,&wait_end);
+    return (wait_end.tv_sec - wait_start.tv_sec)+1e-9*(wait_end.tv_nsec - wait_start.tv_nsec);
+}
+
+//HDF5 is not thread safe, so writers of separate files take turns in it
+static void hdf5_lock(write_queue *queue, bool &locked, bool lock) {
+    if (!queue->hdf5 || locked == lock) return;
+    if (lock) {
+        pthread_mutex_lock(queue->hdf5);
+    } else {
+        pthread_mutex_unlock(queue->hdf5);
+    }
+    locked = lock;
+}
+
+//waits for the files a job must be finalized after
+static void finish_after(const write_job &job) {
+    for (size_t i = 0; i < job.after.size(); i++) {
+        write_queue *other = job.after[i].first;
+        pthread_mutex_lock(&other->mutex);
+        while (other->finished < job.after[i].second) {
+            pthread_cond_wait(&other->popped,&other->mutex);
+        }
+        pthread_mutex_unlock(&other->mutex);
+    }
+}
+
+void *writer_thread(void *_data) {
+    write_queue *queue = (write_queue*)_data;
+    
+    H5File *file = NULL;
+    string fname;
+    bool failed = false, image = false, locked = false;
+    core_image core;
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->jobs.empty() && !queue->done) {
+            pthread_cond_wait(&queue->pushed,&queue->mutex);
+        }
+        if (queue->jobs.empty()) {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        write_job job = queue->jobs.front();
+        pthread_mutex_unlock(&queue->mutex);
+        
+        //after a failure jobs are dropped so the decode thread never blocks
+        if (!failed) {
+            try {
+                Exception::dontPrint();
+                
+                struct timespec write_start, write_end;
+                clock_gettime(CLOCK_MONOTONIC,&write_start);
+                
+                hdf5_lock(queue,locked,true);
+                if (job.fname.size()) {
+                    fname = job.fname;
+                    cout << "Saving data to " << fname << endl;
+                    //a file written by one job can be built in memory and
+                    //written past the page cache, appended ones stay on sec2
+                    image = queue->direct_depth && job.finish;
+                    if (image) {
+                        file = outputCoreFile(outputPartName(fname),core);
+                    } else {
+                        file = new H5File(outputPartName(fname), H5F_ACC_TRUNC);
+                    }
+                }
+                job.batch->write(*file);
+                if (job.finish && image) {
+                    const size_t size = outputImageSize(*file,core);
+                    hdf5_lock(queue,locked,false);
+                    const uint32_t crc = outputImage(outputPartName(fname),core,size,queue->direct_depth);
+                    hdf5_lock(queue,locked,true);
+                    delete file;
+                    file = NULL;
+                    hdf5_lock(queue,locked,false);
+                    finish_after(job);
+                    outputFinalize(fname,job.summary,&crc);
+                } else if (job.finish) {
+                    delete file;
+                    file = NULL;
+                    hdf5_lock(queue,locked,false);
+                    int fd = open(outputPartName(fname).c_str(),O_RDONLY);
+                    if (fd >= 0) {
+                        fsync(fd);
+                        close(fd);
+                    }
+                    finish_after(job);
+                    outputFinalize(fname,job.summary);
+                } else {
+                    //make appended chunks visible to readers of the file
+                    file->flush(H5F_SCOPE_GLOBAL);
+                    hdf5_lock(queue,locked,false);
+                }
+                
+                clock_gettime(CLOCK_MONOTONIC,&write_end);
+                double write_time = (write_end.tv_sec - write_start.tv_sec)+1e-9*(write_end.tv_nsec - write_start.tv_nsec);
+                cout << "Wrote " << job.events << " events (" << job.batch->bytes()/1048576.0 << " MiB) in " << write_time << " s (" << job.events/write_time << " Hz)" << endl;
+            } catch (Exception &e) {
+                hdf5_lock(queue,locked,false);
+                cout << "Writer thread aborted: " << e.getDetailMsg() << endl;
+                failed = stop = true;
+            } catch (runtime_error &e) {
+                hdf5_lock(queue,locked,false);
+                cout << "Writer thread aborted: " << e.what() << endl;
+                failed = stop = true;
+            }
+        }
+        
+        pthread_mutex_lock(&queue->mutex);
+        queue->jobs.pop_front();
+        queue->bytes -= job.batch->bytes();
+        if (job.finish) queue->finished++;
+        pthread_cond_broadcast(&queue->popped);
+        pthread_mutex_unlock(&queue->mutex);
+        delete job.batch;
+    }
+    if (file) {
+        hdf5_lock(queue,locked,true);
+        delete file;
+        hdf5_lock(queue,locked,false);
+    }
+    pthread_exit(NULL);
+}
+
+static void start_writer(write_queue &queue, size_t capacity, size_t direct_depth, pthread_t &writer, pthread_mutex_t *hdf5 = NULL) {
+    pthread_mutex_init(&queue.mutex,NULL);
+    pthread_cond_init(&queue.pushed,NULL);
+    pthread_cond_init(&queue.popped,NULL);
+    queue.capacity = capacity ? capacity : 1;
+    queue.done = false;
+    queue.bytes = 0;
+    queue.direct_depth = direct_depth;
+    queue.finished = 0;
+    queue.hdf5 = hdf5;
+    pthread_create(&writer,NULL,&writer_thread,&queue);
+}
+
+//lets the writer finish what was queued
+static void finish_writer(write_queue &queue, pthread_t &writer) {
+    pthread_mutex_lock(&queue.mutex);
+    queue.done = true;
+    pthread_cond_signal(&queue.pushed);
+    pthread_mutex_unlock(&queue.mutex);
+    pthread_join(writer,NULL);
+    pthread_cond_destroy(&queue.pushed);
+    pthread_cond_destroy(&queue.popped);
+    pthread_mutex_destroy(&queue.mutex);
+}
+
+//records external links from a master file to the files of each card, by
+//name relative to the master so the set can be moved together
+static void output_links(OutputBatch &batch, const vector<string> &cards, const string &base) {
+    const size_t slash = base.rfind('/');
+    const string name = slash == string::npos ? base : base.substr(slash+1);
+    batch.add([cards,name](H5File &file) {
+        for (size_t i = 0; i < cards.size(); i++) {
+            const string path = "/" + cards[i], target = name + "." + cards[i] + ".h5";
+            if (H5Lcreate_external(target.c_str(),path.c_str(),file.getId(),path.c_str(),H5P_DEFAULT,H5P_DEFAULT) < 0) {
+                throw runtime_error("Could not link " + path + " to " + target);
+            }
+        }
+    });
+}
+
+//starts a job for each writer: one per card with per-card files, then the
+//master file's, which holds everything else
+static void start_jobs(decode_thread_data *data, vector<write_job> &jobs, size_t nwriters, bool finish, const vector<size_t> &evtsReady) {
+    jobs.assign(nwriters,write_job());
+    for (size_t j = 0; j < nwriters; j++) {
+        jobs[j].batch = new OutputBatch;
+        jobs[j].finish = finish;
+        jobs[j].events = 0;
+    }
+    for (size_t i = 0; i < evtsReady.size(); i++) {
+        jobs[data->per_card ? i : nwriters-1].events += evtsReady[i];
+    }
+}
+
+//names the files of the jobs and records what each file starts with
+static void open_jobs(decode_thread_data *data, vector<write_job> &jobs, const string &base) {
+    write_job &master = jobs.back();
+    master.fname = base + ".h5";
+    output_metadata(*master.batch,data->config);
+    if (data->per_card) {
+        for (size_t i = 0; i < data->cards.size(); i++) {
+            jobs[i].fname = base + "." + data->cards[i] + ".h5";
+            output_metadata(*jobs[i].batch,data->config);
+        }
+        output_links(*master.batch,data->cards,base);
+    }
+}
+
+//fills the sidecar summaries of finishing jobs, the master file finishing 
+//after the cards' files so it never links to an unfinished file
+static void finish_jobs(decode_thread_data *data, vector<write_job> &jobs, vector<write_queue> &queues, const vector<size_t> &events, double seconds, size_t nfiles) {
+    write_job &master = jobs.back();
+    master.summary.cards = data->cards;
+    master.summary.events.assign(events.begin(),events.end());
+    master.summary.seconds = seconds;
+    if (data->per_card) {
+        for (size_t i = 0; i < data->cards.size(); i++) {
+            jobs[i].summary.cards.assign(1,data->cards[i]);
+            jobs[i].summary.events.assign(1,events[i]);
+            jobs[i].summary.seconds = seconds;
+            master.after.push_back(make_pair(&queues[i],nfiles));
+        }
+    }
+}
+
+//with the readout lock held, hands monitors the events decoded since the
+//last call in one batch, before any are written out, and merges histograms
+//that are due
+static void publish_events(decode_thread_data *data) {
+    if (data->hists) {
+        for (size_t i = 0; i < data->decoders->size(); i++) {
+            HistogramSet *set = (*data->decoders)[i]->getHistograms();
+            if (set) data->hists->merge(*set);
+        }
+    }
+    if (!data->feed) return;
+    for (size_t i = 0; i < data->decoders->size(); i++) {
+        (*data->decoders)[i]->dispatch(*data->feed);
+    }
+    data->feed->publish();
+}
+
+//records the histograms of a card into the batch finishing the file with
+//its data
+static void snapshot_histograms(decode_thread_data *data, size_t card, OutputBatch &batch) {
+    HistogramSet *set = (*data->decoders)[card]->getHistograms();
+    if (data->hists && set) data->hists->snapshot(*set,batch);
+}
+
 void *decode_thread(void *_data) {
     signal(SIGINT,int_handler);
     decode_thread_data* data = (decode_thread_data*)_data;
     
+    //HDF5 is only touched by the writers, so decoding continues while they
+    //write. Each card gets its own writer with per-card files, the last one
+    //writing the master file.
+    const size_t nwriters = data->per_card ? data->decoders->size()+1 : 1;
+    vector<write_queue> queues(nwriters);
+    vector<pthread_t> writers(nwriters);
+    pthread_mutex_t hdf5;
+    pthread_mutex_init(&hdf5,NULL);
+    for (size_t j = 0; j < nwriters; j++) {
+        start_writer(queues[j],data->write_queue_size,data->direct_hdf5 ? data->direct_depth : 0,writers[j],data->per_card ? &hdf5 : NULL);
+    }
+    
     vector<size_t> evtsReady(data->buffers->size());
+    int nfiles = 0;
+    //streaming state: whether a file is open and events already appended to it
+    bool file_open = false;
+    vector<size_t> inFile(data->buffers->size()), counts(data->buffers->size());
+    //handed to the writers once iomutex is released, nwriters jobs at a time
+    vector<write_job> ready, jobs;
+    double stalled = 0.0; //time spent waiting on a full queue since last report
+    //readout taken into the current file and when it started, for file limits
+    size_t file_bytes = 0;
+    struct timespec file_start;
     data->runtype->begin();
+    clock_gettime(CLOCK_MONOTONIC,&file_start);
     try {
         decode_running = true;
         while (decode_running) {
@@ -261,37 +846,110 @@ void *decode_thread(void *_data) {
                 size_t ev = (*data->decoders)[i]->eventsReady();
                 evtsReady[i] = ev;
                 total += ev;
+                file_bytes += sz;
             }
+            publish_events(data);
+            const bool full = data->runtype->fileFull(file_bytes,seconds_since(file_start));
             
-            if (stop && total == 0) {
+            if (stop && total == 0 && !file_open) {
                 decode_running = false;
-            } else if (stop || data->runtype->writeout(evtsReady)) {
-                Exception::dontPrint();
-                
-                string fname = data->runtype->fname() + ".h5"; 
-                cout << "Saving data to " << fname << endl;
-                
-                H5File file(fname, H5F_ACC_TRUNC);
-                data->runtype->write(file);
-                  
-                DataSpace scalar(0,NULL);
-                Group root = file.openGroup("/");
-               
-                StrType configdtype(PredType::C_S1, data->config.size());
-                Attribute config = root.createAttribute("run_config",configdtype,scalar);
-                config.write(configdtype,data->config.c_str());
+            } else if (data->chunk) {
+                //the run type sees every event in the file, written or not
+                bool flush = false;
+                for (size_t i = 0; i < evtsReady.size(); i++) {
+                    counts[i] = inFile[i] + evtsReady[i];
+                    flush |= evtsReady[i] >= data->chunk && !data->runtype->isPaused();
+                }
+                const bool roll = data->runtype->writeout(counts) || full || stop;
+                if (roll || flush) {
+                    start_jobs(data,jobs,nwriters,roll,evtsReady);
+                    OutputBatch &master = *jobs.back().batch;
+                    
+                    if (!file_open) {
+                        open_jobs(data,jobs,data->runtype->fname());
+                        file_open = true;
+                    }
+                    
+                    if (data->builder) {
+                        vector<uint16_t> master_patterns, fast_patterns;
+                        (*data->decoders)[data->builder_master]->getPatterns(evtsReady[data->builder_master],master_patterns);
+                        (*data->decoders)[data->builder_fast]->getPatterns(evtsReady[data->builder_fast],fast_patterns);
+                        data->builder->build(nfiles,master_patterns,fast_patterns,inFile[data->builder_master],inFile[data->builder_fast]);
+                    }
+                    
+                    for (size_t i = 0; i < data->decoders->size(); i++) {
+                        (*data->decoders)[i]->writeOut(*jobs[data->per_card ? i : nwriters-1].batch,evtsReady[i]);
+                        inFile[i] += evtsReady[i];
+                    }
+                    
+                    if (roll) {
+                        for (size_t i = 0; i < data->decoders->size(); i++) {
+                            snapshot_histograms(data,i,*jobs[data->per_card ? i : nwriters-1].batch);
+                        }
+                        finish_jobs(data,jobs,queues,inFile,seconds_since(file_start),nfiles+1);
+                        data->runtype->write(master);
+                        decode_running = data->runtype->keepgoing();
+                        nfiles++;
+                        if (data->builder && (stop || !decode_running)) data->builder->flush();
+                    }
+                    if (data->builder) data->builder->writeOut(master,data->chunk);
+                    
+                    if (roll) {
+                        file_open = false;
+                        for (size_t i = 0; i < inFile.size(); i++) inFile[i] = 0;
+                        file_bytes = 0;
+                        clock_gettime(CLOCK_MONOTONIC,&file_start);
+                    }
+                    ready.insert(ready.end(),jobs.begin(),jobs.end());
+                }
+            } else if (stop || data->runtype->writeout(evtsReady) || full) {
+                start_jobs(data,jobs,nwriters,true,evtsReady);
+                OutputBatch &master = *jobs.back().batch;
+                open_jobs(data,jobs,data->runtype->fname());
+                finish_jobs(data,jobs,queues,evtsReady,seconds_since(file_start),nfiles+1);
+                file_bytes = 0;
+                clock_gettime(CLOCK_MONOTONIC,&file_start);
+                data->runtype->write(master);
                 
-                int epochtime = time(NULL);
-                Attribute timestamp = root.createAttribute("created_unix_timestamp",PredType::NATIVE_INT,scalar);
-                timestamp.write(PredType::NATIVE_INT,&epochtime);
+                //patterns must be collected before writeOut drops the events
+                if (data->builder) {
+                    vector<uint16_t> master_patterns, fast_patterns;
+                    (*data->decoders)[data->builder_master]->getPatterns(evtsReady[data->builder_master],master_patterns);
+                    (*data->decoders)[data->builder_fast]->getPatterns(evtsReady[data->builder_fast],fast_patterns);
+                    data->builder->build(nfiles,master_patterns,fast_patterns);
+                }
                 
                 for (size_t i = 0; i < data->decoders->size(); i++) {
-                    (*data->decoders)[i]->writeOut(file,evtsReady[i]);
+                    (*data->decoders)[i]->writeOut(*jobs[data->per_card ? i : nwriters-1].batch,evtsReady[i]);
+                    snapshot_histograms(data,i,*jobs[data->per_card ? i : nwriters-1].batch);
                 }
                 
                 decode_running = data->runtype->keepgoing();
+                nfiles++;
+                
+                if (data->builder) {
+                    if (stop || !decode_running) data->builder->flush();
+                    data->builder->writeOut(master);
+                }
+                ready.insert(ready.end(),jobs.begin(),jobs.end());
             }
             pthread_mutex_unlock(data->iomutex);
+            
+            //readout continues while this waits for room in the queues
+            for (size_t i = 0; i < ready.size(); i++) {
+                write_queue &queue = queues[i % nwriters];
+                stalled += queue_push(&queue,ready[i]);
+                if (ready[i].events == 0 && nwriters > 1) continue;
+                pthread_mutex_lock(&queue.mutex);
+                const size_t depth = queue.jobs.size(), bytes = queue.bytes;
+                pthread_mutex_unlock(&queue.mutex);
+                cout << "Queued " << ready[i].events << " events for writing, " << depth << " / " << queue.capacity << " batches (" << bytes/1048576.0 << " MiB) waiting" << endl;
+                if (stalled > 0.1) {
+                    cout << "****Writer is behind, decoding waited " << stalled << " s for the queue" << endl;
+                    stalled = 0.0;
+                }
+            }
+            ready.clear();
         }
         stop = true;
     } catch (runtime_error &e) {
@@ -300,16 +958,463 @@ void *decode_thread(void *_data) {
         pthread_mutex_lock(data->iomutex);
         cout << "Decode thread aborted: " << e.what() << endl;
         pthread_mutex_unlock(data->iomutex);
+        for (size_t i = 0; i < ready.size(); i++) delete ready[i].batch;
+    }
+    
+    //the master writer may be waiting on the others, so it goes first
+    for (size_t j = nwriters; j-- > 0; ) {
+        finish_writer(queues[j],writers[j]);
     }
+    pthread_mutex_destroy(&hdf5);
+    
     pthread_exit(NULL);
 }
 
-int main(int argc, char **argv) {
+//records external links /<card>/<n> from a master file to the nth file of a
+//card written on its own schedule, by name relative to the master
+static void output_card_links(OutputBatch &batch, const string &card, const vector<size_t> &nfiles, const vector<string> &fnames) {
+    vector<string> names(fnames.size());
+    for (size_t i = 0; i < fnames.size(); i++) {
+        const size_t slash = fnames[i].rfind('/');
+        names[i] = slash == string::npos ? fnames[i] : fnames[i].substr(slash+1);
+    }
+    batch.group("/"+card);
+    batch.add([card,nfiles,names](H5File &file) {
+        for (size_t i = 0; i < names.size(); i++) {
+            const string path = "/" + card + "/" + to_string(nfiles[i]), target = "/" + card;
+            if (H5Lcreate_external(names[i].c_str(),target.c_str(),file.getId(),path.c_str(),H5P_DEFAULT,H5P_DEFAULT) < 0) {
+                throw runtime_error("Could not link " + path + " to " + names[i]);
+            }
+        }
+    });
+}
 
-    if (argc != 2) {
-        cout << "./v1730_dpppsd config.json" << endl;
-        return -1;
+//decodes into per-card files as decode_thread does, but each card writes
+//its own numbered files when the run type's cardWriteout says, so a quiet
+//card never holds back the others. Events are aligned across cards by the
+//event builder's trigger patterns rather than by file boundaries. Master
+//files roll on writeout as before, with the run metadata, the event index,
+//and links to the card files finished since the last master.
+void *cards_thread(void *_data) {
+    signal(SIGINT,int_handler);
+    decode_thread_data* data = (decode_thread_data*)_data;
+    
+    const size_t ncards = data->decoders->size(), master = ncards;
+    vector<write_queue> queues(ncards+1);
+    vector<pthread_t> writers(ncards+1);
+    pthread_mutex_t hdf5;
+    pthread_mutex_init(&hdf5,NULL);
+    for (size_t j = 0; j <= ncards; j++) {
+        start_writer(queues[j],data->write_queue_size,data->direct_hdf5 ? data->direct_depth : 0,writers[j],&hdf5);
     }
+    
+    vector<size_t> evtsReady(ncards), counts(ncards);
+    //each card's open file: whether there is one, its number, events in it,
+    //and when the last one finished
+    vector<bool> card_open(ncards);
+    vector<size_t> card_file(ncards), inFile(ncards);
+    vector<struct timespec> card_start(ncards);
+    //since the last master file: events of each card, and its files finished
+    vector<size_t> inMaster(ncards);
+    vector<vector<size_t>> finished(ncards);
+    vector<size_t> nfinished(ncards); //files handed to each card's writer
+    vector<write_job> ready; //handed to the writers once iomutex is released
+    vector<size_t> ready_to; //writer of each ready job
+    double stalled = 0.0; //time spent waiting on a full queue since last report
+    size_t file_bytes = 0;
+    struct timespec file_start;
+    data->runtype->begin();
+    clock_gettime(CLOCK_MONOTONIC,&file_start);
+    for (size_t i = 0; i < ncards; i++) card_start[i] = file_start;
+    try {
+        decode_running = true;
+        while (decode_running) {
+            pthread_mutex_lock(data->iomutex);
+            for (;;) {
+                bool found = stop;
+                for (size_t i = 0; i < ncards; i++) {
+                    found |= (*data->buffers)[i]->fill() > 0;
+                }
+                if (found) break;
+                pthread_cond_wait(data->newdata,data->iomutex);
+            }
+            
+            size_t total = 0, pending = 0;
+            for (size_t i = 0; i < ncards; i++) {
+                size_t sz = (*data->buffers)[i]->fill();
+                if (sz > 0) (*data->decoders)[i]->decode(*(*data->buffers)[i]);
+                evtsReady[i] = (*data->decoders)[i]->eventsReady();
+                counts[i] = inMaster[i] + evtsReady[i];
+                total += evtsReady[i];
+                pending += counts[i] + card_open[i];
+                file_bytes += sz;
+            }
+            publish_events(data);
+            const bool full = data->runtype->fileFull(file_bytes,seconds_since(file_start));
+            
+            if (stop && pending == 0) {
+                decode_running = false;
+            } else {
+                //the master file is named before the run type moves on
+                const bool roll = data->runtype->writeout(counts) || full || stop;
+                write_job mjob;
+                if (roll) {
+                    mjob.batch = new OutputBatch;
+                    mjob.finish = true;
+                    mjob.events = 0;
+                    mjob.fname = data->runtype->fname() + ".h5";
+                    output_metadata(*mjob.batch,data->config);
+                    data->runtype->write(*mjob.batch);
+                    decode_running = data->runtype->keepgoing();
+                }
+                const bool ending = stop || !decode_running;
+                
+                for (size_t i = 0; i < ncards; i++) {
+                    const bool cardroll = (ending || data->runtype->cardWriteout(i,inFile[i]+evtsReady[i])) && (card_open[i] || evtsReady[i]);
+                    const bool flush = data->chunk && evtsReady[i] >= data->chunk;
+                    if (!cardroll && !flush) continue;
+                    
+                    write_job job;
+                    job.batch = new OutputBatch;
+                    job.finish = cardroll;
+                    job.events = evtsReady[i];
+                    if (!card_open[i]) {
+                        job.fname = data->runtype->cardFname(data->cards[i],card_file[i]) + ".h5";
+                        output_metadata(*job.batch,data->config);
+                        card_open[i] = true;
+                    }
+                    
+                    if (data->builder && (i == data->builder_master || i == data->builder_fast)) {
+                        vector<uint16_t> patterns;
+                        (*data->decoders)[i]->getPatterns(evtsReady[i],patterns);
+                        if (i == data->builder_master) {
+                            data->builder->buildMaster(card_file[i],patterns,inFile[i]);
+                        } else {
+                            data->builder->buildFast(card_file[i],patterns,inFile[i]);
+                        }
+                    }
+                    
+                    (*data->decoders)[i]->writeOut(*job.batch,evtsReady[i]);
+                    inFile[i] += evtsReady[i];
+                    inMaster[i] += evtsReady[i];
+                    
+                    if (cardroll) {
+                        snapshot_histograms(data,i,*job.batch);
+                        job.summary.cards.assign(1,data->cards[i]);
+                        job.summary.events.assign(1,inFile[i]);
+                        job.summary.seconds = seconds_since(card_start[i]);
+                        clock_gettime(CLOCK_MONOTONIC,&card_start[i]);
+                        finished[i].push_back(card_file[i]);
+                        nfinished[i]++;
+                        card_file[i]++;
+                        card_open[i] = false;
+                        inFile[i] = 0;
+                    }
+                    ready.push_back(job);
+                    ready_to.push_back(i);
+                }
+                
+                if (roll) {
+                    mjob.summary.cards = data->cards;
+                    mjob.summary.events.assign(inMaster.begin(),inMaster.end());
+                    mjob.summary.seconds = seconds_since(file_start);
+                    for (size_t i = 0; i < ncards; i++) {
+                        vector<string> fnames;
+                        for (size_t f = 0; f < finished[i].size(); f++) {
+                            fnames.push_back(data->runtype->cardFname(data->cards[i],finished[i][f]) + ".h5");
+                        }
+                        if (fnames.size()) output_card_links(*mjob.batch,data->cards[i],finished[i],fnames);
+                        mjob.after.push_back(make_pair(&queues[i],nfinished[i]));
+                        finished[i].clear();
+                        inMaster[i] = 0;
+                    }
+                    if (data->builder) {
+                        if (ending) data->builder->flush();
+                        data->builder->writeOut(*mjob.batch);
+                    }
+                    file_bytes = 0;
+                    clock_gettime(CLOCK_MONOTONIC,&file_start);
+                    ready.push_back(mjob);
+                    ready_to.push_back(master);
+                }
+            }
+            pthread_mutex_unlock(data->iomutex);
+            
+            //readout continues while this waits for room in the queues
+            for (size_t i = 0; i < ready.size(); i++) {
+                write_queue &queue = queues[ready_to[i]];
+                stalled += queue_push(&queue,ready[i]);
+                if (ready_to[i] == master) continue;
+                pthread_mutex_lock(&queue.mutex);
+                const size_t depth = queue.jobs.size(), bytes = queue.bytes;
+                pthread_mutex_unlock(&queue.mutex);
+                cout << "Queued " << ready[i].events << " " << data->cards[ready_to[i]] << " events for writing, " << depth << " / " << queue.capacity << " batches (" << bytes/1048576.0 << " MiB) waiting" << endl;
+                if (stalled > 0.1) {
+                    cout << "****Writer is behind, decoding waited " << stalled << " s for the queue" << endl;
+                    stalled = 0.0;
+                }
+            }
+            ready.clear();
+            ready_to.clear();
+        }
+        stop = true;
+    } catch (runtime_error &e) {
+        pthread_mutex_unlock(data->iomutex);
+        stop = true;
+        pthread_mutex_lock(data->iomutex);
+        cout << "Decode thread aborted: " << e.what() << endl;
+        pthread_mutex_unlock(data->iomutex);
+        for (size_t i = 0; i < ready.size(); i++) delete ready[i].batch;
+    }
+    
+    //the master writer may be waiting on the others, so it goes first
+    for (size_t j = ncards+1; j-- > 0; ) {
+        finish_writer(queues[j],writers[j]);
+    }
+    pthread_mutex_destroy(&hdf5);
+    
+    pthread_exit(NULL);
+}
+
+//appends readout buffers verbatim to <fname>.<card>.raw with an index of
+//every event in <fname>.<card>.idx, leaving decoding for later
+void *raw_thread(void *_data) {
+    signal(SIGINT,int_handler);
+    decode_thread_data* data = (decode_thread_data*)_data;
+    
+    //run metadata still goes to <fname>.h5 beside the raw files
+    write_queue queue;
+    pthread_t writer;
+    start_writer(queue,data->write_queue_size,data->direct_hdf5 ? data->direct_depth : 0,writer);
+    
+    const size_t ncards = data->buffers->size();
+    vector<RawFile*> files;
+    vector<size_t> counts(ncards), entries(ncards);
+    vector<raw_index_entry> index;
+    string fname;
+    struct timespec file_start;
+    data->runtype->begin();
+    try {
+        decode_running = true;
+        while (decode_running) {
+            pthread_mutex_lock(data->iomutex);
+            for (;;) {
+                bool found = stop;
+                for (size_t i = 0; i < ncards; i++) {
+                    found |= (*data->buffers)[i]->fill() > 0;
+                }
+                if (found) break;
+                pthread_cond_wait(data->newdata,data->iomutex);
+            }
+            pthread_mutex_unlock(data->iomutex);
+            
+            //readout only appends, so the filled region is stable until dec
+            bool empty = true;
+            for (size_t i = 0; i < ncards; i++) {
+                Buffer *buf = (*data->buffers)[i];
+                const size_t size = buf->fill();
+                if (!size) continue;
+                empty = false;
+                if (files.empty()) {
+                    fname = data->runtype->fname();
+                    cout << "Saving raw readout to " << fname << ".*.raw" << endl;
+                    for (size_t j = 0; j < ncards; j++) {
+                        files.push_back(new RawFile(fname + "." + data->cards[j],data->direct_depth));
+                        counts[j] = entries[j] = 0;
+                    }
+                    clock_gettime(CLOCK_MONOTONIC,&file_start);
+                }
+                index.clear();
+                counts[i] += (*data->decoders)[i]->index(buf->rptr(),size,index);
+                files[i]->append(buf->rptr(),size,index);
+                entries[i] += index.size();
+                buf->dec(size);
+            }
+            
+            if (files.empty()) {
+                if (stop) decode_running = false;
+                continue;
+            }
+            
+            //files roll at readout boundaries, so may hold a few extra events
+            vector<size_t> ready(counts);
+            size_t bytes = 0;
+            for (size_t i = 0; i < ncards; i++) bytes += files[i]->bytes();
+            const double file_time = seconds_since(file_start);
+            const bool full = data->runtype->fileFull(bytes,file_time);
+            if ((stop && empty) || data->runtype->writeout(ready) || full) {
+                write_job job;
+                job.batch = new OutputBatch;
+                job.finish = true;
+                job.fname = fname + ".h5";
+                job.events = 0;
+                job.summary.cards = data->cards;
+                job.summary.events.assign(counts.begin(),counts.end());
+                job.summary.seconds = file_time;
+                output_metadata(*job.batch,data->config);
+                data->runtype->write(*job.batch);
+                
+                for (size_t i = 0; i < ncards; i++) {
+                    const uint64_t size = files[i]->bytes(), nentries = entries[i];
+                    job.batch->attribute("/"+data->cards[i],"raw_bytes",PredType::NATIVE_UINT64,&size);
+                    job.batch->attribute("/"+data->cards[i],"raw_entries",PredType::NATIVE_UINT64,&nentries);
+                    job.events += counts[i];
+                    file_summary card;
+                    card.cards.push_back(data->cards[i]);
+                    card.events.push_back(counts[i]);
+                    card.seconds = file_time;
+                    files[i]->finish(card);
+                    delete files[i];
+                }
+                files.clear();
+                
+                cout << "Recorded " << bytes/1048576.0 << " MiB of readout in " << file_time << " s (" << bytes/1048576.0/file_time << " MiB/s)" << endl;
+                
+                decode_running = !stop && data->runtype->keepgoing();
+                queue_push(&queue,job);
+            }
+        }
+        stop = true;
+    } catch (runtime_error &e) {
+        stop = true;
+        pthread_mutex_lock(data->iomutex);
+        cout << "Raw recording aborted: " << e.what() << endl;
+        pthread_mutex_unlock(data->iomutex);
+        for (size_t i = 0; i < files.size(); i++) delete files[i];
+    }
+    
+    finish_writer(queue,writer);
+    
+    pthread_exit(NULL);
+}
+
+//hardware kept open between runs when under run control, keyed by model and
+//base address, with the configuration each was last set up from
+typedef struct {
+    VMEBridge *bridge;
+    int linknum;
+    map<string,V1742calib*> calibs;
+    map<string,V65XX*> hvs;
+    map<string,Digitizer*> digitizers;
+    map<string,DigitizerSettings*> settings;
+    map<string,string> signatures;
+} resident;
+
+//frees what runs borrowed from the resident state, which owns the DRS4 
+//tables and settings; the boards are left as they were last programmed
+static void release_resident(resident &res) {
+    for (map<string,V1742calib*>::iterator it = res.calibs.begin(); it != res.calibs.end(); it++) delete it->second;
+    for (map<string,DigitizerSettings*>::iterator it = res.settings.begin(); it != res.settings.end(); it++) delete it->second;
+    res.calibs.clear();
+    res.settings.clear();
+    res.signatures.clear();
+}
+
+//commands handed from the control socket to main, one at a time
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    string command, arg;
+    string reply;
+    bool replied;
+    bool running;
+    string config;
+    struct timespec run_start;
+    int listener;
+} control_state;
+
+//every table configuring a card, so that any change reprograms it
+static string card_signature(RunDB &db, const string &index) {
+    vector<RunTable> tables = db.getIndexed(index);
+    string signature;
+    for (size_t i = 0; i < tables.size(); i++) signature += tables[i].toJSON();
+    return signature;
+}
+
+//answers the command main is working on, if it has not been answered yet
+static void control_reply(control_state *ctl, const string &reply) {
+    pthread_mutex_lock(&ctl->mutex);
+    if (!ctl->replied) {
+        ctl->reply = reply;
+        ctl->replied = true;
+        if (reply == "ok" && ctl->command == "start") {
+            ctl->running = true;
+            clock_gettime(CLOCK_MONOTONIC,&ctl->run_start);
+        }
+        pthread_cond_broadcast(&ctl->cond);
+    }
+    pthread_mutex_unlock(&ctl->mutex);
+}
+
+//the member of name[index] a scan sets, following a.b into nested objects
+static json::Value& scan_member(RunDB &db, const scan_param &param) {
+    RunTable tbl = db.getTable(param.table,param.index);
+    size_t dot = param.key.find('.');
+    json::Value *member = &tbl[param.key.substr(0,dot)];
+    while (dot != string::npos) {
+        const size_t next = param.key.find('.',dot+1);
+        const string name = param.key.substr(dot+1,next == string::npos ? string::npos : next-dot-1);
+        if (member->getType() != json::TOBJECT || !member->isMember(name)) {
+            throw runtime_error("Table " + param.table + "[" + param.index + "] missing field " + param.key);
+        }
+        member = &(*member)[name];
+        dot = next;
+    }
+    return *member;
+}
+
+//starts the cards with arm_last (which generates triggers) going last
+static void arm_cards(vector<Digitizer*> &digitizers, vector<DigitizerSettings*> &settings, size_t arm_last, RunTable &run) {
+    for (size_t i = 0; i < digitizers.size(); i++) {
+        if (i == arm_last) continue;
+        digitizers[i]->startAcquisition();
+        if (run.isMember("soft_trig") && settings[i]->getIndex() == run["soft_trig"].cast<string>()) {
+            cout << "Software triggering " << settings[i]->getIndex() << endl;
+            digitizers[i]->softTrig();
+        }
+    }
+    if (digitizers.size() > 0) {
+        digitizers[arm_last]->startAcquisition();
+        if (run.isMember("soft_trig") && settings[arm_last]->getIndex() == run["soft_trig"].cast<string>()) {
+            cout << "Software triggering " << settings[arm_last]->getIndex() << endl;
+            digitizers[arm_last]->softTrig();
+        }
+    }
+}
+
+//stops the cards with arm_last going first, so the others see no triggers
+static void disarm_cards(vector<Digitizer*> &digitizers, size_t arm_last) {
+    if (digitizers.size() > 0) digitizers[arm_last]->stopAcquisition();
+    for (size_t i = 0; i < digitizers.size(); i++) {
+        if (i == arm_last) continue;
+        digitizers[i]->stopAcquisition();
+    }
+}
+
+//false if the HV reports issues before it finishes ramping
+static bool wait_hv(vector<V65XX*> &hvs) {
+    cout << "Waiting for HV to stabilize..." << endl;
+    
+    while (!stop) {
+        bool busy = false;
+        bool warning = false;
+        for (size_t i = 0; i < hvs.size(); i++) {
+             busy |= hvs[i]->isBusy();
+             warning  |= hvs[i]->isWarning();
+        }
+        if (!busy) break;
+        if (warning) {
+            cout << "HV reports issues, aborting run..." << endl;
+            return false;
+        }
+        usleep(1000000);
+    }
+    return true;
+}
+
+//sets up the hardware for a configuration, reusing what res holds where its 
+//tables are unchanged, and unless program_only takes a run with it
+static int run(const string &config_file, bool refresh_calib, resident &res, control_state *ctl, bool program_only) {
 
     stop = false;
     readout_running = decode_running = false;
@@ -318,15 +1423,43 @@ int main(int argc, char **argv) {
     cout << "Reading configuration..." << endl;
     
     RunDB db;
-    db.addFile(argv[1]);
+    db.addFile(config_file);
     RunTable run = db.getTable("RUN");
     
     const string runtypestr = run["runtype"].cast<string>();
     RunType *runtype = NULL;
+    ScanRun *scan = NULL;
+    //everything a run allocates, so that every exit releases it the same
+    //way; the cards and their settings stay resident for the next run
+    vector<V1742Settings*> v1742settings; //NULL once resident or deleted
+    vector<LeCroy6Zi*> lescopes;
+    vector<Buffer*> buffers;
+    vector<Decoder*> decoders;
+    EventBuilder *builder = NULL;
+    LiveFeed *feed = NULL;
+    Histograms *hists = NULL;
+    auto release = [&](int result) {
+        for (size_t i = 0; i < v1742settings.size(); i++) delete v1742settings[i];
+        for (size_t i = 0; i < lescopes.size(); i++) delete lescopes[i];
+        for (size_t i = 0; i < decoders.size(); i++) delete decoders[i];
+        for (size_t i = 0; i < buffers.size(); i++) delete buffers[i];
+        if (builder) delete builder;
+        if (feed) delete feed;
+        if (hists) delete hists;
+        if (runtype) delete runtype;
+        return result;
+    };
+    vector<scan_param> params;
     size_t eventBufferSize = 0;
     if (run.isMember("event_buffer_size")) {
         eventBufferSize = run["event_buffer_size"].cast<int>();
     } 
+    //append to files in chunks instead of buffering whole files in memory
+    size_t chunkEvents = 0;
+    if (run.isMember("chunk_events")) {
+        chunkEvents = run["chunk_events"].cast<int>();
+        if (chunkEvents && !eventBufferSize) eventBufferSize = 4*chunkEvents;
+    }
     if (runtypestr == "nevents") {
 	    cout << "Setting up an event limited run..." << endl;
         const string outfile = run["outfile"].cast<string>();
@@ -345,22 +1478,97 @@ int main(int argc, char **argv) {
         int evtsPerFile;
         if (run.isMember("events_per_file")) {
             evtsPerFile = run["events_per_file"].cast<int>();
-            if (evtsPerFile == 0) {
-                cout << "Cannot do a timed run all in one file - events_per_file must be nonzero" << endl;
-                return -1;
+            if (evtsPerFile == 0 && !chunkEvents) {
+                cout << "Cannot do a timed run all in one file - events_per_file must be nonzero (or set chunk_events)" << endl;
+                return release(-1);
             }
         } else {
             evtsPerFile = 1000; //we need a well defined buffer amount
         }
-        runtype = new TimedRun(outfile,run["runtime"].cast<int>(),evtsPerFile);
+        TimedRun *timed = new TimedRun(outfile,run["runtime"].cast<int>(),evtsPerFile);
+        runtype = timed;
+        if (run.isMember("file_target_mb") || run.isMember("file_target_seconds")) {
+            //events_per_file, and so the buffers, bound the adaptive sizes
+            const double target_mb = run.isMember("file_target_mb") ? run["file_target_mb"].cast<double>() : 0.0;
+            const double target_seconds = run.isMember("file_target_seconds") ? run["file_target_seconds"].cast<double>() : 0.0;
+            if (evtsPerFile == 0) {
+                cout << "Adaptive file sizes need events_per_file as their upper bound" << endl;
+                return release(-1);
+            }
+            cout << "Sizing files for " << target_mb << " MiB or " << target_seconds << " s (0 for no target), at most " << evtsPerFile << " events" << endl;
+            timed->adapt(target_mb,target_seconds);
+        }
         if (!eventBufferSize) eventBufferSize = (size_t)(evtsPerFile*1.5);
+    } else if (runtypestr == "scan") {
+        cout << "Setting up a parameter scan..." << endl;
+        const string outfile = run["outfile"].cast<string>();
+        const int nEvents = run["events"].cast<int>();
+        const double seconds = run.isMember("runtime") ? run["runtime"].cast<double>() : 0.0;
+        if (nEvents == 0 && (seconds <= 0.0 || !chunkEvents)) {
+            cout << "Scan points need events, or a runtime with chunk_events set" << endl;
+            return release(-1);
+        }
+        //raw recording indexes buffers outside the readout lock, so it
+        //cannot share them with the cards being set up between points
+        if (run.isMember("event_builder") || (run.isMember("independent_cards") && run["independent_cards"].cast<bool>()) || (run.isMember("raw") && run["raw"].cast<bool>())) {
+            cout << "Scans write all cards together for each point, without event_builder, independent_cards, or raw" << endl;
+            return release(-1);
+        }
+        json::Value &points = run["scan"];
+        params.resize(points.getArraySize());
+        for (size_t i = 0; i < params.size(); i++) {
+            json::Value &param = points[i];
+            params[i].table = param["table"].cast<string>();
+            params[i].index = param.isMember("index") ? param["index"].cast<string>() : "";
+            params[i].key = param["key"].cast<string>();
+            json::Value &values = param["values"];
+            for (size_t j = 0; j < values.getArraySize(); j++) params[i].values.push_back(values[j]);
+            if (params[i].values.size() != params[0].values.size() || params[i].values.empty()) {
+                cout << "Every scan setting needs the same number of values" << endl;
+                return release(-1);
+            }
+            if (params[i].table != "V65XX" && !db.tableExists("V1730",params[i].index) && !db.tableExists("V1742",params[i].index)) {
+                cout << "Scan settings must be for a digitizer or V65XX: " << params[i].table << "[" << params[i].index << "]" << endl;
+                return release(-1);
+            }
+            if (params[i].key == "sample_freq") {
+                cout << "V1742 calibrations are loaded for one sample_freq, which cannot be scanned" << endl;
+                return release(-1);
+            }
+            //the first point is programmed as if it were in the file
+            scan_member(db,params[i]) = params[i].values[0];
+        }
+        if (params.empty()) {
+            cout << "A scan needs at least one setting to scan" << endl;
+            return release(-1);
+        }
+        cout << "Scanning " << params.size() << " settings over " << params[0].values.size() << " points of ";
+        if (nEvents) cout << nEvents << " events" << endl;
+        else cout << seconds << " s" << endl;
+        runtype = scan = new ScanRun(outfile,nEvents,seconds,params);
+        if (!eventBufferSize) eventBufferSize = (size_t)(nEvents*1.5);
     } 
     
-    cout << "Using " << eventBufferSize << " event buffers." << endl;
+    //files also roll on readout size or age, whichever comes first
+    if (runtype && (run.isMember("file_max_mb") || run.isMember("file_max_seconds"))) {
+        const double max_mb = run.isMember("file_max_mb") ? run["file_max_mb"].cast<double>() : 0.0;
+        const double max_seconds = run.isMember("file_max_seconds") ? run["file_max_seconds"].cast<double>() : 0.0;
+        cout << "Rolling files at " << max_mb << " MiB or " << max_seconds << " s (0 for no limit)" << endl;
+        runtype->setFileLimits((size_t)(max_mb*1048576.0),max_seconds);
+    }
+    
+    //raw recording only indexes readout, so decoders hold no events
+    const bool raw = run.isMember("raw") && run["raw"].cast<bool>();
+    if (raw) {
+        cout << "Recording raw readout without decoding..." << endl;
+        eventBufferSize = 0;
+    } else {
+        cout << "Using " << eventBufferSize << " event buffers." << endl;
+    }
 
     if (!runtype){
         cout << "Unknown runtype: " << runtypestr << endl;
-        return -1;
+        return release(-1);
     }
     
     //Every run has these options
@@ -376,31 +1584,59 @@ int main(int argc, char **argv) {
     //This has to be done before using the CANEVME library due to bugs in the
     //CAENDigitizer library... so hack it in here.
     vector<RunTable> v1742s = db.getGroup("V1742");
-    vector<V1742Settings*> v1742settings;
     vector<V1742calib*> v1742calibs;
+    //DRS4 tables are cached by serial only if calib_cache names a directory
+    const string calib_cache = run.isMember("calib_cache") ? run["calib_cache"].cast<string>() : "";
+    const double calib_max_age = run.isMember("calib_max_age") ? run["calib_max_age"].cast<double>() : 30.0;
     for (size_t i = 0; i < v1742s.size(); i++) {
         RunTable &tbl = v1742s[i];
         cout << "* V1742 - " << tbl.getIndex() << endl;
         V1742Settings *stngs = new V1742Settings(tbl,db);
         v1742settings.push_back(stngs);
-        v1742calibs.push_back(V1742::staticGetCalib(stngs->sampleFreq(),run["link_num"].cast<int>(),tbl["base_address"].cast<int>()));
+        //tables stay resident, so only a new card or frequency fetches them
+        const string key = to_string(tbl["base_address"].cast<int>()) + "@" + to_string(stngs->sampleFreq());
+        if (res.calibs.count(key)) {
+            v1742calibs.push_back(res.calibs[key]);
+        } else if (calib_cache.empty()) {
+            v1742calibs.push_back(V1742::staticGetCalib(stngs->sampleFreq(),run["link_num"].cast<int>(),tbl["base_address"].cast<int>()));
+        } else {
+            const uint32_t serial = tbl.isMember("serial") ? tbl["serial"].cast<int>() : 0;
+            v1742calibs.push_back(V1742::cachedGetCalib(stngs->sampleFreq(),run["link_num"].cast<int>(),tbl["base_address"].cast<int>(),calib_cache,calib_max_age,refresh_calib,serial));
+        }
+        res.calibs[key] = v1742calibs.back();
+        if (tbl.isMember("calib_threads")) v1742calibs.back()->setThreads(tbl["calib_threads"].cast<int>());
     }
 
-    cout << "Opening VME link..." << endl;
-    
-    VMEBridge bridge(linknum,0);
+    if (!res.bridge) {
+        cout << "Opening VME link..." << endl;
+        res.bridge = new VMEBridge(linknum,0);
+        res.linknum = linknum;
+    } else if (res.linknum != linknum) {
+        cout << "The VME link stays open between runs, link_num cannot change" << endl;
+        return release(-1);
+    }
+    VMEBridge &bridge = *res.bridge;
     
     vector<V65XX*> hvs;
+    map<string,string> hv_keys; //resident key of each module by index
     vector<RunTable> v65XXs = db.getGroup("V65XX");
     if (v65XXs.size() > 0) cout << "Setting up V65XX HV..." << endl;
     for (size_t i = 0; i < v65XXs.size(); i++) {
         RunTable &tbl = v65XXs[i];
         cout << "\t" << tbl["index"].cast<string>() << endl;
-        hvs.push_back(new V65XX(bridge,tbl["base_address"].cast<int>()));
-        hvs.back()->set(tbl);
+        const string key = "V65XX@" + to_string(tbl["base_address"].cast<int>());
+        if (!res.hvs.count(key)) res.hvs[key] = new V65XX(bridge,tbl["base_address"].cast<int>());
+        hvs.push_back(res.hvs[key]);
+        hv_keys[tbl.getIndex()] = key;
+        const string signature = tbl.toJSON();
+        if (res.signatures[key] != signature) {
+            hvs.back()->set(tbl);
+            res.signatures[key] = signature;
+        } else {
+            cout << "\t\tunchanged" << endl;
+        }
     }
     
-    vector<LeCroy6Zi*> lescopes;
     vector<RunTable> lecroy6zis = db.getGroup("LECROY6ZI");
     if (lecroy6zis.size() > 0) cout << "Setting up LeCroy6Zi..." << endl;
     for (size_t i = 0; i < lecroy6zis.size(); i++) {
@@ -417,36 +1653,74 @@ int main(int argc, char **argv) {
     
     vector<DigitizerSettings*> settings;
     vector<Digitizer*> digitizers;
-    vector<Buffer*> buffers;
-    vector<Decoder*> decoders;
+    vector<string> card_keys; //resident key of each card
+    vector<V1742calib*> card_calibs; //DRS4 tables of V1742s, NULL for others
     
+    //cards whose tables are unchanged keep the settings they were programmed
+    //with, which hold what the boards rounded or read back
     vector<RunTable> v1730s = db.getGroup("V1730");
     for (size_t i = 0; i < v1730s.size(); i++) {
         RunTable &tbl = v1730s[i];
         cout << "* V1730 - " << tbl.getIndex() << endl;
-        V1730Settings *stngs = new V1730Settings(tbl,db);
-        settings.push_back(stngs);
-        digitizers.push_back(new V1730(bridge,tbl["base_address"].cast<int>()));
-        ((V1730*)digitizers.back())->stopAcquisition();
-        ((V1730*)digitizers.back())->calib();
+        const string key = "V1730@" + to_string(tbl["base_address"].cast<int>());
+        const string signature = card_signature(db,tbl.getIndex());
+        if (!res.digitizers.count(key)) res.digitizers[key] = new V1730(bridge,tbl["base_address"].cast<int>());
+        digitizers.push_back(res.digitizers[key]);
+        card_keys.push_back(key);
+        card_calibs.push_back(NULL);
         buffers.push_back(new Buffer(tbl["buffer_size"].cast<int>()*1024*1024));
-        if (!digitizers.back()->program(*stngs)) return -1;
+        if (res.signatures[key] != signature) {
+            V1730Settings *stngs = new V1730Settings(tbl,db);
+            ((V1730*)digitizers.back())->stopAcquisition();
+            ((V1730*)digitizers.back())->calib();
+            res.signatures.erase(key);
+            if (!digitizers.back()->program(*stngs)) {
+                delete stngs;
+                return release(-1);
+            }
+            if (res.settings.count(key)) delete res.settings[key];
+            res.settings[key] = stngs;
+            res.signatures[key] = signature;
+        } else {
+            cout << "\tunchanged" << endl;
+        }
+        settings.push_back(res.settings[key]);
         // decoders need settings after programming
-        decoders.push_back(new V1730Decoder(eventBufferSize,*stngs));
+        decoders.push_back(new V1730Decoder(eventBufferSize,*(V1730Settings*)settings.back()));
     }
     
     for (size_t i = 0; i < v1742s.size(); i++) {
         RunTable &tbl = v1742s[i];
         cout << "* V1742 - " << tbl.getIndex() << endl;
-        V1742Settings *stngs = v1742settings[i];
-        settings.push_back(stngs);
-        V1742 *card = new V1742(bridge,tbl["base_address"].cast<int>());
-        card->stopAcquisition();
-        digitizers.push_back(card);
+        const string key = "V1742@" + to_string(tbl["base_address"].cast<int>());
+        const string signature = card_signature(db,tbl.getIndex());
+        if (!res.digitizers.count(key)) res.digitizers[key] = new V1742(bridge,tbl["base_address"].cast<int>());
+        digitizers.push_back(res.digitizers[key]);
+        card_keys.push_back(key);
+        card_calibs.push_back(v1742calibs[i]);
         buffers.push_back(new Buffer(tbl["buffer_size"].cast<int>()*1024*1024));
-        if (!digitizers.back()->program(*stngs)) return -1;
+        if (res.signatures[key] != signature) {
+            V1742Settings *stngs = v1742settings[i];
+            ((V1742*)digitizers.back())->stopAcquisition();
+            res.signatures.erase(key);
+            if (!digitizers.back()->program(*stngs)) return release(-1);
+            if (res.settings.count(key)) delete res.settings[key];
+            res.settings[key] = stngs;
+            res.signatures[key] = signature;
+        } else {
+            cout << "\tunchanged" << endl;
+            delete v1742settings[i];
+        }
+        v1742settings[i] = NULL;
+        settings.push_back(res.settings[key]);
         // decoders need settings after programming
-        decoders.push_back(new V1742Decoder(eventBufferSize,v1742calibs[i],*stngs)); 
+        decoders.push_back(new V1742Decoder(eventBufferSize,v1742calibs[i],*(V1742Settings*)settings.back())); 
+    }
+    
+    if (program_only) return release(0);
+    
+    for (size_t i = 0; i < decoders.size(); i++) {
+        decoders[i]->setChunking(chunkEvents);
     }
     
     size_t arm_last = 0;
@@ -455,23 +1729,53 @@ int main(int argc, char **argv) {
             arm_last = i;
     }
     
-    cout << "Waiting for HV to stabilize..." << endl;
-    
-    while (!stop) {
-        bool busy = false;
-        bool warning = false;
-        for (size_t i = 0; i < hvs.size(); i++) {
-             busy |= hvs[i]->isBusy();
-             warning  |= hvs[i]->isWarning();
+    size_t builder_master = 0, builder_fast = 0;
+    if (run.isMember("event_builder") && !raw) {
+        //correlates the triggers of two cards by their LVDS patterns
+        vector<string> cards = run["event_builder"].toVector<string>();
+        if (cards.size() != 2) {
+            cout << "event_builder expects two card indexes" << endl;
+            return release(-1);
         }
-        if (!busy) break;
-        if (warning) {
-            cout << "HV reports issues, aborting run..." << endl;
-            return -1;
+        builder_master = builder_fast = decoders.size();
+        for (size_t i = 0; i < decoders.size(); i++) {
+            if (settings[i]->getIndex() == cards[0]) builder_master = i;
+            if (settings[i]->getIndex() == cards[1]) builder_fast = i;
         }
-        usleep(1000000);
+        vector<uint16_t> check;
+        if (builder_master == decoders.size() || builder_fast == decoders.size() || !decoders[builder_master]->getPatterns(0,check) || !decoders[builder_fast]->getPatterns(0,check)) {
+            cout << "event_builder cards must exist and buffer events" << endl;
+            return release(-1);
+        }
+        const uint16_t test_mask = run.isMember("event_test_mask") ? run["event_test_mask"].cast<int>() : 0xFF;
+        const uint16_t comp_mask = run.isMember("event_comp_mask") ? run["event_comp_mask"].cast<int>() : 0x0F;
+        const size_t max_offset = run.isMember("event_max_offset") ? run["event_max_offset"].cast<int>() : 8;
+        builder = new EventBuilder(cards[0],cards[1],test_mask,comp_mask,max_offset);
+    }
+    
+    if (!wait_hv(hvs)) return release(-1);
+    
+    //monitors map decoded events from shared memory, never holding up readout
+    if (run.isMember("live_feed") && !raw) {
+        const string name = run["live_feed"].cast<string>();
+        const double feed_mb = run.isMember("live_feed_mb") ? run["live_feed_mb"].cast<double>() : 64.0;
+        cout << "Publishing events to shared memory " << name << endl;
+        feed = new LiveFeed(name,(size_t)(feed_mb*1048576.0));
     }
     
+    //decoders histogram what they decode, merged into shared memory for 
+    //monitors (unless the name is empty) and snapshotted into every file
+    if (run.isMember("histograms") && !raw) {
+        const string name = run["histograms"].cast<string>();
+        const double interval = run.isMember("histogram_interval") ? run["histogram_interval"].cast<double>() : 1.0;
+        vector<HistogramSet*> sets;
+        for (size_t i = 0; i < decoders.size(); i++) {
+            decoders[i]->enableHistograms();
+            if (decoders[i]->getHistograms()) sets.push_back(decoders[i]->getHistograms());
+        }
+        if (!name.empty()) cout << "Publishing histograms to shared memory " << name << endl;
+        hists = new Histograms(name,sets,interval);
+    }
     
     cout << "Starting acquisition..." << endl;
     
@@ -481,26 +1785,13 @@ int main(int argc, char **argv) {
     pthread_cond_init(&newdata, NULL);
     vector<uint32_t> temps;
     
-    for (size_t i = 0; i < digitizers.size(); i++) {
-        if (i == arm_last) continue;
-        digitizers[i]->startAcquisition();
-        if (run.isMember("soft_trig") && settings[i]->getIndex() == run["soft_trig"].cast<string>()) {
-            cout << "Software triggering " << settings[i]->getIndex() << endl;
-            digitizers[i]->softTrig();
-        }
-    }
-    if (digitizers.size() > 0) {
-        digitizers[arm_last]->startAcquisition();
-        if (run.isMember("soft_trig") && settings[arm_last]->getIndex() == run["soft_trig"].cast<string>()) {
-            cout << "Software triggering " << settings[arm_last]->getIndex() << endl;
-            digitizers[arm_last]->softTrig();
-        }
-    }
+    arm_cards(digitizers,settings,arm_last,run);
     for (size_t i = 0; i < lescopes.size(); i++) {
         lescopes[i]->normal();
         delete lescopes[i]; //get rid of these until the acquisition is done
         lescopes[i] = NULL;
     }
+    if (ctl) control_reply(ctl,"ok");
     
     decode_thread_data data;
     data.buffers = &buffers;
@@ -508,14 +1799,41 @@ int main(int argc, char **argv) {
     data.iomutex = &iomutex;
     data.newdata = &newdata;
     data.runtype = runtype;
+    data.builder = builder;
+    data.builder_master = builder_master;
+    data.builder_fast = builder_fast;
+    data.chunk = chunkEvents;
+    data.write_queue_size = run.isMember("write_queue") ? run["write_queue"].cast<int>() : 2;
+    data.raw = raw;
+    data.per_card = run.isMember("per_card_files") && run["per_card_files"].cast<bool>();
+    data.independent = run.isMember("independent_cards") && run["independent_cards"].cast<bool>();
+    if (data.independent) data.per_card = true;
+    if (data.independent && !raw) {
+        cout << "Writing each card to its own files on its own schedule..." << endl;
+    } else if (data.per_card && !raw) {
+        cout << "Writing each card to its own file..." << endl;
+    }
+    //O_DIRECT with io_uring keeps multi-GB runs out of the page cache
+    data.direct_depth = 0;
+    if (run.isMember("direct_io") && run["direct_io"].cast<bool>()) {
+        data.direct_depth = run.isMember("io_depth") ? run["io_depth"].cast<int>() : 4;
+        if (!data.direct_depth) data.direct_depth = 1;
+    }
+    //HDF5 files need a second copy in memory for that, which is opt in
+    data.direct_hdf5 = data.direct_depth && run.isMember("direct_hdf5") && run["direct_hdf5"].cast<bool>();
+    for (size_t i = 0; i < settings.size(); i++) {
+        data.cards.push_back(settings[i]->getIndex());
+    }
+    data.feed = feed;
+    data.hists = hists;
     { //copy entire config as-is to be saved in each file
-        std::ifstream file(argv[1]);
+        std::ifstream file(config_file);
         std::stringstream buf;
         buf << file.rdbuf();
         data.config = buf.str();
     }
     pthread_t decode;
-    pthread_create(&decode,NULL,&decode_thread,&data);
+    pthread_create(&decode,NULL,raw ? &raw_thread : data.independent ? &cards_thread : &decode_thread,&data);
     
     struct timespec last_temp_time, cur_time;
     clock_gettime(CLOCK_MONOTONIC,&last_temp_time);
@@ -525,6 +1843,86 @@ int main(int argc, char **argv) {
     try { 
         readout_running = true;
         while (readout_running && !stop) {
+            //between scan points the cards stop, readout left from the last
+            //point is dropped, and only what the next one changes is written
+            bool pending = false;
+            if (scan) {
+                pthread_mutex_lock(&iomutex);
+                pending = scan->pending();
+                pthread_mutex_unlock(&iomutex);
+            }
+            if (pending) {
+                disarm_cards(digitizers,arm_last);
+                pthread_mutex_lock(&iomutex);
+                const size_t point = scan->point();
+                cout << "Applying scan point " << point+1 << "..." << endl;
+                for (size_t i = 0; i < digitizers.size(); i++) {
+                    for (;;) {
+                        buffers[i]->dec(buffers[i]->fill());
+                        if (!digitizers[i]->readoutReady()) break;
+                        buffers[i]->inc(digitizers[i]->readoutBLT(buffers[i]->wptr(),buffers[i]->free()));
+                    }
+                    const size_t stale = decoders[i]->eventsReady();
+                    if (stale) {
+                        OutputBatch dropped;
+                        decoders[i]->writeOut(dropped,stale);
+                    }
+                }
+                map<string,vector<string>> edited; //table keys changed on each card
+                bool ramping = false;
+                for (size_t p = 0; p < params.size(); p++) {
+                    scan_member(db,params[p]) = params[p].values[point];
+                    const string key = params[p].key.substr(0,params[p].key.find('.'));
+                    if (params[p].table != "V65XX") {
+                        edited[params[p].index].push_back(key);
+                        continue;
+                    }
+                    V65XX *hv = res.hvs[hv_keys[params[p].index]];
+                    res.signatures.erase(hv_keys[params[p].index]);
+                    if (key.size() > 2 && key.compare(0,2,"ch") == 0 && params[p].key == key + ".v_set") {
+                        hv->setVSet(stoi(key.substr(2)),params[p].values[point].cast<double>());
+                    } else {
+                        RunTable tbl = db.getTable("V65XX",params[p].index);
+                        hv->set(tbl);
+                    }
+                    ramping = true;
+                }
+                for (size_t i = 0; i < digitizers.size(); i++) {
+                    if (!edited.count(settings[i]->getIndex())) continue;
+                    const bool v1730 = card_keys[i].compare(0,5,"V1730") == 0;
+                    RunTable tbl = db.getTable(v1730 ? "V1730" : "V1742",settings[i]->getIndex());
+                    DigitizerSettings *next;
+                    if (v1730) next = new V1730Settings(tbl,db);
+                    else next = new V1742Settings(tbl,db);
+                    res.signatures.erase(card_keys[i]);
+                    if (digitizers[i]->retune(*settings[i],*next,edited[settings[i]->getIndex()])) {
+                        delete next;
+                        continue;
+                    }
+                    //anything else may change the readout, so the card is
+                    //set up again with a decoder to match
+                    cout << "Reprogramming " << settings[i]->getIndex() << endl;
+                    if (v1730) ((V1730*)digitizers[i])->calib();
+                    if (!digitizers[i]->program(*next)) throw runtime_error("Could not program " + settings[i]->getIndex() + " for scan point " + to_string(point+1));
+                    if (hists && decoders[i]->getHistograms()) hists->merge(*decoders[i]->getHistograms(),true);
+                    //decoders only borrow the DRS4 tables, which stay resident
+                    delete decoders[i];
+                    if (v1730) decoders[i] = new V1730Decoder(eventBufferSize,*(V1730Settings*)next);
+                    else decoders[i] = new V1742Decoder(eventBufferSize,card_calibs[i],*(V1742Settings*)next);
+                    decoders[i]->setChunking(chunkEvents);
+                    if (hists) decoders[i]->enableHistograms();
+                    delete settings[i];
+                    settings[i] = res.settings[card_keys[i]] = next;
+                }
+                pthread_mutex_unlock(&iomutex);
+                if (ramping && !wait_hv(hvs)) stop = true;
+                if (stop) break;
+                arm_cards(digitizers,settings,arm_last,run);
+                pthread_mutex_lock(&iomutex);
+                scan->resume();
+                pthread_mutex_unlock(&iomutex);
+            }
+            
             //Digitizer loop
             for (size_t i = 0; i < digitizers.size() && !stop; i++) {
                 Digitizer *dgtz = digitizers[i];
@@ -583,18 +1981,200 @@ int main(int argc, char **argv) {
             cout << "Could not stop scope! : " << e.what() << endl;
         }
     }
-    if (digitizers.size() > 0) digitizers[arm_last]->stopAcquisition();
-    for (size_t i = 0; i < digitizers.size(); i++) {
-        if (i == arm_last) continue;
-        digitizers[i]->stopAcquisition();
-    }
+    disarm_cards(digitizers,arm_last);
     pthread_cond_signal(&newdata);
     
-    //busy wait for all data to be written out
-    while (decode_running) { sleep(1); }
+    //wait for all data to be written out
+    pthread_join(decode,NULL);
     
-    // Should add some logic to cleanup memory, but we're done anyway
+    pthread_cond_destroy(&newdata);
+    pthread_mutex_destroy(&iomutex);
     
-    pthread_exit(NULL);
+    return release(0);
+
+}
+
+//status and stop are answered here, the rest wait for main to act on them
+static string control_command(control_state *ctl, const string &line, bool &quit) {
+    const size_t space = line.find(' ');
+    const string command = line.substr(0,space);
+    const string arg = space == string::npos ? "" : line.substr(space+1);
+    string reply;
+    pthread_mutex_lock(&ctl->mutex);
+    if (command == "status") {
+        stringstream out;
+        if (ctl->running) {
+            out << "running " << ctl->config << " " << (int)seconds_since(ctl->run_start);
+        } else {
+            out << "idle " << ctl->config;
+        }
+        reply = out.str();
+    } else if (command == "stop") {
+        if (ctl->running) stop = true;
+        reply = "ok";
+    } else if (command != "start" && command != "apply" && command != "quit") {
+        reply = "error unknown command " + command;
+    } else if (ctl->running || !ctl->command.empty()) {
+        reply = "error busy";
+    } else if (command == "apply" && arg.empty()) {
+        reply = "error apply needs a configuration file";
+    } else if (command == "quit") {
+        quit = true;
+        reply = "ok";
+    } else {
+        ctl->command = command;
+        ctl->arg = arg;
+        ctl->replied = false;
+        pthread_cond_broadcast(&ctl->cond);
+        while (!ctl->replied) pthread_cond_wait(&ctl->cond,&ctl->mutex);
+        reply = ctl->reply;
+    }
+    pthread_mutex_unlock(&ctl->mutex);
+    return reply;
+}
+
+//one connection at a time, one command per line, one line per reply:
+//  status        -> running <config> <seconds> | idle <config>
+//  start         -> ok | error <why>  (once the run is armed)
+//  stop          -> ok                (the run finishes writing in the background)
+//  apply <file>  -> ok | error <why>  (programs what changed, used by the next start)
+//  quit          -> ok | error busy
+void *control_thread(void *_data) {
+    control_state *ctl = (control_state*)_data;
+    bool quit = false;
+    while (!quit) {
+        int conn = accept(ctl->listener,NULL,NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        string line;
+        char c;
+        ssize_t n;
+        while (!quit && ((n = read(conn,&c,1)) == 1 || (n < 0 && errno == EINTR))) {
+            if (n < 0 || c == '\r') continue;
+            if (c != '\n') {
+                line += c;
+                continue;
+            }
+            const string reply = control_command(ctl,line,quit) + "\n";
+            line.clear();
+            if (write(conn,reply.data(),reply.size()) != (ssize_t)reply.size()) break;
+        }
+        close(conn);
+    }
+    pthread_mutex_lock(&ctl->mutex);
+    stop = true;
+    pthread_cond_broadcast(&ctl->cond);
+    pthread_mutex_unlock(&ctl->mutex);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+
+    bool refresh_calib = false;
+    string config, control;
+    for (int i = 1; i < argc; i++) {
+        const string arg(argv[i]);
+        if (arg == "--refresh-calib") {
+            refresh_calib = true;
+        } else if (arg == "--control" && i+1 < argc) {
+            control = argv[++i];
+        } else if (config.empty() && arg[0] != '-') {
+            config = arg;
+        } else {
+            config.clear();
+            break;
+        }
+    }
+    if (config.empty()) {
+        cout << "./WbLSdaq config.json [--refresh-calib] [--control socket]" << endl;
+        return -1;
+    }
+    
+    resident res;
+    res.bridge = NULL;
+    res.linknum = 0;
+    
+    if (control.empty()) {
+        const int result = run(config,refresh_calib,res,NULL,false);
+        release_resident(res);
+        return result;
+    }
+    
+    control_state ctl;
+    pthread_mutex_init(&ctl.mutex,NULL);
+    pthread_cond_init(&ctl.cond,NULL);
+    ctl.replied = true;
+    ctl.running = false;
+    ctl.config = config;
+    
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (control.size() >= sizeof(addr.sun_path)) {
+        cout << "Control socket path too long: " << control << endl;
+        return -1;
+    }
+    strcpy(addr.sun_path,control.c_str());
+    unlink(control.c_str());
+    ctl.listener = socket(AF_UNIX,SOCK_STREAM,0);
+    if (ctl.listener < 0 || bind(ctl.listener,(struct sockaddr*)&addr,sizeof(addr)) < 0 || listen(ctl.listener,4) < 0) {
+        cout << "Could not listen on " << control << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    
+    stop = false;
+    signal(SIGINT,int_handler);
+    signal(SIGPIPE,SIG_IGN);
+    pthread_t thread;
+    pthread_create(&thread,NULL,&control_thread,&ctl);
+    cout << "Waiting for commands on " << control << endl;
+    
+    //hardware is opened with the first start or apply and stays open after
+    for (;;) {
+        pthread_mutex_lock(&ctl.mutex);
+        while (ctl.command.empty() && !stop) {
+            struct timespec wake;
+            clock_gettime(CLOCK_REALTIME,&wake);
+            wake.tv_sec += 1;
+            pthread_cond_timedwait(&ctl.cond,&ctl.mutex,&wake);
+        }
+        const string command = ctl.command, arg = ctl.arg, current = ctl.config;
+        pthread_mutex_unlock(&ctl.mutex);
+        if (command.empty()) break;
+        
+        string reply = "ok";
+        try {
+            if (command == "start") {
+                if (run(current,refresh_calib,res,&ctl,false)) reply = "error run did not start";
+            } else if (run(arg,refresh_calib,res,&ctl,true)) {
+                reply = "error could not apply " + arg;
+            } else {
+                pthread_mutex_lock(&ctl.mutex);
+                ctl.config = arg;
+                pthread_mutex_unlock(&ctl.mutex);
+            }
+        } catch (exception &e) {
+            reply = string("error ") + e.what();
+        }
+        cout << command << " " << arg << ": " << reply << endl;
+        
+        //a run ends with stop set, which would otherwise end this loop too
+        pthread_mutex_lock(&ctl.mutex);
+        stop = false;
+        ctl.running = false;
+        ctl.command.clear();
+        pthread_mutex_unlock(&ctl.mutex);
+        control_reply(&ctl,reply);
+    }
+    
+    cout << "Leaving run control" << endl;
+    shutdown(ctl.listener,SHUT_RDWR);
+    close(ctl.listener);
+    unlink(control.c_str());
+    release_resident(res);
+    
+    return 0;
 
 }
@@ -0,0 +1,406 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <ctime>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "RunDB.hh"
+#include "Buffer.hh"
+#include "Generator.hh"
+#include "CalibFile.hh"
+#include "DirectFile.hh"
+#include "V1730_dpppsd.hh"
+#include "V1742.hh"
+
+using namespace std;
+using namespace H5;
+
+typedef struct {
+    size_t triggers; // triggers to generate per card
+    size_t batch; // triggers per readout
+    size_t writeEvery; // events per writeOut
+    string calibfname; // optional V1742 calibration file
+    string capture; // optional WbLSdaq file to recompress instead
+    string iopath; // optional file to benchmark output backends with instead
+    size_t iosize; // MiB written per backend
+    size_t iodepth; // DirectFile writes in flight
+} bench_config;
+
+// Logical and on disk bytes of datasets
+typedef struct {
+    size_t logical, stored;
+} storage_sizes;
+
+static herr_t storage_visit(hid_t loc, const char *name, const H5O_info_t *info, void *data) {
+    if (info->type != H5O_TYPE_DATASET) return 0;
+    storage_sizes *sizes = (storage_sizes*)data;
+    hid_t dataset = H5Dopen(loc,name,H5P_DEFAULT);
+    hid_t space = H5Dget_space(dataset), type = H5Dget_type(dataset);
+    sizes->logical += H5Sget_simple_extent_npoints(space)*H5Tget_size(type);
+    sizes->stored += H5Dget_storage_size(dataset);
+    H5Tclose(type);
+    H5Sclose(space);
+    H5Dclose(dataset);
+    return 0;
+}
+
+// Waveform datasets are the ones filtered by a card's output_filters
+static bool is_waveform(const string &name) {
+    const string samples = "samples", values = "zs_values";
+    return (name.size() >= samples.size() && name.compare(name.size()-samples.size(),samples.size(),samples) == 0) ||
+           (name.size() >= values.size() && name.compare(name.size()-values.size(),values.size(),values) == 0);
+}
+
+static herr_t waveform_visit(hid_t loc, const char *name, const H5O_info_t *info, void *data) {
+    if (info->type == H5O_TYPE_DATASET && is_waveform(name)) ((vector<string>*)data)->push_back(name);
+    return 0;
+}
+
+[[noreturn]] void help() {
+    cout << "decoderbench decodes synthetic readout data for each V1730 and V1742 " << endl;
+    cout << "in a WbLSdaq config and reports decode and writeout throughput." << endl;
+    cout << "./decoderbench [options] config.json" << endl;
+    cout << "./decoderbench -D file [-M MiB] [-q depth]" << endl;
+    cout << "\t-n triggers   triggers to generate per card [100000]" << endl;
+    cout << "\t-b triggers   triggers per readout [100]" << endl;
+    cout << "\t-w events     events per writeout (in memory) [1000]" << endl;
+    cout << "\t-r rate       trigger rate for time tags in Hz [1000]" << endl;
+    cout << "\t-p fraction   fraction of traces with a pulse [0.5]" << endl;
+    cout << "\t-a height     pulse height in ADC counts [500]" << endl;
+    cout << "\t-P fraction   fraction of aggregates with a padding word [0.01]" << endl;
+    cout << "\t-m fraction   fraction of missed triggers [0.001]" << endl;
+    cout << "\t-d fraction   fraction of duplicated triggers [0.001]" << endl;
+    cout << "\t-s seed       random seed [1]" << endl;
+    cout << "\t-c file       V1742 calibration file from v1742calib" << endl;
+    cout << "\t-R file       recompress waveforms of each card in a WbLSdaq file" << endl;
+    cout << "\t              with the config's filters instead of generating data" << endl;
+    cout << "\t-D file       compare buffered and O_DIRECT output backends writing" << endl;
+    cout << "\t              raw and HDF5 data to file instead of generating data" << endl;
+    cout << "\t-M MiB        size written per backend with -D [1024]" << endl;
+    cout << "\t-q depth      O_DIRECT writes in flight with -D [4]" << endl;
+    exit(1);
+}
+
+static inline double elapsed(struct timespec &start) {
+    struct timespec cur;
+    clock_gettime(CLOCK_MONOTONIC,&cur);
+    return (cur.tv_sec - start.tv_sec)+1e-9*(cur.tv_nsec - start.tv_nsec);
+}
+
+// Runs a decoder over generated data, with its chatter sent to /dev/null
+void bench(const string &name, Generator &gen, Decoder &dec, Buffer &buffer, const bench_config &cfg) {
+    ofstream null("/dev/null");
+    streambuf *out = cout.rdbuf();
+    
+    size_t bytes = 0, written = 0, writeouts = 0;
+    storage_sizes sizes = {0, 0};
+    double decode_time = 0.0, write_time = 0.0, max_write = 0.0;
+    for (size_t triggers = 0; triggers < cfg.triggers; ) {
+        buffer.inc(0); //compact the buffer before writing more
+        const size_t n = gen.generate(buffer,min(cfg.batch,cfg.triggers-triggers));
+        if (n == 0) throw runtime_error("Buffer too small for one trigger");
+        triggers += n;
+        bytes += buffer.fill();
+        
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        cout.rdbuf(null.rdbuf());
+        dec.decode(buffer);
+        cout.rdbuf(out);
+        decode_time += elapsed(start);
+        
+        const size_t ready = dec.eventsReady();
+        if (ready >= cfg.writeEvery || triggers == cfg.triggers) {
+            FileAccPropList fapl;
+            fapl.setCore(1<<24,false);
+            H5File file("decoderbench.h5",H5F_ACC_TRUNC,FileCreatPropList::DEFAULT,fapl);
+            clock_gettime(CLOCK_MONOTONIC,&start);
+            cout.rdbuf(null.rdbuf());
+            dec.writeOut(file,ready);
+            cout.rdbuf(out);
+            const double t = elapsed(start);
+            H5Ovisit(file.getId(),H5_INDEX_NAME,H5_ITER_NATIVE,storage_visit,&sizes);
+            write_time += t;
+            if (t > max_write) max_write = t;
+            written += ready;
+            writeouts++;
+        }
+    }
+    
+    cout << name << ": " << written << " events (" << gen.eventsGenerated() << " generated) from " << bytes/1048576.0 << " MiB" << endl;
+    cout << "\tdecode   " << bytes/1048576.0/decode_time << " MiB/s, " << written/decode_time << " events/s" << endl;
+    cout << "\twriteout " << written/write_time << " events/s, " << write_time/writeouts*1e3 << " ms mean, " << max_write*1e3 << " ms max latency" << endl;
+    cout << "\tstorage  " << sizes.logical/1048576.0 << " MiB as " << sizes.stored/1048576.0 << " MiB (ratio " << (double)sizes.logical/sizes.stored << "), " << sizes.logical/1048576.0/write_time << " MiB/s" << endl;
+    if (written != gen.eventsGenerated()) throw runtime_error(name + " decoded a different number of events than generated");
+}
+
+// Rewrites the waveforms of one card from a capture with its filters
+void recompress(const string &name, H5File &capture, const string &index, const output_filters &filters) {
+    if (H5Lexists(capture.getId(),index.c_str(),H5P_DEFAULT) <= 0) {
+        cout << name << ": not in capture" << endl;
+        return;
+    }
+    vector<string> paths;
+    H5Ovisit(capture.openGroup(index).getId(),H5_INDEX_NAME,H5_ITER_NATIVE,waveform_visit,&paths);
+    
+    FileAccPropList fapl;
+    fapl.setCore(1<<24,false);
+    H5File file("decoderbench.h5",H5F_ACC_TRUNC,FileCreatPropList::DEFAULT,fapl);
+    
+    storage_sizes sizes = {0, 0};
+    double write_time = 0.0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        DataSet dataset = capture.openDataSet(index+"/"+paths[i]);
+        DataSpace space = dataset.getSpace();
+        hsize_t dims[2] = {0, 0};
+        const int rank = space.getSimpleExtentDims(dims);
+        vector<uint16_t> data(space.getSimpleExtentNpoints());
+        if (data.size()) dataset.read(data.data(),PredType::NATIVE_UINT16);
+        
+        const string path = "/" + to_string(i);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        outputRows(file,path,PredType::NATIVE_UINT16,data.data(),dims[0],rank == 2 ? dims[1] : 0,0,&filters);
+        file.flush(H5F_SCOPE_GLOBAL);
+        write_time += elapsed(start);
+        
+        sizes.logical += data.size()*sizeof(uint16_t);
+        sizes.stored += file.openDataSet(path).getStorageSize();
+    }
+    
+    cout << name << ": " << paths.size() << " waveform datasets from capture" << endl;
+    cout << "\tstorage  " << sizes.logical/1048576.0 << " MiB as " << sizes.stored/1048576.0 << " MiB (ratio " << (double)sizes.logical/sizes.stored << "), " << sizes.logical/1048576.0/write_time << " MiB/s (" << (filters.nbit ? 1 : filters.threads) << " compression threads)" << endl;
+}
+
+// Sustained rate and append latency of one backend writing 4 MiB blocks
+static void iobench_one(const string &name, const bench_config &cfg, const vector<char> &block, function<void(const char*,size_t)> append, function<void()> finish) {
+    const size_t nblocks = max((size_t)1,(cfg.iosize<<20)/block.size());
+    vector<double> latency(nblocks);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (size_t i = 0; i < nblocks; i++) {
+        struct timespec append_start;
+        clock_gettime(CLOCK_MONOTONIC,&append_start);
+        append(block.data(),block.size());
+        latency[i] = elapsed(append_start);
+    }
+    finish(); //including the final sync
+    const double t = elapsed(start);
+    unlink(cfg.iopath.c_str());
+    
+    sort(latency.begin(),latency.end());
+    const double mib = nblocks*block.size()/1048576.0;
+    cout << name << ": " << mib << " MiB in " << t << " s (" << mib/t << " MiB/s)" << endl;
+    cout << "\tappend latency p50 " << latency[nblocks/2]*1e3 << " ms, p99 " << latency[nblocks*99/100]*1e3 << " ms, max " << latency.back()*1e3 << " ms" << endl;
+}
+
+// Compares the default and O_DIRECT backends for raw and HDF5 output
+void iobench(const bench_config &cfg) {
+    vector<char> block(4<<20);
+    srand(1);
+    for (size_t i = 0; i < block.size(); i++) block[i] = rand();
+    const size_t rowlen = 1024, rows = block.size()/(rowlen*sizeof(uint16_t));
+    
+    int fd = -1;
+    iobench_one("raw write()",cfg,block,[&](const char *data, size_t size) {
+        if (fd < 0 && (fd = open(cfg.iopath.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644)) < 0) throw runtime_error("Could not open " + cfg.iopath);
+        writeall(fd,data,size);
+    },[&]() {
+        fsync(fd);
+        close(fd);
+    });
+    
+    DirectFile *direct = NULL;
+    iobench_one("raw O_DIRECT",cfg,block,[&](const char *data, size_t size) {
+        if (!direct) {
+            direct = new DirectFile(cfg.iopath,cfg.iodepth);
+            if (!direct->isDirect()) cout << "\t(O_DIRECT refused, buffered)" << endl;
+            if (!direct->isUring()) cout << "\t(io_uring unavailable, pwrite)" << endl;
+        }
+        direct->write(data,size);
+    },[&]() {
+        direct->close();
+        delete direct;
+    });
+    
+    H5File *file = NULL;
+    iobench_one("HDF5 sec2",cfg,block,[&](const char *data, size_t size) {
+        if (!file) file = new H5File(cfg.iopath,H5F_ACC_TRUNC);
+        outputRows(*file,"/samples",PredType::NATIVE_UINT16,data,rows,rowlen,rows);
+    },[&]() {
+        delete file;
+        fd = open(cfg.iopath.c_str(),O_RDONLY);
+        fsync(fd);
+        close(fd);
+    });
+    
+    file = NULL;
+    core_image image;
+    iobench_one("HDF5 core+O_DIRECT",cfg,block,[&](const char *data, size_t size) {
+        if (!file) file = outputCoreFile(cfg.iopath,image);
+        outputRows(*file,"/samples",PredType::NATIVE_UINT16,data,rows,rowlen,rows);
+    },[&]() {
+        outputImage(*file,image,cfg.iodepth);
+        delete file;
+    });
+}
+
+int main(int argc, char **argv) {
+
+    bench_config cfg;
+    cfg.triggers = 100000;
+    cfg.batch = 100;
+    cfg.writeEvery = 1000;
+    cfg.iosize = 1024;
+    cfg.iodepth = 4;
+    
+    generator_config gcfg;
+    gcfg.rate = 1000.0;
+    gcfg.pulse_fraction = 0.5;
+    gcfg.pulse_height = 500.0;
+    gcfg.pad_fraction = 0.01;
+    gcfg.missed_fraction = 0.001;
+    gcfg.duplicate_fraction = 0.001;
+    gcfg.seed = 1;
+
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, ":n:b:w:r:p:a:P:m:d:s:c:R:D:M:q:")) != -1) {
+        switch (c) {
+            case 'n':
+                cfg.triggers = stoull(optarg);
+                break;
+            case 'b':
+                cfg.batch = stoull(optarg);
+                break;
+            case 'w':
+                cfg.writeEvery = stoull(optarg);
+                break;
+            case 'r':
+                gcfg.rate = stod(optarg);
+                break;
+            case 'p':
+                gcfg.pulse_fraction = stod(optarg);
+                break;
+            case 'a':
+                gcfg.pulse_height = stod(optarg);
+                break;
+            case 'P':
+                gcfg.pad_fraction = stod(optarg);
+                break;
+            case 'm':
+                gcfg.missed_fraction = stod(optarg);
+                break;
+            case 'd':
+                gcfg.duplicate_fraction = stod(optarg);
+                break;
+            case 's':
+                gcfg.seed = stoul(optarg);
+                break;
+            case 'c':
+                cfg.calibfname = string(optarg);
+                break;
+            case 'R':
+                cfg.capture = string(optarg);
+                break;
+            case 'D':
+                cfg.iopath = string(optarg);
+                break;
+            case 'M':
+                cfg.iosize = stoull(optarg);
+                break;
+            case 'q':
+                cfg.iodepth = stoull(optarg);
+                break;
+            case ':':
+                cout << "-" << (char)optopt << " requires an argument" << endl;
+                help();
+            case '?':
+                cout << "-" << (char)optopt << " is an unknown option" << endl;
+                help();
+            default:
+                cout << "Unexpected result from getopt" << endl;
+                help();
+        }
+    }
+    if ((argc - optind != 1 && cfg.iopath.empty()) || cfg.batch == 0) help();
+    
+    Exception::dontPrint();
+    
+    if (cfg.iopath.length()) {
+        iobench(cfg);
+        return 0;
+    }
+    
+    RunDB db;
+    db.addFile(argv[optind]);
+    
+    if (cfg.capture.length()) {
+        H5File capture(cfg.capture,H5F_ACC_RDONLY);
+        vector<RunTable> v1730s = db.getGroup("V1730");
+        for (size_t i = 0; i < v1730s.size(); i++) {
+            V1730Settings settings(v1730s[i],db);
+            recompress("V1730 " + settings.getIndex(),capture,settings.getIndex(),settings.getFilters());
+        }
+        vector<RunTable> v1742s = db.getGroup("V1742");
+        for (size_t i = 0; i < v1742s.size(); i++) {
+            V1742Settings settings(v1742s[i],db);
+            recompress("V1742 " + settings.getIndex(),capture,settings.getIndex(),settings.getFilters());
+        }
+        return 0;
+    }
+    
+    //room for a batch of duplicated triggers past a writeout
+    const size_t eventBuffer = cfg.writeEvery + 2*cfg.batch;
+    
+    vector<RunTable> v1730s = db.getGroup("V1730");
+    for (size_t i = 0; i < v1730s.size(); i++) {
+        V1730Settings settings(v1730s[i],db);
+        V1730Generator gen(gcfg,settings);
+        V1730Decoder dec(eventBuffer,settings);
+        Buffer buffer(64*1024*1024);
+        bench("V1730 " + settings.getIndex(),gen,dec,buffer,cfg);
+    }
+    
+    vector<RunTable> v1742s = db.getGroup("V1742");
+    for (size_t i = 0; i < v1742s.size(); i++) {
+        V1742Settings settings(v1742s[i],db);
+        V1742calib *calib = NULL;
+        if (cfg.calibfname.length()) {
+            CalibFile file(cfg.calibfname);
+            if (!file.hasTables(settings.sampleFreq())) throw runtime_error("No calibration for this sample rate in " + cfg.calibfname);
+            calib = new V1742calib(file.tables(settings.sampleFreq()));
+        }
+        {
+            V1742Generator gen(gcfg,settings);
+            V1742Decoder dec(eventBuffer,calib,settings);
+            Buffer buffer(64*1024*1024);
+            bench("V1742 " + settings.getIndex(),gen,dec,buffer,cfg);
+        }
+        if (calib) delete calib;
+    }
+    
+    return 0;
+}
@@ -11,6 +11,7 @@
 #include <getopt.h>
 #include <sstream>
 #include <json.hh>
+#include <CalibFile.hh>
 
 using namespace std;
 using namespace H5;
@@ -114,7 +115,7 @@ typedef struct {
 
 [[noreturn]] void help() {
     cout << "./spe [groups] prefix" << endl;
-    cout << "\t-T --timecorr filename  specify a json file with V1742 (fast) time calibration" << endl;
+    cout << "\t-T --timecorr filename  specify a binary or json file from v1742calib with V1742 (fast) time calibration" << endl;
     cout << "\t-o --outfile filename   specify a filename other than ${prefix}.int.h5" << endl;
     cout << "\t-S --skim file          specify a skim file to use instead of an event map" << endl;
     cout << "\t-m --master group       start a group for the master card" << endl;
@@ -353,7 +354,34 @@ int main(int argc, char **argv) {
         data[i].start_index = NULL;
     }
     
-    if (tcorrfname.length() > 0) {
+    if (tcorrfname.length() > 0 && isCalibFile(tcorrfname)) {
+        CalibFile calib(tcorrfname);
+        for (size_t i = 0; i < specs.size(); i++) {
+            if (specs[i]->type == FAST) {
+                size_t freq;
+                switch ((int)round(specs[i]->ps_sample)) {
+                    case 200:
+                        freq = 0;
+                        break;
+                    case 400:
+                        freq = 1;
+                        break;
+                    case 1000:
+                        freq = 2;
+                        break;
+                    default:
+                        cout << "Unknown sample rate.";
+                        exit(1);
+                }
+                if (!calib.hasTables(freq)) {
+                    cout << "No time calibration for this sample rate in " << tcorrfname << endl;
+                    exit(1);
+                }
+                const float *delays = calib.tables(freq).time[specs[i]->grnum];
+                specs[i]->group_cell_delays.assign(delays,delays+1024);
+            }
+        }
+    } else if (tcorrfname.length() > 0) {
         ifstream calibfile(tcorrfname);
         json::Reader reader(calibfile);
         json::Value calib;
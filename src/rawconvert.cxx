@@ -0,0 +1,371 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  WbLSdaq is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  WbLSdaq is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with WbLSdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+ 
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+#include <stdexcept>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "RunDB.hh"
+#include "Buffer.hh"
+#include "RawFile.hh"
+#include "CalibFile.hh"
+#include "EventBuilder.hh"
+#include "V1730_dpppsd.hh"
+#include "V1742.hh"
+
+using namespace std;
+using namespace H5;
+
+typedef struct {
+    size_t threads; // segments decoded at once
+    size_t segment; // raw bytes per segment
+    string calibfname; // optional V1742 calibration file
+} convert_config;
+
+// A digitizer from the run config and how to decode its raw file
+typedef struct {
+    string index;
+    bool per_channel; // index entries are per channel rather than per trigger
+    function<Decoder*(size_t)> make; // decoder with room for some events
+} raw_card;
+
+// A span of a raw file that starts on an aggregate boundary
+typedef struct {
+    size_t start, end; // bytes in the raw file
+    size_t events; // most events of any channel in the span, the same on all but the last
+    Decoder *decoder;
+    string error;
+} segment;
+
+typedef struct {
+    vector<segment> *segments;
+    size_t first, stride;
+    int fd;
+    const raw_card *card;
+} segment_thread_data;
+
+[[noreturn]] void help() {
+    cout << "rawconvert decodes raw readout recorded by WbLSdaq with raw: true into" << endl;
+    cout << "the HDF5 layout WbLSdaq writes, decoding segments of each card's raw" << endl;
+    cout << "file in parallel. Each run.h5 is converted to run.decoded.h5." << endl;
+    cout << "./rawconvert [options] run.h5 [run.h5 ...]" << endl;
+    cout << "\t-j threads    segments to decode at once [online CPUs]" << endl;
+    cout << "\t-s MiB        raw MiB per segment [16]" << endl;
+    cout << "\t-c file       V1742 calibration file from v1742calib" << endl;
+    cout << "\t              (default: the run's calib_cache, if set, by V1742 serial)" << endl;
+    exit(1);
+}
+
+static inline double elapsed(struct timespec &start) {
+    struct timespec cur;
+    clock_gettime(CLOCK_MONOTONIC,&cur);
+    return (cur.tv_sec - start.tv_sec)+1e-9*(cur.tv_nsec - start.tv_nsec);
+}
+
+static string readConfig(const string &fname) {
+    H5File file(fname,H5F_ACC_RDONLY);
+    Attribute attr = file.openGroup("/").openAttribute("run_config");
+    StrType type = attr.getStrType();
+    string config;
+    attr.read(type,config);
+    return config;
+}
+
+// Splits a raw file at the first aggregate past every segbytes where every
+// channel has the same number of events in the segment, since each segment
+// is decoded on its own and only events complete on all channels are written
+static void splitSegments(const vector<raw_index_entry> &entries, size_t bytes, size_t segbytes, bool per_channel, vector<segment> &segments) {
+    segment seg;
+    seg.start = 0;
+    seg.decoder = NULL;
+    map<uint16_t,size_t> counts;
+    for (size_t i = 0; i < entries.size(); i++) counts[per_channel ? entries[i].channel : 0] = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const size_t agg = entries[i].aggregate;
+        if (agg > seg.start && agg - seg.start >= segbytes && (i == 0 || agg != entries[i-1].aggregate)) {
+            bool balanced = true;
+            for (map<uint16_t,size_t>::iterator it = counts.begin(); it != counts.end(); it++) {
+                balanced &= it->second == counts.begin()->second;
+            }
+            if (balanced) {
+                seg.end = agg;
+                seg.events = counts.begin()->second;
+                segments.push_back(seg);
+                for (map<uint16_t,size_t>::iterator it = counts.begin(); it != counts.end(); it++) it->second = 0;
+                seg.start = agg;
+            }
+        }
+        counts[per_channel ? entries[i].channel : 0]++;
+    }
+    seg.end = bytes;
+    seg.events = 0;
+    for (map<uint16_t,size_t>::iterator it = counts.begin(); it != counts.end(); it++) {
+        if (it->second > seg.events) seg.events = it->second;
+    }
+    if (seg.end > seg.start) segments.push_back(seg);
+}
+
+static void* segment_thread(void *_data) {
+    segment_thread_data *data = (segment_thread_data*)_data;
+    vector<segment> &segments = *data->segments;
+    for (size_t i = data->first; i < segments.size(); i += data->stride) {
+        segment &seg = segments[i];
+        try {
+            const size_t size = seg.end - seg.start;
+            Buffer buffer(size);
+            for (size_t done = 0; done < size; ) {
+                ssize_t res = pread(data->fd,buffer.wptr(),size-done,seg.start+done);
+                if (res <= 0) throw runtime_error("Could not read raw file");
+                buffer.inc(res);
+                done += res;
+            }
+            seg.decoder = data->card->make(seg.events);
+            seg.decoder->decode(buffer);
+        } catch (runtime_error &e) {
+            seg.error = e.what();
+        }
+    }
+    return NULL;
+}
+
+// Decodes one card's raw file into file, keeping LVDS patterns if asked
+void convert(const string &base, const raw_card &card, H5File &file, const convert_config &cfg, vector<uint16_t> *patterns) {
+    const string rawname = base + "." + card.index + ".raw", idxname = base + "." + card.index + ".idx";
+    int fd = open(rawname.c_str(),O_RDONLY);
+    if (fd < 0) throw runtime_error("Could not open " + rawname);
+    const size_t bytes = lseek(fd,0,SEEK_END);
+    
+    ifstream idx(idxname,ios::binary);
+    if (!idx.is_open()) throw runtime_error("Could not open " + idxname);
+    idx.seekg(0,ios::end);
+    vector<raw_index_entry> entries(idx.tellg()/sizeof(raw_index_entry));
+    idx.seekg(0,ios::beg);
+    idx.read((char*)entries.data(),entries.size()*sizeof(raw_index_entry));
+    
+    vector<segment> segments;
+    splitSegments(entries,bytes,cfg.segment,card.per_channel,segments);
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    streambuf *out = cout.rdbuf();
+    size_t events = 0;
+    
+    //decode a round of segments in parallel, then write them in order
+    for (size_t first = 0; first < segments.size(); first += cfg.threads) {
+        vector<segment> round(segments.begin()+first,segments.begin()+min(first+cfg.threads,segments.size()));
+        vector<pthread_t> threads(round.size());
+        vector<segment_thread_data> threaddata(round.size());
+        cout.rdbuf(NULL); //decoders report every buffer
+        for (size_t t = 0; t < round.size(); t++) {
+            threaddata[t].segments = &round;
+            threaddata[t].first = t;
+            threaddata[t].stride = round.size();
+            threaddata[t].fd = fd;
+            threaddata[t].card = &card;
+            if (pthread_create(&threads[t],NULL,&segment_thread,&threaddata[t])) throw runtime_error("Could not start decode thread");
+        }
+        for (size_t t = 0; t < round.size(); t++) {
+            pthread_join(threads[t],NULL);
+        }
+        
+        string error;
+        for (size_t t = 0; t < round.size(); t++) {
+            Decoder *dec = round[t].decoder;
+            if (error.empty() && round[t].error.size()) error = round[t].error;
+            if (error.empty()) {
+                //only the last segment can end with events missing from
+                //some channels, which the run never wrote out either
+                const size_t ready = dec->eventsReady();
+                if (ready != round[t].events) {
+                    if (first+t+1 < segments.size()) {
+                        error = "segment at " + to_string(round[t].start) + " decoded " + to_string(ready) + " of " + to_string(round[t].events) + " indexed events";
+                        delete dec;
+                        continue;
+                    }
+                    cout.rdbuf(out);
+                    cout << card.index << ": dropping " << round[t].events-ready << " events at the end of the run not seen on every channel" << endl;
+                    cout.rdbuf(NULL);
+                }
+                if (patterns) {
+                    vector<uint16_t> segpatterns;
+                    dec->getPatterns(ready,segpatterns);
+                    patterns->insert(patterns->end(),segpatterns.begin(),segpatterns.end());
+                }
+                dec->writeOut(file,ready);
+                events += ready;
+            }
+            if (dec) delete dec;
+        }
+        cout.rdbuf(out);
+        if (error.size()) {
+            close(fd);
+            throw runtime_error(card.index + ": " + error);
+        }
+    }
+    close(fd);
+    
+    const double t = elapsed(start);
+    cout << card.index << ": " << events << " events from " << bytes/1048576.0 << " MiB in " << segments.size() << " segments, " << t << " s (" << bytes/1048576.0/t << " MiB/s)" << endl;
+}
+
+int main(int argc, char **argv) {
+
+    convert_config cfg;
+    cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg.segment = 16;
+    
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, ":j:s:c:")) != -1) {
+        switch (c) {
+            case 'j':
+                cfg.threads = stoull(optarg);
+                break;
+            case 's':
+                cfg.segment = stoull(optarg);
+                break;
+            case 'c':
+                cfg.calibfname = string(optarg);
+                break;
+            case ':':
+                cout << "-" << (char)optopt << " requires an argument" << endl;
+                help();
+            case '?':
+                cout << "-" << (char)optopt << " is an unknown option" << endl;
+                help();
+            default:
+                cout << "Unexpected result from getopt" << endl;
+                help();
+        }
+    }
+    if (argc - optind < 1 || cfg.threads == 0 || cfg.segment == 0) help();
+    cfg.segment *= 1024*1024;
+    
+    Exception::dontPrint();
+    
+    //every file of a run has the same config, so the first one sets it up
+    RunDB db;
+    db.addString(readConfig(argv[optind]));
+    RunTable run = db.getTable("RUN");
+    const size_t chunk = run.isMember("chunk_events") && run["chunk_events"].cast<int>() ? run["chunk_events"].cast<int>() : 1000;
+    
+    //cards in the order WbLSdaq sets them up
+    vector<raw_card> cards;
+    vector<RunTable> v1730s = db.getGroup("V1730");
+    for (size_t i = 0; i < v1730s.size(); i++) {
+        V1730Settings *settings = new V1730Settings(v1730s[i],db);
+        settings->roundRecordLengths();
+        raw_card card;
+        card.index = settings->getIndex();
+        card.per_channel = true;
+        card.make = [settings,chunk](size_t events) {
+            Decoder *dec = new V1730Decoder(events,*settings);
+            dec->setChunking(chunk);
+            return dec;
+        };
+        cards.push_back(card);
+    }
+    
+    const string calib_cache = run.isMember("calib_cache") ? run["calib_cache"].cast<string>() : "";
+    vector<RunTable> v1742s = db.getGroup("V1742");
+    vector<V1742calib*> calibs; //shared by every segment of a card
+    for (size_t i = 0; i < v1742s.size(); i++) {
+        V1742Settings *settings = new V1742Settings(v1742s[i],db);
+        V1742calib *calib = NULL;
+        if (cfg.calibfname.length()) {
+            CalibFile file(cfg.calibfname);
+            if (!file.hasTables(settings->sampleFreq())) throw runtime_error("No calibration for this sample rate in " + cfg.calibfname);
+            calib = new V1742calib(file.tables(settings->sampleFreq()));
+        } else if (v1742s[i].isMember("serial") && calib_cache.size()) {
+            //only ever the cached table for the serial, never the board
+            const string cached = calibFileName(calib_cache,v1742s[i]["serial"].cast<int>(),settings->sampleFreq());
+            if (!access(cached.c_str(),R_OK)) {
+                CalibFile file(cached);
+                if (file.hasTables(settings->sampleFreq())) calib = new V1742calib(file.tables(settings->sampleFreq()));
+            }
+        }
+        if (calib) {
+            calibs.push_back(calib);
+            if (v1742s[i].isMember("calib_threads")) calib->setThreads(v1742s[i]["calib_threads"].cast<int>());
+        } else {
+            cout << "No calibration for V1742 " << settings->getIndex() << ", writing uncalibrated samples" << endl;
+        }
+        raw_card card;
+        card.index = settings->getIndex();
+        card.per_channel = false;
+        card.make = [settings,calib,chunk](size_t events) {
+            Decoder *dec = new V1742Decoder(events,calib,*settings);
+            dec->setChunking(chunk);
+            return dec;
+        };
+        cards.push_back(card);
+    }
+    
+    EventBuilder *builder = NULL;
+    if (run.isMember("event_builder")) {
+        vector<string> names = run["event_builder"].toVector<string>();
+        if (names.size() != 2) throw runtime_error("event_builder expects two card indexes");
+        const uint16_t test_mask = run.isMember("event_test_mask") ? run["event_test_mask"].cast<int>() : 0xFF;
+        const uint16_t comp_mask = run.isMember("event_comp_mask") ? run["event_comp_mask"].cast<int>() : 0x0F;
+        const size_t max_offset = run.isMember("event_max_offset") ? run["event_max_offset"].cast<int>() : 8;
+        builder = new EventBuilder(names[0],names[1],test_mask,comp_mask,max_offset);
+    }
+    
+    for (int arg = optind; arg < argc; arg++) {
+        const string fname = argv[arg];
+        if (fname.size() < 3 || fname.compare(fname.size()-3,3,".h5") != 0) help();
+        const string base = fname.substr(0,fname.size()-3), outname = base + ".decoded.h5";
+        cout << "Converting " << fname << " to " << outname << endl;
+        
+        //starts from the run metadata written beside the raw files
+        {
+            ifstream in(fname,ios::binary);
+            ofstream copy(outname,ios::binary|ios::trunc);
+            copy << in.rdbuf();
+            if (!copy.good()) throw runtime_error("Could not write " + outname);
+        }
+        H5File file(outname,H5F_ACC_RDWR);
+        
+        vector<uint16_t> master_patterns, fast_patterns;
+        for (size_t i = 0; i < cards.size(); i++) {
+            vector<uint16_t> *patterns = NULL;
+            if (builder && cards[i].index == builder->getMaster()) patterns = &master_patterns;
+            if (builder && cards[i].index == builder->getFast()) patterns = &fast_patterns;
+            convert(base,cards[i],file,cfg,patterns);
+        }
+        
+        if (builder) {
+            builder->build(arg-optind,master_patterns,fast_patterns);
+            if (arg == argc-1) builder->flush();
+            OutputBatch batch;
+            builder->writeOut(batch,chunk);
+            batch.write(file);
+        }
+    }
+    
+    for (size_t i = 0; i < calibs.size(); i++) delete calibs[i];
+    
+    return 0;
+}
@@ -5,7 +5,10 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <cstring>
+#include <ctime>
 
+#include "CalibFile.hh"
 #include "json.hh"
 
 using namespace std;
@@ -40,7 +43,7 @@ json::Value to_json(CAEN_DGTZ_DRS4Correction_t *dat) {
 
 int main(int argc, char **argv) {
     if (argc != 3) {
-        cout << "Usage: ./v1742calib base_addr output.json\n\tbase_addr is vme base in hex; output.json stores the calib data\n";
+        cout << "Usage: ./v1742calib base_addr output\n\tbase_addr is vme base in hex; output stores the calib data\n\tas JSON if it ends in .json, otherwise in the binary calibration format\n";
         return 1;
     }
 
@@ -54,38 +57,55 @@ int main(int argc, char **argv) {
     ss << std::hex << argv[1];
     ss >> baseaddr;
     
-    json::Value card(json::TOBJECT);
+    const string outname = argv[2];
+    const bool as_json = outname.size() >= 5 && outname.substr(outname.size()-5) == ".json";
     
     cout << "Opening dgtz" << endl;
     res = CAEN_DGTZ_OpenDigitizer(CAEN_DGTZ_USB, linknum, 0, (int)baseaddr, &handle);
     if (res != 0) throw runtime_error("Open");
     
-    CAEN_DGTZ_DRS4Correction_t corr[4];
+    CAEN_DGTZ_BoardInfo_t info;
+    res = CAEN_DGTZ_GetInfo(handle,&info);
+    if (res != 0) throw runtime_error("Info");
+    
+    //indexed as V1742SampleFreq
+    CAEN_DGTZ_DRS4Correction_t corr[3][4];
     
     cout << "Reading 1GHz" << endl;
-    res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_1GHz,&corr);
+    res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_1GHz,&corr[2]);
     if (res != 0) throw runtime_error("1GHz");
-    card["1GHz"] = to_json(corr);
     
     cout << "Reading 2.5GHz" << endl;
-    res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_2_5GHz,&corr);
+    res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_2_5GHz,&corr[1]);
     if (res != 0) throw runtime_error("2.5GHz");
-    card["2.5GHz"] = to_json(corr);
     
     cout << "Reading 5GHz" << endl;
-    res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_5GHz,&corr);
+    res = CAEN_DGTZ_GetCorrectionTables(handle,CAEN_DGTZ_DRS4_5GHz,&corr[0]);
     if (res != 0) throw runtime_error("5GHz");
-    card["5GHz"] = to_json(corr);
     
     cout << "Closing dgtz" << endl;
     res = CAEN_DGTZ_CloseDigitizer(handle);
     if (res != 0) throw runtime_error("Close");
     
-    ofstream file(argv[2]);
-    json::Writer out(file);
-    card["name"] = string("CALIB");
-    card["index"] = string("fast");
-    out.putValue(card);
+    if (as_json) {
+        json::Value card(json::TOBJECT);
+        card["1GHz"] = to_json(corr[2]);
+        card["2.5GHz"] = to_json(corr[1]);
+        card["5GHz"] = to_json(corr[0]);
+        ofstream file(outname);
+        json::Writer out(file);
+        card["name"] = string("CALIB");
+        card["index"] = string("fast");
+        out.putValue(card);
+    } else {
+        calib_file_header header;
+        header.serial = info.SerialNumber;
+        strncpy(header.roc_firmware,info.ROC_FirmwareRel,sizeof(header.roc_firmware));
+        strncpy(header.amc_firmware,info.AMC_FirmwareRel,sizeof(header.amc_firmware));
+        header.created = time(NULL);
+        CAEN_DGTZ_DRS4Correction_t *tables[3] = {corr[0], corr[1], corr[2]};
+        CalibFile::write(outname,header,tables);
+    }
     
     cout << "Calibration written" << endl;
     return 0;